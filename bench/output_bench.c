@@ -0,0 +1,119 @@
+/*
+ * Output throughput into a pipe: plain putchar() against the VM's
+ * OutputBuffer copying with write(2) and splicing pages with vmsplice(2).
+ * A child process drains the pipe with read(2) in every case.
+ *
+ *   make bench
+ *   ./bench/output_bench [megabytes]
+ */
+#include "vm.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+typedef enum { MODE_PUTCHAR, MODE_WRITE, MODE_VMSPLICE } BenchMode;
+
+static OutputBuffer g_bench_out;
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Forks a child that reads the pipe until EOF. Returns its pid and
+ * the pipe's write end, or -1.
+ */
+static pid_t start_drain(int *write_fd)
+{
+	int fds[2];
+	if (pipe(fds) != 0) {
+		perror("pipe");
+		return -1;
+	}
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		static uint8_t sink[1 << 20];
+		close(fds[1]);
+		while (read(fds[0], sink, sizeof(sink)) > 0)
+			;
+		_exit(0);
+	}
+	close(fds[0]);
+	*write_fd = fds[1];
+	return pid;
+}
+
+/**
+ * @brief Writes `bytes` bytes of a repeating pattern into a drained pipe.
+ * Returns the elapsed time in seconds, or a negative value on failure.
+ */
+static double run_mode(BenchMode mode, size_t bytes, bool *spliced)
+{
+	int fd;
+	pid_t pid = start_drain(&fd);
+	if (pid < 0)
+		return -1.0;
+
+	// putchar writes to fd 1, so point stdout at the pipe for the run
+	fflush(stdout);
+	int saved_stdout = dup(1);
+	dup2(fd, 1);
+	close(fd);
+
+	*spliced = false;
+	double begin = now_seconds();
+	if (mode == MODE_PUTCHAR) {
+		for (size_t i = 0; i < bytes; ++i)
+			putchar('a' + (int)(i % 26));
+		fflush(stdout);
+	} else {
+		OutputBuffer_init(&g_bench_out, 1, FLUSH_FULL);
+		if (mode == MODE_WRITE)
+			g_bench_out.splice = false;
+		*spliced = g_bench_out.splice;
+		for (size_t i = 0; i < bytes; ++i)
+			OutputBuffer_put(&g_bench_out,
+					 (uint8_t)('a' + (int)(i % 26)));
+		OutputBuffer_flush(&g_bench_out);
+	}
+
+	// Closing the last write end lets the child see EOF
+	dup2(saved_stdout, 1);
+	close(saved_stdout);
+	waitpid(pid, NULL, 0);
+	return now_seconds() - begin;
+}
+
+int main(int argc, const char *argv[])
+{
+	size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 256;
+	if (megabytes == 0) {
+		fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+		return -1;
+	}
+	size_t bytes = megabytes << 20;
+
+	static const char *names[] = { "putchar", "write", "vmsplice" };
+	for (int mode = MODE_PUTCHAR; mode <= MODE_VMSPLICE; ++mode) {
+		bool spliced;
+		double seconds = run_mode((BenchMode)mode, bytes, &spliced);
+		if (seconds < 0)
+			return -1;
+		fprintf(stderr, "%-9s %6zu MiB %8.3fs %9.1f MiB/s%s\n",
+			names[mode], megabytes, seconds,
+			(double)megabytes / seconds,
+			mode == MODE_VMSPLICE && !spliced ?
+				" (vmsplice unavailable, copied)" :
+				"");
+	}
+	return 0;
+}
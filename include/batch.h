@@ -0,0 +1,62 @@
+#ifndef BF_BATCH_H
+#define BF_BATCH_H
+
+#include "jit.h"
+
+/*
+ * @brief One execution of the batch program.
+ * const char *input: file read as the program's input.
+ * char *output: file its output is written to (created or truncated).
+ * The rest is filled in by batch_run().
+ */
+typedef struct {
+	const char *input;
+	char *output;
+	bool ok;
+	double seconds; // latency from opening the input to closing the output
+	size_t bytes_in;
+	size_t bytes_out;
+} BatchJob;
+
+/*
+ * @brief Batch settings.
+ * size_t threads: worker count; 0 means one per online core.
+ * EofPolicy eof: what ',' stores at the end of each job's input.
+ * VmLimits limits: fuel and timeout for each job on its own.
+ * bool tape_left: start each job in the middle of its tape (BfVm.tape_left).
+ */
+typedef struct {
+	size_t threads;
+	EofPolicy eof;
+	VmLimits limits;
+	bool tape_left;
+} BatchOptions;
+
+/*
+ * @brief What batch_run() measured as a whole.
+ */
+typedef struct {
+	size_t threads;
+	size_t steals; // jobs a worker took from another worker's deque
+	double seconds; // wall time from starting the pool to the last job
+} BatchStats;
+
+/**
+ * @brief Runs `program` once per job on a pool of worker threads.
+ * Jobs are dealt out in contiguous blocks to per-worker work-stealing
+ * deques: a worker pops from the bottom of its own deque and, once that is
+ * empty, steals from the top of the others'. Each worker owns a BfVm, so
+ * every execution gets a private tape and input and output buffers.
+ * Returns false if the pool could not be started; a job that fails (for
+ * example, an unreadable input) only clears its own `ok`.
+ */
+bool batch_run(const JitRegion *program, BatchJob *jobs, size_t job_count,
+	       const BatchOptions *options, BatchStats *stats);
+
+/**
+ * @brief Prints aggregate throughput and the per-job latency distribution.
+ */
+void batch_report(const BatchJob *jobs, size_t job_count,
+		  const BatchStats *stats, FILE *out);
+
+#endif // BF_BATCH_H
@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include <errno.h>
 #include <time.h>
+#include <inttypes.h>
 
 typedef enum {
 	op_add, // +
@@ -21,16 +22,45 @@ typedef enum {
 	op_clear, // [-]
 	op_def_lambda, // ( - Define a lambda
 	op_ret, // ) - Return from lambda
-	op_call // ! - Call last-defined lambda
+	op_call, // ! - Call last-defined lambda
+	op_mul, // [->+<] - Add p[src] * num to p[offset]
+	op_scanr, // [>] - Move right by num until p[0] == 0
+	op_scanl, // [<] - Move left by num until p[0] == 0
+	op_set // [-]+++ - Store num into p[offset]
 } optype_t;
 
 typedef struct {
 	optype_t op;
 	uint32_t num;
+	int32_t offset; // Displacement of the cell this op touches, from p
+	int32_t src; // op_mul: displacement of the multiplier cell
 } opcode;
 
+/*
+ * Width of a tape cell (--cell), as log2 of its size in bytes, so the
+ * zero value is the classic byte cell. Cell arithmetic wraps at the width;
+ * ',' and '.' still move bytes.
+ */
+typedef enum {
+	CELL_8,
+	CELL_16,
+	CELL_32,
+} CellWidth;
+
+static inline size_t CellWidth_bytes(CellWidth cell)
+{
+	return (size_t)1 << cell;
+}
+
+/* The largest value a cell holds: 0xff, 0xffff or 0xffffffff. */
+static inline uint32_t CellWidth_mask(CellWidth cell)
+{
+	return (uint32_t)(((uint64_t)1 << (8 << cell)) - 1);
+}
+
 // full forward declarations for key data structures are in util.h)
 struct OpcodeVector;
+struct BfVm;
 struct SizeTStack;
 
 #endif // BRAINFORK_H
@@ -8,9 +8,32 @@
  */
 bool scanner(const char *s, OpcodeVector *out_code);
 
+#define OPTIMIZE_MAX_LEVEL 3
+
+/**
+ * @brief Selects which optimizer passes run.
+ * int level: 0 runs no passes, 1 folds loops, 2 also folds pointer moves
+ *            into offsets, 3 also combines cell arithmetic.
+ * bool time_passes: print each pass's time and op count to stderr.
+ * CellWidth cell: the width cell arithmetic wraps at; the code must run
+ *                 with the same width.
+ */
+typedef struct {
+	int level;
+	bool time_passes;
+	CellWidth cell;
+} OptimizeOptions;
+
 /**
- * @brief Performs peephole optimizations on an OpcodeVector.
+ * @brief Performs peephole optimizations on an OpcodeVector at the highest
+ * optimization level.
  */
 bool optimize(const OpcodeVector *in_code, OpcodeVector *out_code);
 
+/**
+ * @brief Runs the optimizer pass pipeline selected by `options`.
+ */
+bool optimize_with(const OpcodeVector *in_code, OpcodeVector *out_code,
+		   const OptimizeOptions *options);
+
 #endif // BF_COMPILER_H
@@ -2,11 +2,61 @@
 #define BF_JIT_H
 
 #include "util.h"
+#include "vm.h"
+#include "jit_common.h"
 
 /**
- * @brief Executes an OpcodeVector using the JIT compiler.
+ * @brief A standalone piece of native code for a range of opcodes.
+ * JitBuffer buffer: the executable memory holding it; buffer.cell is the
+ * cell width it was compiled for.
+ * JitRegionFn entry: call with the data pointer and the VM; returns the
+ * final data pointer.
+ */
+typedef struct {
+	JitBuffer buffer;
+	JitRegionFn entry;
+} JitRegion;
+
+/**
+ * @brief Executes an OpcodeVector on `vm` using the JIT compiler: compiles
+ * it with jit_compile() for the VM's cell width, runs it once and frees it.
+ */
+VmStatus jit_run(BfVm *vm, const OpcodeVector *code);
+
+/**
+ * @brief Compiles a whole program once into `out`, for cells of width
+ * `cell` (which the optimizer must have assumed as well).
  * * This function dispatches to the correct architecture-specific backend.
+ * The code takes the tape and the VM as arguments and is read-only once
+ * built, so any number of threads may run it at the same time with
+ * jit_execute(), each on its own BfVm. Free it with JitRegion_free().
+ */
+bool jit_compile(const OpcodeVector *code, CellWidth cell, JitRegion *out);
+
+/**
+ * @brief Runs a program built by jit_compile() on `vm` under its limits:
+ * sets the VM's cell width to the program's, resets its tape and stacks,
+ * runs from the first op and flushes the VM's output. A run that exhausts
+ * its fuel or time unwinds out of the native code at the next back-edge or
+ * lambda entry; one that moves the pointer off the tape unwinds from the
+ * faulting access.
+ */
+VmStatus jit_execute(const JitRegion *program, BfVm *vm);
+
+/**
+ * @brief Compiles opcodes [start_pc, end_pc) of `code` into `out`.
+ * The range must be self-contained: every jump inside it targets an op in
+ * [start_pc, end_pc]. Safe to call from a thread other than the one that
+ * runs the result. The code cache is reserved in proportion to the range,
+ * and a failure is not reported: it is best-effort, and the caller goes
+ * on interpreting the range.
+ */
+bool jit_compile_region(const OpcodeVector *code, size_t start_pc,
+			size_t end_pc, CellWidth cell, JitRegion *out);
+
+/**
+ * @brief Releases the memory of a region compiled by jit_compile_region().
  */
-bool jit(const OpcodeVector *code);
+void JitRegion_free(JitRegion *region);
 
 #endif // BF_JIT_H
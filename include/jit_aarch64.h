@@ -2,11 +2,15 @@
 #define JIT_AARCH64_H
 
 #include "util.h"
+#include "jit_common.h"
+#include "vm.h"
 
-/*
- * @brief Just compiles and executes the OpcodeVector using the ARM JIT (which
- * in of itself is just a translation of the X86 JIT).
+/**
+ * @brief Compiles opcodes [start_pc, end_pc) into a standalone function
+ * and makes it executable. `jit` must be freshly created with one address
+ * slot per opcode in `code` (plus one). Returns NULL on failure.
  */
-bool jit_exec_aarch64(const OpcodeVector *code);
+JitRegionFn jit_compile_region_aarch64(JitBuffer *jit, const OpcodeVector *code,
+				       size_t start_pc, size_t end_pc);
 
 #endif // JIT_AARCH64_H
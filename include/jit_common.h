@@ -16,23 +16,76 @@ typedef struct {
 	uint8_t jump_type; // 0 = JE, 1 = JNE (or other backend-specific types)
 } JumpPatch;
 
+/*
+ * Address space reserved for a whole program's JitBuffer. Only the pages
+ * the code actually uses are committed, on huge pages where the kernel
+ * offers them. Kept well under 2 GiB so rel32 jumps and calls always
+ * reach.
+ */
+#define JIT_RESERVE_BYTES ((size_t)1 << 30)
+
 typedef struct JitBuffer {
 	uint8_t *buffer; // The executable memory buffer
-	size_t capacity; // Total allocated size of buffer
+	size_t capacity; // Committed (usable) size of buffer
+	size_t reserved; // Reserved address space; capacity grows up to this
 	size_t size; // Current size of generated code
 
-	size_t *opcode_addresses; // Map: opcode_index -> buffer_offset
+	// Map: opcode_index - opcode_base -> buffer_offset, for the ops of
+	// the compiled range and the end of it
+	size_t *opcode_addresses;
+	size_t opcode_base;
 	size_t opcode_count;
 
 	JumpPatch *jump_patches;
 	size_t jump_patch_count;
 	size_t jump_patch_capacity;
+
+	// Per target opcode: the branch to it fits a short encoding. Only
+	// used by backends that relax branches (x86-64); NULL otherwise.
+	bool *short_branch;
+
+	// Fuel checks whose out-of-line stubs are not emitted yet: the offset
+	// of each check's branch. A function emits the stubs for the checks
+	// it pushed after its epilogue, so a nested lambda only sees its own.
+	size_t *fuel_sites;
+	size_t fuel_site_count;
+	size_t fuel_site_capacity;
+	size_t fuel_trap; // Offset of the routine the stubs call
+	// Offsets of the stops lambda ops branch to: each sets vm->status and
+	// unwinds the run from the trap routine's tail
+	size_t stack_overflow;
+	size_t no_lambda;
+
+	CellWidth cell; // Width of the cells the code operates on
+	// Failures are not reported on stderr. Set before JitBuffer_create()
+	// for best-effort compiles whose caller has a fallback.
+	bool quiet;
 } JitBuffer;
 
-bool JitBuffer_create(JitBuffer *jit, size_t capacity, size_t num_opcodes);
+/**
+ * @brief A compiled region of opcodes: runs them on `vm` with `p` as the
+ * data pointer and returns the data pointer it finished on.
+ */
+typedef uint8_t *(*JitRegionFn)(uint8_t *p, struct BfVm *vm);
+
+/**
+ * @brief Reserves `reserve` bytes of address space for a code cache and
+ * commits its first `capacity` bytes. Pushing past the committed size
+ * commits more pages (doubling), up to the reservation; the buffer never
+ * moves. Addresses are recorded for ops `first_opcode` ..
+ * `first_opcode + num_opcodes - 1`.
+ */
+bool JitBuffer_create(JitBuffer *jit, size_t capacity, size_t reserve,
+		      size_t first_opcode, size_t num_opcodes);
 void JitBuffer_destroy(JitBuffer *jit);
 bool JitBuffer_exec(JitBuffer *jit);
 
+/**
+ * @brief Patches jumps and turns the buffer read-only and executable. After
+ * this nothing writes to the code, so threads may run it concurrently.
+ */
+bool JitBuffer_seal(JitBuffer *jit);
+
 bool JitBuffer_push_bytes(JitBuffer *jit, const uint8_t *bytes, size_t count);
 bool JitBuffer_push8(JitBuffer *jit, uint8_t val);
 bool JitBuffer_push32(JitBuffer *jit, uint32_t val);
@@ -40,7 +93,70 @@ bool JitBuffer_push64(JitBuffer *jit, uint64_t val);
 
 bool JitBuffer_add_jump_patch(JitBuffer *jit, size_t target_opcode_index,
 			      uint8_t jump_type);
+
+/* Whether op `opcode_index` has a slot in the address table. */
+static inline bool JitBuffer_has_opcode(const JitBuffer *jit,
+					size_t opcode_index)
+{
+	return opcode_index >= jit->opcode_base &&
+	       opcode_index - jit->opcode_base < jit->opcode_count;
+}
+
+/* Buffer offset recorded for op `opcode_index`, which must have a slot. */
+static inline size_t JitBuffer_opcode_address(const JitBuffer *jit,
+					      size_t opcode_index)
+{
+	return jit->opcode_addresses[opcode_index - jit->opcode_base];
+}
+
 void JitBuffer_record_opcode_address(JitBuffer *jit, size_t opcode_index);
+bool JitBuffer_add_fuel_site(JitBuffer *jit, size_t offset);
+
+/**
+ * @brief Stores in *out the byte distance spanned by `cells` cells of the
+ * buffer's width. Returns false, after reporting it, if that does not fit
+ * an int32 displacement.
+ */
+bool JitBuffer_cell_disp(const JitBuffer *jit, int64_t cells, int32_t *out);
+
+/**
+ * @brief The op whose code holds `offset`, or SIZE_MAX. Safe to call from a
+ * signal handler.
+ */
+size_t JitBuffer_opcode_at(const JitBuffer *jit, size_t offset);
+
+/*
+ * Cells p[lo] .. p[hi] that the ops since the last label are known to have
+ * accessed. Had one of them been off the tape, the interpreter would have
+ * stopped there with a tape fault, so later code may assume the whole span
+ * is on the tape. Labels are loop entries and exits, where every incoming
+ * edge has just tested p[0].
+ */
+typedef struct {
+	bool known;
+	int64_t lo;
+	int64_t hi;
+} JitTapeReach;
+
+/* Folds in the cells `op` accesses, or starts over at a label. */
+void JitTapeReach_update(JitTapeReach *reach, const opcode *op);
+
+static inline bool JitTapeReach_covers(const JitTapeReach *reach, int64_t lo,
+				       int64_t hi)
+{
+	return reach->known && reach->lo <= lo && hi <= reach->hi;
+}
+
+/**
+ * @brief Highest total of committed JIT memory across all buffers so far.
+ */
+size_t JitBuffer_peak_committed(void);
+
+/**
+ * @brief Most code of one buffer found on huge pages when it was sealed.
+ * Only buffers of at least a huge page are measured.
+ */
+size_t JitBuffer_peak_huge(void);
 
 /**
  * @brief A generic jump patcher.
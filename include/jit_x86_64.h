@@ -2,10 +2,15 @@
 #define JIT_X86_64_H
 
 #include "util.h"
+#include "jit_common.h"
+#include "vm.h"
 
 /**
- * @brief Compiles and executes an OpcodeVector using the x86-64 JIT.
+ * @brief Compiles opcodes [start_pc, end_pc) into a standalone function
+ * and makes it executable. `jit` must be freshly created with one address
+ * slot per opcode in `code` (plus one). Returns NULL on failure.
  */
-bool jit_exec_x86_64(const OpcodeVector *code);
+JitRegionFn jit_compile_region_x86_64(JitBuffer *jit, const OpcodeVector *code,
+				      size_t start_pc, size_t end_pc);
 
 #endif // JIT_X86_64_H
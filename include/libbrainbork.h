@@ -0,0 +1,212 @@
+#ifndef LIBBRAINBORK_H
+#define LIBBRAINBORK_H
+
+/*
+ * Embedding API for libbrainbork.a / libbrainbork.so.
+ *
+ * Compile a program once with BfProgram_compile(), then run it any number of
+ * times with BfProgram_run(), from any number of threads: each run gets its
+ * own tape, stacks and I/O buffers, and the compiled program is read-only.
+ *
+ *   BfProgram *program;
+ *   if (BfProgram_compile(src, strlen(src), NULL, &program) == BF_OK) {
+ *           uint8_t out[256];
+ *           BfRunOptions run = { 0 };
+ *           run.input = (const uint8_t *)"hi";
+ *           run.input_size = 2;
+ *           run.output = out;
+ *           run.output_capacity = sizeof(out);
+ *           BfRunStats stats;
+ *           BfStatus status = BfProgram_run(program, &run, &stats);
+ *           ...
+ *           BfProgram_free(program);
+ *   }
+ *
+ * To run many times without setting up a VM each time, create a BfContext
+ * once and pass it to BfContext_run(); BfProgram_run() is a BfContext
+ * created and freed around one run.
+ *
+ * Process-wide side effects, on POSIX hosts:
+ * - The first run installs SIGSEGV and SIGBUS handlers. They act only on
+ *   an access to a tape's guard regions by a thread that is running a
+ *   program, which ends that run with BF_ERR_TAPE_FAULT; every other
+ *   fault is passed to the handler installed before. A host that installs
+ *   its own handlers afterwards loses only that reporting: a program that
+ *   leaves the tape then takes the host's handler.
+ * - The first run with a timeout installs a SIGRTMIN handler (SIGALRM
+ *   where there are no real-time signals), and each such run creates a
+ *   POSIX timer that signals the running thread. Blocking that signal in
+ *   the thread disables the timeout.
+ * - Each BfContext, and each BfProgram_run() while it lasts, maps about
+ *   6 GiB of address space on 64-bit hosts: a 4 GiB tape between two
+ *   1 GiB inaccessible guards, and an arena of about 25 MiB for the lambda
+ *   and call stacks. All of it is MAP_NORESERVE and committed only as a
+ *   program touches it, but it counts against RLIMIT_AS; where that leaves
+ *   too little room the tape is halved until it fits, down to 128 KiB.
+ *   32-bit hosts map a 16 MiB tape with 16 MiB guards.
+ * - JIT programs make their lambda calls on the calling thread's stack,
+ *   16 bytes a call, and stop with BF_ERR_STACK_OVERFLOW 64 KiB short of
+ *   its end.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__)
+#define BF_API __attribute__((visibility("default")))
+#else
+#define BF_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+	BF_OK = 0,
+	BF_ERR_ARGS, // a required argument was NULL or out of range
+	BF_ERR_PARSE, // unbalanced brackets in the source
+	BF_ERR_COMPILE, // the optimizer or the JIT failed
+	BF_ERR_NOMEM,
+	BF_ERR_IO, // the write callback reported a failure
+	BF_ERR_OUTPUT_FULL, // output_capacity was too small; output holds a prefix
+	BF_ERR_UNSUPPORTED, // an option this build cannot honour
+	BF_ERR_OUT_OF_FUEL, // the run used up BfRunOptions.fuel
+	BF_ERR_TIMEOUT, // the run took longer than BfRunOptions.timeout
+	BF_ERR_TAPE_FAULT, // the data pointer left the tape; see fault_cell
+	BF_ERR_STACK_OVERFLOW, // too many live lambdas or nested '!' calls
+	BF_ERR_NO_LAMBDA, // '!' ran with no lambda defined
+} BfStatus;
+
+typedef enum {
+	BF_ENGINE_JIT, // native code; BF_ERR_UNSUPPORTED where there is no backend
+	BF_ENGINE_INTERPRETER,
+} BfEngine;
+
+/* What ',' stores once the input is exhausted. */
+typedef enum {
+	BF_EOF_MINUS_ONE, // all ones (255 in a byte cell)
+	BF_EOF_ZERO,
+	BF_EOF_UNCHANGED,
+} BfEof;
+
+/*
+ * @brief How a program is compiled. Passing NULL selects the JIT at
+ * -O3 where a backend exists and the interpreter otherwise.
+ * int opt_level: 0 .. 3, as the command line's -O flag.
+ * int cell_bits: 8, 16 or 32, as --cell; 0 also means 8.
+ */
+typedef struct {
+	BfEngine engine;
+	int opt_level;
+	int cell_bits;
+} BfCompileOptions;
+
+/* Fills `buf` with up to `size` bytes. Returns the count, 0 at end of
+ * input, or a negative value on error (also treated as end of input). */
+typedef ptrdiff_t (*BfReadFn)(void *ctx, uint8_t *buf, size_t size);
+
+/* Consumes `size` bytes of output. Returns false to report a failure; the
+ * run then discards the rest of its output and returns BF_ERR_IO. */
+typedef bool (*BfWriteFn)(void *ctx, const uint8_t *data, size_t size);
+
+/*
+ * @brief Where one run reads and writes. Zero-initialize and set what you
+ * need: with no input the program sees an immediate end of input, and with
+ * no output its bytes are counted and dropped.
+ * input/input_size: read in place; must stay valid for the run.
+ * read/read_ctx: pulled in chunks; used when `input` is NULL.
+ * output/output_capacity: filled from the start; bytes past the capacity
+ *                         are counted but dropped (BF_ERR_OUTPUT_FULL).
+ * write/write_ctx: called with chunks of up to 64 KiB; used only when
+ *                  `output` is NULL.
+ * uint64_t fuel: loop back-edges and lambda calls allowed; 0 for no limit.
+ * double timeout: wall-clock seconds; 0 for no limit. Checked where fuel
+ *                 is charged, so a blocked read callback is not cut short.
+ * A run stopped by either keeps the output it produced so far.
+ * bool tape_left: start in the middle of the tape, so the program can move
+ *                 left of its first cell instead of faulting there.
+ */
+typedef struct {
+	const uint8_t *input;
+	size_t input_size;
+	BfReadFn read;
+	void *read_ctx;
+	uint8_t *output;
+	size_t output_capacity;
+	BfWriteFn write;
+	void *write_ctx;
+	BfEof eof;
+	uint64_t fuel;
+	double timeout;
+	bool tape_left;
+} BfRunOptions;
+
+/* @brief What BfProgram_compile() produced. */
+typedef struct {
+	BfEngine engine;
+	size_t op_count; // ops after optimization
+	size_t code_bytes; // native code size; 0 for the interpreter
+	double compile_seconds;
+} BfProgramStats;
+
+/* @brief What one BfProgram_run() did. */
+typedef struct {
+	size_t input_bytes; // bytes consumed by ','
+	size_t output_bytes; // bytes written by '.', including dropped ones
+	double seconds;
+	ptrdiff_t fault_cell; // where the pointer went on BF_ERR_TAPE_FAULT
+} BfRunStats;
+
+typedef struct BfProgram BfProgram;
+
+/**
+ * @brief Parses, optimizes and compiles `size` bytes of Brainfork source.
+ * The source need not be NUL-terminated. On BF_OK `*out` owns the program.
+ */
+BF_API BfStatus BfProgram_compile(const char *source, size_t size,
+				  const BfCompileOptions *options,
+				  BfProgram **out);
+
+/**
+ * @brief Runs `program` once on a fresh tape. `options` may be NULL for no
+ * input and discarded output; `stats` may be NULL. Safe to call
+ * concurrently on the same program. Maps and unmaps a whole VM per call;
+ * see BfContext for repeated runs.
+ */
+BF_API BfStatus BfProgram_run(const BfProgram *program,
+			      const BfRunOptions *options, BfRunStats *stats);
+
+/*
+ * @brief A VM that runs programs one after another: the tape, the lambda
+ * and call stacks, and I/O buffers, mapped once. Each run starts on a
+ * cleared tape, cheaply when the last run touched little of it. A context
+ * may move between threads but serves one run at a time.
+ */
+typedef struct BfContext BfContext;
+
+/* @brief Maps a context's VM. On BF_OK `*out` owns it. */
+BF_API BfStatus BfContext_create(BfContext **out);
+
+/**
+ * @brief Runs `program` once on `context`, as BfProgram_run() does. Nothing
+ * of `options` is kept after it returns.
+ */
+BF_API BfStatus BfContext_run(BfContext *context, const BfProgram *program,
+			      const BfRunOptions *options, BfRunStats *stats);
+
+BF_API void BfContext_free(BfContext *context);
+
+BF_API void BfProgram_stats(const BfProgram *program, BfProgramStats *stats);
+
+BF_API void BfProgram_free(BfProgram *program);
+
+/* A short English description of `status`. */
+BF_API const char *BfStatus_string(BfStatus status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LIBBRAINBORK_H
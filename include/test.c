@@ -1,18 +1,37 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <unistd.h>     // For dup, dup2, fileno
-#include <fcntl.h>      // For open, O_RDWR
+#include <dirent.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 // Include all our project headers
 #include "compiler.h"
 #include "vm.h"
 #include "jit.h"
+#include "tier.h"
+#include "batch.h"
+#include "libbrainbork.h"
+
+// The architectures with a JIT backend
+#if defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__)
+#define HOST_HAS_JIT 1
+#else
+#define HOST_HAS_JIT 0
+#endif
 
 // --- Minimal C Test Framework ---
 
 static int g_tests_run = 0;
 static int g_tests_failed = 0;
+static bool g_verbose = false; // -v: also log passing assertions
 
 // Logs a test header. We use a macro to avoid a function call.
 #define TEST_CASE(name) \
@@ -34,19 +53,19 @@ static int g_tests_failed = 0;
     if (!(cond)) { \
         fprintf(stderr, "    FAILED: %s:%d: Assertion failed: %s\n", __FILE__, __LINE__, #cond); \
         test_case_passed = 0; \
-    } else { \
+    } else if (g_verbose) { \
         printf("    Passed: %s\n", #cond); \
     }
 
 // --- Assertion Helpers ---
 #define ASSERT_EQ_INT(a, b) \
     do { \
-        int _a = (a); int _b = (b); \
+        long long _a = (a); long long _b = (b); \
         if (_a != _b) { \
-            fprintf(stderr, "    FAILED: %s:%d: %s (%d) != %s (%d)\n", __FILE__, __LINE__, #a, _a, #b, _b); \
+            fprintf(stderr, "    FAILED: %s:%d: %s (%lld) != %s (%lld)\n", __FILE__, __LINE__, #a, _a, #b, _b); \
             test_case_passed = 0; \
-        } else { \
-            printf("    Passed: %s == %s (%d)\n", #a, #b, _a); \
+        } else if (g_verbose) { \
+            printf("    Passed: %s == %s (%lld)\n", #a, #b, _a); \
         } \
     } while(0)
 
@@ -56,7 +75,7 @@ static int g_tests_failed = 0;
         if (_a != _b) { \
             fprintf(stderr, "    FAILED: %s:%d: %s (%zu) != %s (%zu)\n", __FILE__, __LINE__, #a, _a, #b, _b); \
             test_case_passed = 0; \
-        } else { \
+        } else if (g_verbose) { \
             printf("    Passed: %s == %s (%zu)\n", #a, #b, _a); \
         } \
     } while(0)
@@ -67,16 +86,28 @@ static int g_tests_failed = 0;
         if (strcmp(_a, _b) != 0) { \
             fprintf(stderr, "    FAILED: %s:%d: \"%s\" != \"%s\"\n", __FILE__, __LINE__, _a, _b); \
             test_case_passed = 0; \
-        } else { \
+        } else if (g_verbose) { \
             printf("    Passed: \"%s\" == \"%s\"\n", _a, _b); \
         } \
     } while(0)
 
+// Compares two byte strings that may hold NULs
+#define ASSERT_EQ_BYTES(a, a_size, b, b_size) \
+    do { \
+        size_t _as = (a_size); size_t _bs = (b_size); \
+        if (_as != _bs || memcmp((a), (b), _as) != 0) { \
+            fprintf(stderr, "    FAILED: %s:%d: %s (%zu bytes) != %s (%zu bytes)\n", __FILE__, __LINE__, #a, _as, #b, _bs); \
+            test_case_passed = 0; \
+        } else if (g_verbose) { \
+            printf("    Passed: %s == %s (%zu bytes)\n", #a, #b, _as); \
+        } \
+    } while(0)
+
 #define ASSERT_NOT_NULL(ptr) \
     if ((ptr) == NULL) { \
         fprintf(stderr, "    FAILED: %s:%d: %s is NULL\n", __FILE__, __LINE__, #ptr); \
         test_case_passed = 0; \
-    } else { \
+    } else if (g_verbose) { \
         printf("    Passed: %s is NOT NULL\n", #ptr); \
     }
 
@@ -85,126 +116,207 @@ static int g_tests_failed = 0;
 
 // --- Test Execution Harness ---
 
-// A struct to hold the result of a program execution
+typedef enum {
+    ENGINE_INTERPRETER,
+    ENGINE_JIT,
+    ENGINE_TIERED,
+} Engine;
+
+static const char *const ENGINE_FLAGS[] = { "-i", "-j", "-t" };
+
+// How a program is compiled and run; see DEFAULT_SETUP
 typedef struct {
-    char output[4096];
-    bool success;
+    Engine engine;
+    int opt_level;
+    CellWidth cell;
+    EofPolicy eof;
+    FlushPolicy flush;
+    VmLimits limits;
+    bool tape_left;
+    int input_fd; // read with InputBuffer_init(), or -1 for the given bytes
+    int output_fd; // written with OutputBuffer_init(), or -1 to capture
+} RunSetup;
+
+// A program that hangs fails with VM_TIMEOUT rather than stalling the suite
+static const RunSetup DEFAULT_SETUP = {
+    ENGINE_INTERPRETER, OPTIMIZE_MAX_LEVEL, CELL_8, EOF_MINUS_ONE, FLUSH_FULL, { 0, 60.0 }, false, -1, -1
+};
+
+#define RESULT_OUTPUT_SIZE (256 << 10)
+
+// The result of a program execution. Output past RESULT_OUTPUT_SIZE is
+// counted and hashed but not kept.
+typedef struct {
+    bool success; // compiled and ran; `status` says how the run ended
+    VmStatus status;
+    ptrdiff_t fault_cell;
+    size_t size;
+    size_t flushes; // calls to the sink
+    size_t max_chunk; // the most bytes one call got
+    bool spliced; // output_fd was written with vmsplice
+    uint64_t hash; // FNV-1a of all output
+    uint8_t output[RESULT_OUTPUT_SIZE];
 } RunResult;
 
+static bool capture_output(void *ctx, const uint8_t *data, size_t size) {
+    RunResult *result = ctx;
+    result->flushes++;
+    if (size > result->max_chunk)
+        result->max_chunk = size;
+    for (size_t i = 0; i < size; ++i) {
+        result->hash = (result->hash ^ data[i]) * 0x100000001b3ull;
+        if (result->size < RESULT_OUTPUT_SIZE)
+            result->output[result->size] = data[i];
+        result->size++;
+    }
+    return true;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
 /**
- * @brief Runs a BF program string, capturing its stdout.
- * This is the core of our behavioral testing.
- */
-RunResult run_code(const char* code_string, const char* input_string, bool use_jit) {
-    RunResult result = {0};
-    OpcodeVector code, optimized_code;
-    BfVm vm;
-
-    // --- I/O Redirection Setup ---
-    // We create temporary files to act as stdin and stdout
-    FILE* tmp_in = tmpfile();
-    FILE* tmp_out = tmpfile();
-    if (!tmp_in || !tmp_out) {
-        perror("Failed to create temp files for I/O");
-        result.success = false;
-        return result;
-    }
-    
-    // Get the file descriptors
-    int tmp_in_fd = fileno(tmp_in);
-    int tmp_out_fd = fileno(tmp_out);
-    
-    // Save the real stdin/stdout
-    int saved_stdin = dup(fileno(stdin));
-    int saved_stdout = dup(fileno(stdout));
-    
-    // Write the input string to the temp input file
-    fputs(input_string, tmp_in);
-    rewind(tmp_in);
-    
-    // Redirect stdin and stdout
-    dup2(tmp_in_fd, fileno(stdin));
-    dup2(tmp_out_fd, fileno(stdout));
-    // --- End I/O Setup ---
-
-    // Initialize all our structures
-    OpcodeVector_init(&code);
-    OpcodeVector_init(&optimized_code);
-    if (!BfVm_init(&vm)) {
-        fprintf(stderr, "BfVm_init failed\n");
-        result.success = false;
-        goto cleanup;
+ * @brief Maps a VM with no I/O attached; run_on() connects it per run.
+ */
+static BfVm *vm_create(void) {
+    // BfVm holds page-aligned output buffers
+    BfVm *vm = aligned_alloc(_Alignof(BfVm), sizeof(BfVm));
+    if (vm && !BfVm_init_unconnected(vm)) {
+        free(vm);
+        return NULL;
     }
+    return vm;
+}
 
+static void vm_destroy(BfVm *vm) {
+    BfVm_free(vm);
+    free(vm);
+}
+
+static bool compile_code(const char *code_string, const RunSetup *setup, OpcodeVector *out) {
+    OpcodeVector code;
+    OpcodeVector_init(&code);
+    OpcodeVector_init(out);
     if (!scanner(code_string, &code)) {
-        fprintf(stderr, "Scanner failed\n");
-        result.success = false;
-        goto cleanup;
-    }
-
-    if (!optimize(&code, &optimized_code)) {
-        fprintf(stderr, "Optimizer failed\n");
-        result.success = false;
-        goto cleanup;
-    }
-    
-    // --- Run the code ---
-    if (use_jit) {
-        if (!jit_run(&vm, &optimized_code)) {
-            fprintf(stderr, "JIT run failed\n");
-            result.success = false;
-            goto cleanup;
-        }
-    } else {
-        interpreter(&vm, &optimized_code);
-    }
-    result.success = true;
-    
-    // --- Read the captured output ---
-    fflush(stdout); // IMPORTANT: Flush stdout before reading
-    rewind(tmp_out);
-    size_t bytes_read = fread(result.output, 1, sizeof(result.output) - 1, tmp_out);
-    result.output[bytes_read] = '\0';
-    // --- End Read Output ---
-
-cleanup:
-    // --- Restore I/O ---
-    fflush(stdout);
-    fflush(stdin);
-    dup2(saved_stdout, fileno(stdout));
-    dup2(saved_stdin, fileno(stdin));
-    close(saved_stdout);
-    close(saved_stdin);
-    fclose(tmp_in);
-    fclose(tmp_out);
-    // --- End I/O Restore ---
-    
+        OpcodeVector_free(&code);
+        return false;
+    }
+    OptimizeOptions opt = { setup->opt_level, false, setup->cell };
+    bool ok = optimize_with(&code, out, &opt);
     OpcodeVector_free(&code);
-    OpcodeVector_free(&optimized_code);
-    BfVm_free(&vm);
-    
+    return ok;
+}
+
+/**
+ * @brief Runs already compiled code on `vm` with `input`, capturing its
+ * output into `result`.
+ */
+static void run_on(BfVm *vm, const OpcodeVector *code, const uint8_t *input, size_t input_size,
+                   const RunSetup *setup, RunResult *result) {
+    result->size = 0;
+    result->flushes = 0;
+    result->max_chunk = 0;
+    result->hash = 0xcbf29ce484222325ull;
+    if (setup->input_fd >= 0)
+        InputBuffer_init(&vm->in, setup->input_fd, setup->eof);
+    else
+        InputBuffer_init_memory(&vm->in, input, input_size, setup->eof);
+    if (setup->output_fd >= 0)
+        OutputBuffer_init(&vm->out, setup->output_fd, setup->flush);
+    else
+        OutputBuffer_init_sink(&vm->out, capture_output, result, setup->flush);
+    result->spliced = vm->out.splice;
+    vm->limits = setup->limits;
+    vm->tape_left = setup->tape_left;
+    vm->cell = setup->cell;
+
+    InterpreterOptions interp = { false, setup->engine == ENGINE_TIERED };
+    switch (setup->engine) {
+    case ENGINE_INTERPRETER:
+    case ENGINE_TIERED:
+        result->status = interpreter_execute(vm, code, &interp);
+        break;
+    case ENGINE_JIT:
+        result->status = jit_run(vm, code);
+        break;
+    }
+    result->success = result->status != VM_COMPILE_FAILED;
+    result->fault_cell = vm->fault_cell;
+    InputBuffer_init_memory(&vm->in, NULL, 0, setup->eof);
+}
+
+/**
+ * @brief Compiles and runs a BF program string on a fresh VM. The result
+ * is heap-allocated; free() it.
+ */
+static RunResult *run_setup(const char *code_string, const uint8_t *input, size_t input_size,
+                            const RunSetup *setup) {
+    RunResult *result = calloc(1, sizeof(*result));
+    if (!result)
+        abort();
+    OpcodeVector code;
+    BfVm *vm = vm_create();
+    if (vm && compile_code(code_string, setup, &code))
+        run_on(vm, &code, input, input_size, setup, result);
+    OpcodeVector_free(&code);
+    if (vm)
+        vm_destroy(vm);
     return result;
 }
 
+static RunResult *run_code(const char *code_string, const char *input_string, Engine engine) {
+    RunSetup setup = DEFAULT_SETUP;
+    setup.engine = engine;
+    return run_setup(code_string, (const uint8_t *)input_string, strlen(input_string), &setup);
+}
+
+/**
+ * @brief Reads a whole file into a NUL-terminated string, or NULL.
+ */
+static char *read_file(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f)
+        return NULL;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+    char *text = size >= 0 ? malloc((size_t)size + 1) : NULL;
+    if (text && fread(text, 1, (size_t)size, f) != (size_t)size) {
+        free(text);
+        text = NULL;
+    }
+    if (text)
+        text[size] = '\0';
+    fclose(f);
+    return text;
+}
+
 /**
- * @brief Main test function. Runs a program on BOTH interpreter and JIT
- * and asserts they produce the same, expected output.
+ * @brief Main test function. Runs a program on every engine and asserts
+ * they produce the same, expected output.
  */
-void test_program(const char* name, const char* code, const char* input, const char* expected_output) {
-    printf("  Behavioral Test: %s\n", name);
-    
-    // Test Interpreter
-    RunResult interp_res = run_code(code, input, false);
-    ASSERT_TRUE(interp_res.success);
-    ASSERT_EQ_STR(interp_res.output, expected_output);
-    
-    // Test JIT
-    RunResult jit_res = run_code(code, input, true);
-    ASSERT_TRUE(jit_res.success);
-    ASSERT_EQ_STR(jit_res.output, expected_output);
+#define test_program(name, code, input, expected_output) \
+    test_program_bytes(&test_case_passed, name, code, input, expected_output, sizeof(expected_output) - 1)
 
-    // Final sanity check: Interp vs JIT
-    ASSERT_EQ_STR(interp_res.output, jit_res.output);
+static void test_program_bytes(int *passed, const char *name, const char *code, const char *input,
+                               const char *expected_output, size_t expected_size) {
+    int test_case_passed = 1;
+    if (g_verbose)
+        printf("  Behavioral Test: %s\n", name);
+    for (size_t e = 0; e < sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS); ++e) {
+        RunResult *res = run_code(code, input, (Engine)e);
+        ASSERT_TRUE(res->success);
+        ASSERT_EQ_INT(res->status, VM_OK);
+        ASSERT_EQ_BYTES(res->output, res->size, expected_output, expected_size);
+        if (!test_case_passed)
+            fprintf(stderr, "    ...in \"%s\" with %s\n", name, ENGINE_FLAGS[e]);
+        free(res);
+    }
+    if (!test_case_passed)
+        *passed = 0;
 }
 
 
@@ -212,42 +324,44 @@ void test_program(const char* name, const char* code, const char* input, const c
 
 void test_data_structures() {
     TEST_CASE("Data Structures");
-    
-    // Test IndexStack
-    IndexStack stack;
-    IndexStack_init(&stack);
-    ASSERT_TRUE(IndexStack_is_empty(&stack));
-    ASSERT_TRUE(IndexStack_push(&stack, 10));
-    ASSERT_TRUE(IndexStack_push(&stack, 20));
+
+    // Test SizeTStack
+    SizeTStack stack;
+    SizeTStack_init(&stack);
+    ASSERT_TRUE(SizeTStack_empty(&stack));
+    ASSERT_TRUE(SizeTStack_push(&stack, 10));
+    ASSERT_TRUE(SizeTStack_push(&stack, 20));
     ASSERT_EQ_SIZE(stack.size, 2);
-    
+
     size_t val;
-    ASSERT_TRUE(IndexStack_pop(&stack, &val));
+    ASSERT_TRUE(SizeTStack_top(&stack, &val));
     ASSERT_EQ_SIZE(val, 20);
-    ASSERT_TRUE(IndexStack_pop(&stack, &val));
+    SizeTStack_pop(&stack);
+    ASSERT_TRUE(SizeTStack_top(&stack, &val));
     ASSERT_EQ_SIZE(val, 10);
-    ASSERT_TRUE(IndexStack_is_empty(&stack));
-    ASSERT_TRUE(!IndexStack_pop(&stack, &val)); // Pop from empty
-    IndexStack_free(&stack);
+    SizeTStack_pop(&stack);
+    ASSERT_TRUE(SizeTStack_empty(&stack));
+    ASSERT_TRUE(!SizeTStack_top(&stack, &val)); // Top of empty
+    SizeTStack_free(&stack);
 
     // Test OpcodeVector
     OpcodeVector vec;
     OpcodeVector_init(&vec);
     ASSERT_TRUE(vec.data == NULL);
-    opcode op1 = {op_add, 5};
+    opcode op1 = {op_add, 5, 0, 0};
     OpcodeVector_push_back(&vec, op1);
     ASSERT_EQ_SIZE(vec.size, 1);
     ASSERT_NOT_NULL(vec.data);
     ASSERT_EQ_INT(vec.data[0].op, op_add);
     ASSERT_EQ_INT(vec.data[0].num, 5);
     OpcodeVector_free(&vec);
-    
+
     END_TEST_CASE;
 }
 
 void test_scanner() {
     TEST_CASE("Scanner");
-    
+
     OpcodeVector code;
     OpcodeVector_init(&code);
 
@@ -269,7 +383,7 @@ void test_scanner() {
     ASSERT_EQ_INT(code.data[4].op, op_out);
     ASSERT_EQ_INT(code.data[5].op, op_in);
     OpcodeVector_free(&code);
-    
+
     // Test jumps
     ASSERT_TRUE(scanner("[+]", &code));
     ASSERT_EQ_SIZE(code.size, 3);
@@ -281,7 +395,7 @@ void test_scanner() {
     OpcodeVector_free(&code);
 
     // Test functions
-    ASSERT_TRUE(scanner("(+!)", &code));
+    ASSERT_TRUE(scanner("(+)!", &code));
     ASSERT_EQ_SIZE(code.size, 4);
     ASSERT_EQ_INT(code.data[0].op, op_def_lambda);
     ASSERT_EQ_INT(code.data[0].num, 3); // Jumps past the ')'
@@ -289,7 +403,7 @@ void test_scanner() {
     ASSERT_EQ_INT(code.data[2].op, op_ret);
     ASSERT_EQ_INT(code.data[3].op, op_call);
     OpcodeVector_free(&code);
-    
+
     // Test errors
     ASSERT_TRUE(!scanner("[", &code));
     ASSERT_TRUE(!scanner("]", &code));
@@ -305,7 +419,7 @@ void test_optimizer() {
 
     OpcodeVector code, opt_code;
     OpcodeVector_init(&code);
-    
+
     // Test [-] optimization
     ASSERT_TRUE(scanner("[-]", &code));
     ASSERT_TRUE(optimize(&code, &opt_code));
@@ -313,7 +427,7 @@ void test_optimizer() {
     ASSERT_EQ_INT(opt_code.data[0].op, op_clear);
     OpcodeVector_free(&code);
     OpcodeVector_free(&opt_code);
-    
+
     // Test [+] optimization
     ASSERT_TRUE(scanner("[+]", &code));
     ASSERT_TRUE(optimize(&code, &opt_code));
@@ -322,42 +436,128 @@ void test_optimizer() {
     OpcodeVector_free(&code);
     OpcodeVector_free(&opt_code);
 
-    // Test non-optimization
-    ASSERT_TRUE(scanner("[->+<]", &code));
+    // Test copy/multiply loop optimization
+    ASSERT_TRUE(scanner("[->+>+++<<]", &code));
+    ASSERT_TRUE(optimize(&code, &opt_code));
+    ASSERT_EQ_SIZE(opt_code.size, 3);
+    ASSERT_EQ_INT(opt_code.data[0].op, op_mul);
+    ASSERT_EQ_INT(opt_code.data[0].num, 1);
+    ASSERT_EQ_INT(opt_code.data[0].offset, 1);
+    ASSERT_EQ_INT(opt_code.data[1].op, op_mul);
+    ASSERT_EQ_INT(opt_code.data[1].num, 3);
+    ASSERT_EQ_INT(opt_code.data[1].offset, 2);
+    ASSERT_EQ_INT(opt_code.data[2].op, op_clear);
+    OpcodeVector_free(&code);
+    OpcodeVector_free(&opt_code);
+
+    // Test `+1` counter (factor is negated)
+    ASSERT_TRUE(scanner("[+<++>]", &code));
+    ASSERT_TRUE(optimize(&code, &opt_code));
+    ASSERT_EQ_SIZE(opt_code.size, 2);
+    ASSERT_EQ_INT(opt_code.data[0].op, op_mul);
+    ASSERT_EQ_INT(opt_code.data[0].num, 254);
+    ASSERT_EQ_INT(opt_code.data[0].offset, -1);
+    OpcodeVector_free(&code);
+    OpcodeVector_free(&opt_code);
+
+    // Test scan loop optimization
+    ASSERT_TRUE(scanner("[>>>>][<]", &code));
+    ASSERT_TRUE(optimize(&code, &opt_code));
+    ASSERT_EQ_SIZE(opt_code.size, 2);
+    ASSERT_EQ_INT(opt_code.data[0].op, op_scanr);
+    ASSERT_EQ_INT(opt_code.data[0].num, 4);
+    ASSERT_EQ_INT(opt_code.data[1].op, op_scanl);
+    ASSERT_EQ_INT(opt_code.data[1].num, 1);
+    OpcodeVector_free(&code);
+    OpcodeVector_free(&opt_code);
+
+    // Test arithmetic combining
+    ASSERT_TRUE(scanner("+-+->+++<[-]+++++>--", &code));
+    ASSERT_TRUE(optimize(&code, &opt_code));
+    ASSERT_EQ_SIZE(opt_code.size, 2);
+    ASSERT_EQ_INT(opt_code.data[0].op, op_set);
+    ASSERT_EQ_INT(opt_code.data[0].num, 5);
+    ASSERT_EQ_INT(opt_code.data[0].offset, 0);
+    ASSERT_EQ_INT(opt_code.data[1].op, op_add);
+    ASSERT_EQ_INT(opt_code.data[1].num, 1);
+    ASSERT_EQ_INT(opt_code.data[1].offset, 1);
+    OpcodeVector_free(&code);
+    OpcodeVector_free(&opt_code);
+
+    // Test stores surviving input (EOF may leave the cell unchanged)
+    ASSERT_TRUE(scanner("+++,.", &code));
     ASSERT_TRUE(optimize(&code, &opt_code));
-    ASSERT_EQ_SIZE(opt_code.size, 6); // Should not optimize
+    ASSERT_EQ_SIZE(opt_code.size, 3);
+    ASSERT_EQ_INT(opt_code.data[0].op, op_add);
+    ASSERT_EQ_INT(opt_code.data[1].op, op_in);
+    ASSERT_EQ_INT(opt_code.data[2].op, op_out);
+    OpcodeVector_free(&code);
+    OpcodeVector_free(&opt_code);
+
+    // Test -O0 running no passes
+    OptimizeOptions o0 = { 0, false, CELL_8 };
+    ASSERT_TRUE(scanner("[-]>>+", &code));
+    ASSERT_TRUE(optimize_with(&code, &opt_code, &o0));
+    ASSERT_EQ_SIZE(opt_code.size, code.size);
+    ASSERT_EQ_INT(opt_code.data[0].op, op_jf);
+    ASSERT_EQ_INT(opt_code.data[0].num, 3);
+    OpcodeVector_free(&code);
+    OpcodeVector_free(&opt_code);
+
+    // Test non-optimization (pointer is not balanced)
+    ASSERT_TRUE(scanner("[->+<<]", &code));
+    ASSERT_TRUE(optimize(&code, &opt_code));
+    ASSERT_EQ_SIZE(opt_code.size, 5); // Only the pointer moves fold
     ASSERT_EQ_INT(opt_code.data[0].op, op_jf);
+    ASSERT_EQ_INT(opt_code.data[0].num, 5);
+    ASSERT_EQ_INT(opt_code.data[2].offset, 1);
+    ASSERT_EQ_INT(opt_code.data[3].op, op_subp);
     OpcodeVector_free(&code);
     OpcodeVector_free(&opt_code);
-    
+
+    // Test pointer moves folding into offsets
+    ASSERT_TRUE(scanner(">>+<<-", &code));
+    ASSERT_TRUE(optimize(&code, &opt_code));
+    ASSERT_EQ_SIZE(opt_code.size, 2);
+    ASSERT_EQ_INT(opt_code.data[0].op, op_add);
+    ASSERT_EQ_INT(opt_code.data[0].offset, 2);
+    ASSERT_EQ_INT(opt_code.data[1].op, op_sub);
+    ASSERT_EQ_INT(opt_code.data[1].offset, 0);
+    OpcodeVector_free(&code);
+    OpcodeVector_free(&opt_code);
+
     END_TEST_CASE;
 }
 
 void test_execution() {
-    TEST_CASE("Program Execution (Interpreter vs JIT)");
+    TEST_CASE("Program Execution (Interpreter vs JIT vs Tiered)");
 
-    test_program("Hello", 
+    test_program("Hello",
         "++++++++[>++++[>++>+++>+++>+<<<<-]>+>+>->>+[<]<-]>>." // H
-        "---." // e
-        "++++++ +." // l
-        "." // l
-        "+++." // o
-        , "", "Hello");
-    
-    test_program("Echo", 
-        ",.", 
+        "---." // E
+        "+++++++." // L
+        "." // L
+        "+++." // O
+        , "", "HELLO");
+
+    test_program("Echo",
+        ",.",
         "A", "A");
-    
+
     test_program("Cat",
-        ",[.,]",
+        ",+[-.,+]", // EOF reads as -1
         "Hi!\n", "Hi!\n");
-        
+
     test_program("Loop",
         "+++[>+.<-]",
-        "", " \x01\x02"); // Prints ASCII 1, 2, 3
+        "", "\x01\x02\x03");
+
+    test_program("Scan",
+        ">+>+>+>+>+>>+>+>+>+>+<<<<<[>]>[>]<[<]<[<]>.",
+        "", "\x01");
 
     test_program("Hardcoded Multiply",
-        "++++++(>+++++++<) > [-<+>]! .", // 6 * 7
+        "++++++(>+++++++<)[!-]>.", // 6 calls adding 7
         "",
         "*"); // ASCII 42
 
@@ -372,34 +572,1633 @@ void test_execution() {
         "\x01");
 
     test_program("Lambda Capture",
-        "+++++ > + (>.<) ! .", // p[0]=5, p[1]=1. Def lambda (capture p[1]). Call. Print p[1].
+        "+++++ > + (>.<) ! .", // p[0]=5, p[1]=1. Def lambda (capture p[1]). Call prints p[2]. Print p[1].
         "",
-        "\x01"); // Call should not affect p[1]
+        "\x00\x01"); // Call should not affect p[1]
 
     test_program("Lambda Capture 2",
         "+++++ > + ( < + > ) ! . > .", // p[0]=5, p[1]=1. Def lambda (capture p[1]). Call. Print p[1]. Go to p[2]. Print p[2].
         "",                            // Lambda body is <+> (inc p[0])
         "\x01\x00");                   // Should print p[1] (1) and p[2] (0). p[0] becomes 6.
-    
+
+    END_TEST_CASE;
+}
+
+static const CellWidth CELL_WIDTHS[] = { CELL_8, CELL_16, CELL_32 };
+#define CELL_WIDTH_COUNT (sizeof(CELL_WIDTHS) / sizeof(*CELL_WIDTHS))
+
+/**
+ * @brief Runs every program in examples/ on each engine at every -O level
+ * and cell width, and checks all of them print what the JIT prints at -O3
+ * with cells of that width. A program the JIT takes more than 100 ms on is
+ * too slow for the interpreter at the lower levels; it is only checked at
+ * -O0 and -O3 with 8-bit cells, and with wider ones only the interpreter at
+ * -O3 is checked against the JIT.
+ */
+void test_examples() {
+    TEST_CASE("Examples on every engine, -O level and cell width");
+
+    DIR *dir = opendir("examples");
+    ASSERT_NOT_NULL(dir);
+    size_t programs = 0;
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        size_t len = strlen(entry->d_name);
+        if (len < 3 || strcmp(entry->d_name + len - 3, ".bf") != 0)
+            continue;
+        char path[512];
+        snprintf(path, sizeof(path), "examples/%s", entry->d_name);
+        char *source = read_file(path);
+        ASSERT_NOT_NULL(source);
+        if (!source)
+            continue;
+        programs++;
+
+        bool slow = false;
+        for (size_t w = 0; w < CELL_WIDTH_COUNT; ++w) {
+            RunSetup setup = DEFAULT_SETUP;
+            setup.engine = ENGINE_JIT;
+            setup.cell = CELL_WIDTHS[w];
+            double begin = now_seconds();
+            RunResult *expected = run_setup(source, NULL, 0, &setup);
+            slow = slow || now_seconds() - begin > 0.1;
+            ASSERT_TRUE(expected->success);
+            ASSERT_EQ_INT(expected->status, VM_OK);
+            for (size_t e = 0; e < sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS); ++e) {
+                for (int level = 0; level <= OPTIMIZE_MAX_LEVEL; ++level) {
+                    if (slow && (w == 0 ? level != 0 && level != OPTIMIZE_MAX_LEVEL :
+                                          level != OPTIMIZE_MAX_LEVEL || e != ENGINE_INTERPRETER))
+                        continue;
+                    setup.engine = (Engine)e;
+                    setup.opt_level = level;
+                    RunResult *res = run_setup(source, NULL, 0, &setup);
+                    int before = test_case_passed;
+                    ASSERT_EQ_INT(res->status, expected->status);
+                    ASSERT_EQ_SIZE(res->size, expected->size);
+                    ASSERT_TRUE(res->hash == expected->hash);
+                    if (before && !test_case_passed)
+                        fprintf(stderr, "    ...in %s with %s -O%d --cell=%d\n", path,
+                                ENGINE_FLAGS[e], level, 8 << w);
+                    free(res);
+                }
+            }
+            free(expected);
+        }
+        free(source);
+    }
+    if (dir)
+        closedir(dir);
+    ASSERT_TRUE(programs > 0);
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Appends a random program of roughly `budget` ops to `out`. Loops
+ * nest up to three deep, and some are multiply or clear loops so the
+ * interpreter's superinstructions get exercised.
+ */
+static void random_program(unsigned *seed, char *out, size_t *len, int budget, int depth) {
+    static const char *const FRAGMENTS[] = {
+        "[-]", "[->+<]", "[->++>+++<<]", "[-<+>]", "[>]", "[<]", ">[-]<", "[>+<-]>[-<+>]<",
+    };
+    while (budget-- > 0) {
+        int pick = rand_r(seed) % 16;
+        if (pick < 8) {
+            out[(*len)++] = "+-><+-.,"[pick];
+        } else if (pick < 11) {
+            const char *fragment = FRAGMENTS[rand_r(seed) % (sizeof(FRAGMENTS) / sizeof(*FRAGMENTS))];
+            memcpy(out + *len, fragment, strlen(fragment));
+            *len += strlen(fragment);
+        } else if (pick < 13 && depth < 3) {
+            int body = rand_r(seed) % 8 + 1;
+            out[(*len)++] = '[';
+            random_program(seed, out, len, body, depth + 1);
+            out[(*len)++] = rand_r(seed) % 2 ? '>' : '<';
+            out[(*len)++] = ']';
+            budget -= body;
+        }
+    }
+}
+
+/**
+ * @brief Runs seeded random programs through the interpreter and checks
+ * they end like the JIT does. Programs that run out of fuel on the JIT
+ * are skipped; the rest must match in status and output at every -O level.
+ */
+void test_random_programs() {
+    TEST_CASE("Random programs (Interpreter vs JIT)");
+
+    unsigned seed = 12345;
+    static const uint8_t input[] = "random \x00\xff input";
+    size_t compared = 0;
+    for (int n = 0; n < 400; ++n) {
+        char source[4096];
+        size_t len = 0;
+        source[len++] = '>'; // Leave room for a few '<' before a tape fault
+        random_program(&seed, source, &len, 40, 0);
+        source[len] = '\0';
+
+        RunSetup setup = DEFAULT_SETUP;
+        setup.opt_level = n % (OPTIMIZE_MAX_LEVEL + 1);
+        setup.limits.fuel = 100000;
+        setup.engine = ENGINE_JIT;
+        RunResult *jit = run_setup(source, input, sizeof(input) - 1, &setup);
+        ASSERT_TRUE(jit->success);
+        if (jit->status != VM_OUT_OF_FUEL) {
+            compared++;
+            setup.limits.fuel = 0;
+            setup.engine = ENGINE_INTERPRETER;
+            RunResult *interp = run_setup(source, input, sizeof(input) - 1, &setup);
+            int before = test_case_passed;
+            ASSERT_EQ_INT(interp->status, jit->status);
+            ASSERT_EQ_BYTES(interp->output, interp->size, jit->output, jit->size);
+            if (before && !test_case_passed)
+                fprintf(stderr, "    ...in \"%s\" at -O%d\n", source, setup.opt_level);
+            free(interp);
+        }
+        free(jit);
+    }
+    ASSERT_TRUE(compared > 100);
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Checks the tier compiler compiles a requested loop in the
+ * background and leaves loops holding lambda ops to the interpreter.
+ */
+void test_tier_compiler() {
+    TEST_CASE("Tier compiler");
+
+    OpcodeVector code;
+    OpcodeVector_init(&code);
+    ASSERT_TRUE(scanner("[(+)>][>+<-]", &code));
+    TierCompiler tier;
+    ASSERT_TRUE(TierCompiler_start(&tier, &code, CELL_8, 2));
+    size_t id = 0;
+    for (size_t pc = 0; pc < code.size && id < 2; ++pc) {
+        if (code.data[pc].op != op_jf)
+            continue;
+        tier.loops[id].start_pc = pc;
+        tier.loops[id].end_pc = code.data[pc].num;
+        pc = code.data[pc].num - 1;
+        id++;
+    }
+    ASSERT_EQ_SIZE(id, 2);
+
+    // Requests are compiled in order, so once the second loop is in the
+    // first has been looked at too
+    TierCompiler_request(&tier, 0);
+    TierCompiler_request(&tier, 1);
+    TierCompiler_request(&tier, 1);
+    double deadline = now_seconds() + 10.0;
+    while (TierCompiler_entry(&tier, 1) == NULL && now_seconds() < deadline)
+        sched_yield();
+    ASSERT_TRUE(TierCompiler_entry(&tier, 1) != NULL);
+    ASSERT_TRUE(TierCompiler_entry(&tier, 0) == NULL);
+    ASSERT_EQ_SIZE(atomic_load(&tier.compiled), 1);
+
+    // The region's address table covers its own ops, not the program's,
+    // and still maps code back to program op indices
+    const TierLoop *loop = &tier.loops[1];
+    const JitBuffer *buffer = &loop->region.buffer;
+    ASSERT_EQ_SIZE(buffer->opcode_base, loop->start_pc);
+    ASSERT_EQ_SIZE(buffer->opcode_count, loop->end_pc - loop->start_pc + 1);
+    for (size_t pc = loop->start_pc; pc < loop->end_pc; ++pc) {
+        size_t at = JitBuffer_opcode_address(buffer, pc);
+        size_t next = JitBuffer_opcode_address(buffer, pc + 1);
+        if (next > at)
+            ASSERT_EQ_SIZE(JitBuffer_opcode_at(buffer, at), pc);
+    }
+    TierCompiler_stop(&tier);
+    OpcodeVector_free(&code);
+
+    // A loop that gets hot partway through its output: every engine must
+    // print the same 4096 bytes whether or not native code took over
+    char expected[4096];
+    for (size_t i = 0; i < sizeof(expected); ++i)
+        expected[i] = (char)(i + 1);
+    test_program_bytes(&test_case_passed, "Hot Loop",
+        "++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++" // 64 x 64 bytes, each after 127 trips of a loop
+        "[>++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++[>+.>--[-->+<]>[-]<<<-]<-]", "",
+        expected, sizeof(expected));
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Bytes of address space the process has mapped, or 0.
+ */
+static size_t mapped_bytes(void) {
+    unsigned long pages = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%lu", &pages) != 1)
+            pages = 0;
+        fclose(f);
+    }
+    return pages * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * @brief Compiles a tier region for each loop in `starts` into `regions`
+ * and returns how many compiled.
+ */
+static size_t compile_regions(const OpcodeVector *code, const size_t *starts, size_t count,
+                              JitRegion *regions) {
+    size_t compiled = 0;
+    for (size_t i = 0; i < count; ++i)
+        compiled += jit_compile_region(code, starts[i], code->data[starts[i]].num, CELL_16,
+                                       &regions[i]);
+    return compiled;
+}
+
+/**
+ * @brief Compiles 3000 hot loops the way the tier compiler does, each into
+ * a region of its own, under an address space limit. With no room they
+ * fail without a word on stderr; with 1 GiB of room they all compile.
+ */
+void test_many_regions() {
+    TEST_CASE("Thousands of tier regions under an address space limit");
+
+    enum { LOOPS = 3000 };
+    char *source = malloc(LOOPS * 8 + 1);
+    size_t *starts = malloc(LOOPS * sizeof(*starts));
+    JitRegion *regions = calloc(LOOPS, sizeof(*regions));
+    if (!source || !starts || !regions)
+        abort();
+    for (int i = 0; i < LOOPS; ++i)
+        memcpy(source + i * 8, ">+++[-.]", 8);
+    source[LOOPS * 8] = '\0';
+    RunSetup setup = DEFAULT_SETUP;
+    setup.cell = CELL_16;
+    OpcodeVector code;
+    ASSERT_TRUE(compile_code(source, &setup, &code));
+    size_t loops = 0;
+    for (size_t pc = 0; pc < code.size && loops < LOOPS; ++pc)
+        if (code.data[pc].op == op_jf)
+            starts[loops++] = pc;
+    ASSERT_EQ_SIZE(loops, LOOPS);
+
+    struct rlimit saved;
+    ASSERT_TRUE(getrlimit(RLIMIT_AS, &saved) == 0);
+    size_t mapped = mapped_bytes();
+    size_t room = (size_t)1 << 30;
+    if (loops == LOOPS && mapped &&
+        (saved.rlim_max == RLIM_INFINITY || saved.rlim_max >= mapped + room)) {
+        // No room at all: every compile fails, quietly
+        char path[] = "/tmp/brainbork_test_XXXXXX";
+        int fd = mkstemp(path);
+        ASSERT_TRUE(fd >= 0);
+        unlink(path);
+        fflush(stderr);
+        int saved_stderr = dup(2);
+        dup2(fd, 2);
+        struct rlimit limit = saved;
+        limit.rlim_cur = mapped_bytes();
+        setrlimit(RLIMIT_AS, &limit);
+        size_t compiled = compile_regions(&code, starts, LOOPS, regions);
+        setrlimit(RLIMIT_AS, &saved);
+        dup2(saved_stderr, 2);
+        close(saved_stderr);
+        for (size_t i = 0; i < LOOPS; ++i)
+            JitRegion_free(&regions[i]);
+        ASSERT_EQ_SIZE(compiled, 0);
+        ASSERT_EQ_INT(lseek(fd, 0, SEEK_END), 0);
+        close(fd);
+
+        // 1 GiB, which one whole-program code cache would take alone
+        limit.rlim_cur = mapped_bytes() + room;
+        ASSERT_TRUE(setrlimit(RLIMIT_AS, &limit) == 0);
+        compiled = compile_regions(&code, starts, LOOPS, regions);
+        setrlimit(RLIMIT_AS, &saved);
+        ASSERT_EQ_SIZE(compiled, LOOPS);
+        for (size_t i = 0; i < LOOPS; ++i)
+            JitRegion_free(&regions[i]);
+    }
+
+    OpcodeVector_free(&code);
+    free(regions);
+    free(starts);
+    free(source);
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Builds a program whose code is several times larger than the old
+ * fixed 64 KiB JIT buffer, with a loop branching back across all of it,
+ * and checks it compiles and runs on every engine.
+ */
+void test_large_program() {
+    TEST_CASE("JIT code larger than 64 KiB");
+
+    enum { CELLS = 20000 };
+    char *source = malloc(3 * CELLS + CELLS + 16);
+    char *expected = malloc(CELLS);
+    if (!source || !expected)
+        abort();
+    size_t len = 0;
+    len += (size_t)sprintf(source, "+[->");
+    for (int i = 0; i < CELLS; ++i) {
+        memcpy(source + len, "+.>", 3);
+        len += 3;
+        expected[i] = 1;
+    }
+    memset(source + len, '<', CELLS + 1);
+    len += CELLS + 1;
+    source[len++] = ']';
+    source[len] = '\0';
+
+    OpcodeVector code;
+    ASSERT_TRUE(compile_code(source, &DEFAULT_SETUP, &code));
+    JitRegion region;
+    ASSERT_TRUE(jit_compile(&code, CELL_8, &region));
+    ASSERT_TRUE(region.buffer.size > 4 * 65536);
+    JitRegion_free(&region);
+    OpcodeVector_free(&code);
+
+    test_program_bytes(&test_case_passed, "Large Program", source, "", expected, CELLS);
+    free(source);
+    free(expected);
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Programs that read or write the current cell right after I/O,
+ * loops, scans and lambda calls, where the JIT keeps the cell in a
+ * register and must reload or spill it.
+ */
+void test_cached_cell() {
+    TEST_CASE("Cell cached across I/O, loops and calls");
+
+    test_program("Input Then Arithmetic", ",+.,-.", "AB", "BA");
+    test_program("Input Over Loop Result", "+++[>+++<-]>,.", "Z", "Z");
+    test_program("EOF Then Increment", ",+.", "", "\x00");
+    test_program("Multiply Into Next Cell", ",[->+<]>.<.", "\x05", "\x05\x00");
+    test_program("Output In Loop", "++>+++[<.>-]<.", "", "\x02\x02\x02\x02");
+    test_program("Scans", ">+>+>+>>+<<<<[>]+<[<]>.>>>.", "", "\x01\x01");
+    test_program("Clear Then Set", "+++++[-]+.", "", "\x01");
+    test_program("Call Writes Neighbour", "+++>(<++>)!<.", "", "\x05");
+    test_program("Call Writes Current", "+++(++)!.!.", "", "\x05\x07");
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Runs loops whose bodies grow a few bytes at a time across the
+ * 127-byte reach of a short jump, both taken and skipped, so each loop
+ * edge is emitted once near each side of the rel8/rel32 boundary.
+ */
+void test_branch_lengths() {
+    TEST_CASE("Loop bodies around the short jump range");
+
+    for (int k = 1; k <= 64; ++k) {
+        // A skipped loop, then a loop run twice inside a loop run once
+        char source[1024];
+        size_t len = 0;
+        source[len++] = '[';
+        for (int i = 0; i < k; ++i)
+            len += (size_t)sprintf(source + len, "+.");
+        len += (size_t)sprintf(source + len, "]+[->++[>");
+        for (int i = 0; i < k; ++i)
+            len += (size_t)sprintf(source + len, "+.");
+        len += (size_t)sprintf(source + len, "<-]<]");
+        char expected[128];
+        for (int i = 0; i < 2 * k; ++i)
+            expected[i] = (char)(i + 1);
+
+        for (int level = 0; level <= OPTIMIZE_MAX_LEVEL; ++level) {
+            RunSetup setup = DEFAULT_SETUP;
+            setup.engine = ENGINE_JIT;
+            setup.opt_level = level;
+            RunResult *res = run_setup(source, NULL, 0, &setup);
+            int before = test_case_passed;
+            ASSERT_EQ_INT(res->status, VM_OK);
+            ASSERT_EQ_BYTES(res->output, res->size, expected, (size_t)(2 * k));
+            if (before && !test_case_passed)
+                fprintf(stderr, "    ...in \"%s\" at -O%d\n", source, level);
+            free(res);
+        }
+    }
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Checks when the output buffer hands bytes to its sink under each
+ * flush policy, on every engine.
+ */
+void test_flush_policies() {
+    TEST_CASE("Output flush policies");
+
+    // 8 * 8 * 8 * 8 * 50 zero bytes: a little over three full buffers
+    const char *large = "++++++++[>++++++++[>++++++++[>++++++++[>"
+                        "++++++++++++++++++++++++++++++++++++++++++++++++++"
+                        "[>.<-]<-]<-]<-]<-]";
+    for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+        RunSetup setup = DEFAULT_SETUP;
+        setup.engine = (Engine)e;
+        int before = test_case_passed;
+
+        setup.flush = FLUSH_NONE;
+        RunResult *res = run_setup("+++.+.+.", NULL, 0, &setup);
+        ASSERT_EQ_BYTES(res->output, res->size, "\x03\x04\x05", 3);
+        ASSERT_EQ_SIZE(res->flushes, 3);
+        free(res);
+
+        setup.flush = FLUSH_LINE;
+        res = run_setup("++++++++++>+++[<.>-]+.", NULL, 0, &setup);
+        ASSERT_EQ_BYTES(res->output, res->size, "\n\n\n\x01", 4);
+        ASSERT_EQ_SIZE(res->flushes, 4);
+        free(res);
+
+        setup.flush = FLUSH_FULL;
+        res = run_setup("++++++++++>+++[<.>-]+.", NULL, 0, &setup);
+        ASSERT_EQ_SIZE(res->flushes, 1);
+        free(res);
+        res = run_setup(large, NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_OK);
+        ASSERT_EQ_SIZE(res->size, 204800);
+        ASSERT_EQ_SIZE(res->flushes, 4);
+        ASSERT_EQ_SIZE(res->max_chunk, BF_OUT_BUFFER_SIZE);
+        free(res);
+        if (before && !test_case_passed)
+            fprintf(stderr, "    ...with %s\n", ENGINE_FLAGS[e]);
+    }
+
+    END_TEST_CASE;
+}
+
+
+typedef struct {
+    int fd;
+    const uint8_t *data;
+    size_t size;
+} PipeWriter;
+
+static void *pipe_writer_main(void *arg) {
+    PipeWriter *writer = arg;
+    size_t done = 0;
+    while (done < writer->size) {
+        ssize_t n = write(writer->fd, writer->data + done, writer->size - done);
+        if (n <= 0)
+            break;
+        done += (size_t)n;
+    }
+    close(writer->fd);
+    return NULL;
+}
+
+/**
+ * @brief Checks ',' reads a mapped regular file, a pipe and memory alike,
+ * and stores what each EOF policy asks for at every cell width.
+ */
+void test_input() {
+    TEST_CASE("Input from files, pipes and memory");
+
+    enum { INPUT_SIZE = 100000 };
+    static uint8_t data[INPUT_SIZE];
+    for (size_t i = 0; i < INPUT_SIZE; ++i)
+        data[i] = (uint8_t)(i % 254 + 1); // Never 0 or 255
+    FILE *file = tmpfile();
+    ASSERT_NOT_NULL(file);
+    if (!file)
+        abort();
+    ASSERT_EQ_SIZE(fwrite(data, 1, INPUT_SIZE, file), INPUT_SIZE);
+    fflush(file);
+
+    // Each copies its input and stops at EOF under its policy
+    static const struct {
+        const char *code;
+        EofPolicy eof;
+    } CATS[] = {
+        { ",+[-.,+]", EOF_MINUS_ONE },
+        { ",[.,]", EOF_ZERO },
+        { ",[.[-],]", EOF_UNCHANGED },
+    };
+    for (size_t c = 0; c < sizeof(CATS) / sizeof(*CATS); ++c) {
+        for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+            RunSetup setup = DEFAULT_SETUP;
+            setup.engine = (Engine)e;
+            setup.eof = CATS[c].eof;
+            int before = test_case_passed;
+
+            RunResult *res = run_setup(CATS[c].code, data, INPUT_SIZE, &setup);
+            ASSERT_EQ_BYTES(res->output, res->size, data, (size_t)INPUT_SIZE);
+            free(res);
+
+            // A mapped file starts at the descriptor's offset
+            lseek(fileno(file), 10, SEEK_SET);
+            setup.input_fd = fileno(file);
+            res = run_setup(CATS[c].code, NULL, 0, &setup);
+            ASSERT_EQ_BYTES(res->output, res->size, data + 10, (size_t)INPUT_SIZE - 10);
+            free(res);
+
+            int fds[2];
+            ASSERT_TRUE(pipe(fds) == 0);
+            PipeWriter writer = { fds[1], data, INPUT_SIZE };
+            pthread_t thread;
+            ASSERT_TRUE(pthread_create(&thread, NULL, pipe_writer_main, &writer) == 0);
+            setup.input_fd = fds[0];
+            res = run_setup(CATS[c].code, NULL, 0, &setup);
+            pthread_join(thread, NULL);
+            close(fds[0]);
+            ASSERT_EQ_BYTES(res->output, res->size, data, (size_t)INPUT_SIZE);
+            free(res);
+
+            if (before && !test_case_passed)
+                fprintf(stderr, "    ...in \"%s\" with %s\n", CATS[c].code, ENGINE_FLAGS[e]);
+        }
+    }
+    fclose(file);
+
+    // EOF stores -1, 0 or nothing in a cell of each width
+    static const CellWidth CELLS[] = { CELL_8, CELL_16, CELL_32 };
+    for (size_t w = 0; w < sizeof(CELLS) / sizeof(*CELLS); ++w) {
+        for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+            RunSetup setup = DEFAULT_SETUP;
+            setup.engine = (Engine)e;
+            setup.cell = CELLS[w];
+            int before = test_case_passed;
+
+            RunResult *res = run_setup(",+[[-]+.]", NULL, 0, &setup);
+            ASSERT_EQ_SIZE(res->size, 0); // -1 + 1 is zero at any width
+            free(res);
+            setup.eof = EOF_ZERO;
+            res = run_setup("+++,.", NULL, 0, &setup);
+            ASSERT_EQ_BYTES(res->output, res->size, "\x00", 1);
+            free(res);
+            setup.eof = EOF_UNCHANGED;
+            res = run_setup("+++,.", NULL, 0, &setup);
+            ASSERT_EQ_BYTES(res->output, res->size, "\x03", 1);
+            free(res);
+
+            if (before && !test_case_passed)
+                fprintf(stderr, "    ...with %s and %d-bit cells\n", ENGINE_FLAGS[e], 8 << w);
+        }
+    }
+
+    END_TEST_CASE;
+}
+
+
+typedef struct {
+    int fd;
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+} PipeReader;
+
+static void *pipe_reader_main(void *arg) {
+    PipeReader *reader = arg;
+    for (;;) {
+        // Read slowly, so spliced pages stay in the pipe while the VM
+        // fills the other half of its buffer
+        usleep(50);
+        size_t room = reader->capacity - reader->size;
+        ssize_t n = read(reader->fd, reader->data + reader->size, room < 4096 ? room : 4096);
+        if (n <= 0)
+            break;
+        reader->size += (size_t)n;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs a program writing half a megabyte to a pipe with a slow
+ * reader, spliced under FLUSH_FULL and copied otherwise, and checks the
+ * reader sees every byte unchanged.
+ */
+void test_pipe_output() {
+    TEST_CASE("Output to a pipe");
+
+    // 8 * 8 * 32 rounds of printing 1..255
+    const char *code = "++++++++[>++++++++[>++++++++++++++++++++++++++++++++"
+                       "[>+[.+]<-]<-]<-]";
+    enum { ROUNDS = 8 * 8 * 32, OUTPUT_SIZE = ROUNDS * 255 };
+    uint8_t *expected = malloc(OUTPUT_SIZE);
+    uint8_t *received = malloc(OUTPUT_SIZE + 1);
+    if (!expected || !received)
+        abort();
+    for (size_t i = 0; i < OUTPUT_SIZE; ++i)
+        expected[i] = (uint8_t)(i % 255 + 1);
+
+    static const FlushPolicy POLICIES[] = { FLUSH_FULL, FLUSH_LINE };
+    for (size_t f = 0; f < sizeof(POLICIES) / sizeof(*POLICIES); ++f) {
+        for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+            int fds[2];
+            ASSERT_TRUE(pipe(fds) == 0);
+            PipeReader reader = { fds[0], received, 0, OUTPUT_SIZE + 1 };
+            pthread_t thread;
+            ASSERT_TRUE(pthread_create(&thread, NULL, pipe_reader_main, &reader) == 0);
+
+            RunSetup setup = DEFAULT_SETUP;
+            setup.engine = (Engine)e;
+            setup.flush = POLICIES[f];
+            setup.output_fd = fds[1];
+            int before = test_case_passed;
+            RunResult *res = run_setup(code, NULL, 0, &setup);
+            close(fds[1]);
+            pthread_join(thread, NULL);
+            close(fds[0]);
+
+            ASSERT_EQ_INT(res->status, VM_OK);
+#ifdef __linux__
+            ASSERT_TRUE(res->spliced == (POLICIES[f] == FLUSH_FULL));
+#endif
+            ASSERT_EQ_BYTES(received, reader.size, expected, (size_t)OUTPUT_SIZE);
+            if (before && !test_case_passed)
+                fprintf(stderr, "    ...with %s, %s\n", ENGINE_FLAGS[e],
+                        POLICIES[f] == FLUSH_FULL ? "spliced" : "copied");
+            free(res);
+        }
+    }
+    free(expected);
+    free(received);
+
+    END_TEST_CASE;
+}
+
+
+// Programs with lambdas, loops and output that reuse tests run side by side
+static const char *const REENTRANT_PROGRAMS[] = {
+    "++++++(>+++++++<)[!-]>.",
+    "+++++ > + ( < + > ) ! . > .",
+    "++++++++[>++++[>++>+++>+++>+<<<<-]>+>+>->>+[<]<-]>>.---.+++++++..+++.",
+    "++++++++[>++++++++[>+.<-]<-]",
+};
+#define REENTRANT_COUNT (sizeof(REENTRANT_PROGRAMS) / sizeof(*REENTRANT_PROGRAMS))
+
+typedef struct {
+    Engine engine;
+    uint64_t hashes[REENTRANT_COUNT];
+    size_t sizes[REENTRANT_COUNT];
+    bool ok;
+} VmThread;
+
+/**
+ * @brief Runs every REENTRANT_PROGRAMS entry 50 times on one VM of its own
+ * and records the last output of each.
+ */
+static void *vm_thread_main(void *arg) {
+    VmThread *thread = arg;
+    RunSetup setup = DEFAULT_SETUP;
+    setup.engine = thread->engine;
+    RunResult *res = malloc(sizeof(*res));
+    BfVm *vm = vm_create();
+    OpcodeVector code[REENTRANT_COUNT];
+    thread->ok = res && vm;
+    for (size_t i = 0; i < REENTRANT_COUNT; ++i)
+        thread->ok = compile_code(REENTRANT_PROGRAMS[i], &setup, &code[i]) && thread->ok;
+    for (int round = 0; thread->ok && round < 50; ++round) {
+        for (size_t i = 0; i < REENTRANT_COUNT; ++i) {
+            run_on(vm, &code[i], NULL, 0, &setup, res);
+            thread->ok = thread->ok && res->status == VM_OK;
+            thread->hashes[i] = res->hash;
+            thread->sizes[i] = res->size;
+        }
+    }
+    for (size_t i = 0; i < REENTRANT_COUNT; ++i)
+        OpcodeVector_free(&code[i]);
+    if (vm)
+        vm_destroy(vm);
+    free(res);
+    return NULL;
+}
+
+/**
+ * @brief Runs programs on several VMs at once, on threads and interleaved
+ * on one thread, and checks each VM prints what a lone run does.
+ */
+void test_reentrant_vms() {
+    TEST_CASE("Independent VMs on threads and interleaved");
+
+    uint64_t hashes[REENTRANT_COUNT];
+    size_t sizes[REENTRANT_COUNT];
+    for (size_t i = 0; i < REENTRANT_COUNT; ++i) {
+        RunResult *res = run_setup(REENTRANT_PROGRAMS[i], NULL, 0, &DEFAULT_SETUP);
+        ASSERT_EQ_INT(res->status, VM_OK);
+        hashes[i] = res->hash;
+        sizes[i] = res->size;
+        free(res);
+    }
+
+    enum { THREADS = 6 };
+    VmThread threads[THREADS];
+    pthread_t ids[THREADS];
+    for (int t = 0; t < THREADS; ++t) {
+        threads[t].engine = (Engine)(t % (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)));
+        ASSERT_TRUE(pthread_create(&ids[t], NULL, vm_thread_main, &threads[t]) == 0);
+    }
+    for (int t = 0; t < THREADS; ++t) {
+        pthread_join(ids[t], NULL);
+        ASSERT_TRUE(threads[t].ok);
+        for (size_t i = 0; i < REENTRANT_COUNT; ++i) {
+            ASSERT_EQ_SIZE(threads[t].sizes[i], sizes[i]);
+            ASSERT_TRUE(threads[t].hashes[i] == hashes[i]);
+        }
+    }
+
+    // Two VMs taking turns: a lambda left defined on one must not show up
+    // on the other or on the next run
+    BfVm *a = vm_create();
+    BfVm *b = vm_create();
+    ASSERT_NOT_NULL(a);
+    ASSERT_NOT_NULL(b);
+    OpcodeVector define, call;
+    ASSERT_TRUE(compile_code("(+++.)", &DEFAULT_SETUP, &define));
+    ASSERT_TRUE(compile_code("!.", &DEFAULT_SETUP, &call));
+    RunResult *res = malloc(sizeof(*res));
+    if (!a || !b || !res)
+        abort();
+    for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+        RunSetup setup = DEFAULT_SETUP;
+        setup.engine = (Engine)e;
+        run_on(a, &define, NULL, 0, &setup, res);
+        ASSERT_EQ_INT(res->status, VM_OK);
+        run_on(b, &call, NULL, 0, &setup, res);
+        ASSERT_EQ_INT(res->status, VM_NO_LAMBDA);
+        run_on(a, &call, NULL, 0, &setup, res);
+        ASSERT_EQ_INT(res->status, VM_NO_LAMBDA);
+    }
+    free(res);
+    OpcodeVector_free(&define);
+    OpcodeVector_free(&call);
+    vm_destroy(a);
+    vm_destroy(b);
+
+    END_TEST_CASE;
+}
+
+
+typedef struct {
+    const JitRegion *programs;
+    uint64_t hashes[REENTRANT_COUNT];
+    size_t sizes[REENTRANT_COUNT];
+    bool ok;
+} SharedCodeThread;
+
+/**
+ * @brief Runs precompiled code like run_on() does source.
+ */
+static void execute_on(BfVm *vm, const JitRegion *program, RunResult *result) {
+    result->size = 0;
+    result->hash = 0xcbf29ce484222325ull;
+    InputBuffer_init_memory(&vm->in, NULL, 0, EOF_MINUS_ONE);
+    OutputBuffer_init_sink(&vm->out, capture_output, result, FLUSH_FULL);
+    vm->limits = DEFAULT_SETUP.limits;
+    vm->tape_left = false;
+    result->status = jit_execute(program, vm);
+}
+
+static void *shared_code_thread_main(void *arg) {
+    SharedCodeThread *thread = arg;
+    RunResult *res = malloc(sizeof(*res));
+    BfVm *vm = vm_create();
+    thread->ok = res && vm;
+    for (int round = 0; thread->ok && round < 50; ++round) {
+        for (size_t i = 0; i < REENTRANT_COUNT; ++i) {
+            execute_on(vm, &thread->programs[i], res);
+            thread->ok = thread->ok && res->status == VM_OK;
+            thread->hashes[i] = res->hash;
+            thread->sizes[i] = res->size;
+        }
+    }
+    if (vm)
+        vm_destroy(vm);
+    free(res);
+    return NULL;
+}
+
+/**
+ * @brief Compiles programs once and runs the same native code on several
+ * threads at once, and repeatedly on one VM.
+ */
+void test_shared_code() {
+    TEST_CASE("JIT code compiled once, run on many VMs");
+
+    JitRegion programs[REENTRANT_COUNT];
+    uint64_t hashes[REENTRANT_COUNT];
+    size_t sizes[REENTRANT_COUNT];
+    for (size_t i = 0; i < REENTRANT_COUNT; ++i) {
+        OpcodeVector code;
+        ASSERT_TRUE(compile_code(REENTRANT_PROGRAMS[i], &DEFAULT_SETUP, &code));
+        ASSERT_TRUE(jit_compile(&code, CELL_8, &programs[i]));
+        OpcodeVector_free(&code);
+
+        RunResult *res = run_setup(REENTRANT_PROGRAMS[i], NULL, 0, &DEFAULT_SETUP);
+        hashes[i] = res->hash;
+        sizes[i] = res->size;
+        free(res);
+    }
+
+    enum { THREADS = 4 };
+    SharedCodeThread threads[THREADS];
+    pthread_t ids[THREADS];
+    for (int t = 0; t < THREADS; ++t) {
+        threads[t].programs = programs;
+        ASSERT_TRUE(pthread_create(&ids[t], NULL, shared_code_thread_main, &threads[t]) == 0);
+    }
+    for (int t = 0; t < THREADS; ++t) {
+        pthread_join(ids[t], NULL);
+        ASSERT_TRUE(threads[t].ok);
+        for (size_t i = 0; i < REENTRANT_COUNT; ++i) {
+            ASSERT_EQ_SIZE(threads[t].sizes[i], sizes[i]);
+            ASSERT_TRUE(threads[t].hashes[i] == hashes[i]);
+        }
+    }
+
+    // A VM left on another cell width is switched to the program's
+    BfVm *vm = vm_create();
+    RunResult *res = malloc(sizeof(*res));
+    if (!vm || !res)
+        abort();
+    for (int round = 0; round < 2; ++round) {
+        vm->cell = CELL_32;
+        execute_on(vm, &programs[0], res);
+        ASSERT_EQ_INT(res->status, VM_OK);
+        ASSERT_EQ_INT(vm->cell, CELL_8);
+        ASSERT_EQ_BYTES(res->output, res->size, "*", 1);
+    }
+    free(res);
+    vm_destroy(vm);
+
+    for (size_t i = 0; i < REENTRANT_COUNT; ++i)
+        JitRegion_free(&programs[i]);
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Runs a program over many input files with batch_run() and checks
+ * each output file holds what a single run prints for that input.
+ */
+void test_batch() {
+    TEST_CASE("Batch runs over input files");
+
+    const char *source = ",+[.,+]"; // Copies its input plus one
+    char dir[] = "/tmp/brainbork_test_XXXXXX";
+    ASSERT_NOT_NULL(mkdtemp(dir));
+
+    enum { JOBS = 64 };
+    BatchJob jobs[JOBS + 1];
+    char inputs[JOBS + 1][64];
+    static uint8_t data[JOBS * 40];
+    for (size_t i = 0; i < sizeof(data); ++i)
+        data[i] = (uint8_t)(i % 200);
+    for (int j = 0; j < JOBS; ++j) {
+        snprintf(inputs[j], sizeof(inputs[j]), "%s/%d", dir, j);
+        FILE *f = fopen(inputs[j], "wb");
+        ASSERT_NOT_NULL(f);
+        if (!f)
+            abort();
+        fwrite(data, 1, (size_t)j * 40, f);
+        fclose(f);
+    }
+    // An input that does not exist only fails its own job
+    snprintf(inputs[JOBS], sizeof(inputs[JOBS]), "%s/missing", dir);
+    for (int j = 0; j <= JOBS; ++j) {
+        jobs[j] = (BatchJob){ .input = inputs[j], .output = malloc(strlen(inputs[j]) + 5) };
+        if (!jobs[j].output)
+            abort();
+        sprintf(jobs[j].output, "%s.out", inputs[j]);
+    }
+
+    OpcodeVector code;
+    JitRegion program;
+    ASSERT_TRUE(compile_code(source, &DEFAULT_SETUP, &code));
+    ASSERT_TRUE(jit_compile(&code, CELL_8, &program));
+    OpcodeVector_free(&code);
+    BatchOptions options = { 4, EOF_MINUS_ONE, { 0, 0.0 }, false };
+    BatchStats stats;
+    ASSERT_TRUE(batch_run(&program, jobs, JOBS + 1, &options, &stats));
+    JitRegion_free(&program);
+    ASSERT_EQ_SIZE(stats.threads, 4);
+
+    for (int j = 0; j < JOBS; ++j) {
+        RunResult *expected = run_setup(source, data, (size_t)j * 40, &DEFAULT_SETUP);
+        char *output = read_file(jobs[j].output);
+        ASSERT_TRUE(jobs[j].ok);
+        ASSERT_NOT_NULL(output);
+        if (output)
+            ASSERT_EQ_BYTES(output, jobs[j].bytes_out, expected->output, expected->size);
+        ASSERT_EQ_SIZE(jobs[j].bytes_in, (size_t)j * 40);
+        free(output);
+        free(expected);
+        unlink(jobs[j].output);
+        unlink(inputs[j]);
+    }
+    ASSERT_TRUE(!jobs[JOBS].ok);
+    unlink(jobs[JOBS].output);
+    for (int j = 0; j <= JOBS; ++j)
+        free(jobs[j].output);
+    ASSERT_TRUE(rmdir(dir) == 0);
+
+    END_TEST_CASE;
+}
+
+
+static bool refuse_output(void *ctx, const uint8_t *data, size_t size) {
+    (void)ctx;
+    (void)data;
+    (void)size;
+    return false;
+}
+
+static ptrdiff_t read_letters(void *ctx, uint8_t *buf, size_t size) {
+    size_t *left = ctx;
+    size_t n = size < *left ? size : *left;
+    memset(buf, 'x', n);
+    *left -= n;
+    return (ptrdiff_t)n;
+}
+
+/**
+ * @brief Drives the embedding API: compile errors, each engine and cell
+ * width, output into a caller's buffer or callback, input from a callback,
+ * run failures, and a reused BfContext matching BfProgram_run().
+ */
+void test_library() {
+    TEST_CASE("Embedding library");
+
+    BfProgram *program = NULL;
+    ASSERT_EQ_INT(BfProgram_compile("[", 1, NULL, &program), BF_ERR_PARSE);
+    ASSERT_TRUE(program == NULL);
+    ASSERT_EQ_INT(BfProgram_compile("+", 1, NULL, NULL), BF_ERR_ARGS);
+    BfCompileOptions odd_cells = { BF_ENGINE_JIT, 3, 12 };
+    ASSERT_EQ_INT(BfProgram_compile("+", 1, &odd_cells, &program), BF_ERR_ARGS);
+    // The JIT is refused, not failed, where this build has no backend
+    BfCompileOptions jit = { BF_ENGINE_JIT, 3, 8 };
+    ASSERT_EQ_INT(BfProgram_compile("+", 1, &jit, &program), HOST_HAS_JIT ? BF_OK : BF_ERR_UNSUPPORTED);
+    ASSERT_TRUE((program != NULL) == HOST_HAS_JIT);
+    BfProgram_free(program);
+    program = NULL;
+    for (int status = BF_OK; status <= BF_ERR_NO_LAMBDA; ++status)
+        ASSERT_TRUE(BfStatus_string((BfStatus)status)[0] != '\0');
+
+    const char *hello = "++++++++[>++++[>++>+++>+++>+<<<<-]>+>+>->>+[<]<-]>>.---.+++++++..+++.";
+    static const BfEngine ENGINES[] = { BF_ENGINE_INTERPRETER, BF_ENGINE_JIT };
+    static const int CELL_BITS[] = { 8, 16, 32 };
+    for (size_t e = 0; e < sizeof(ENGINES) / sizeof(*ENGINES); ++e) {
+        for (size_t w = 0; w < sizeof(CELL_BITS) / sizeof(*CELL_BITS); ++w) {
+            BfCompileOptions options = { ENGINES[e], 3, CELL_BITS[w] };
+            if (ENGINES[e] == BF_ENGINE_JIT && !HOST_HAS_JIT)
+                continue;
+            int before = test_case_passed;
+            ASSERT_EQ_INT(BfProgram_compile(hello, strlen(hello), &options, &program), BF_OK);
+            if (!program)
+                continue;
+            BfProgramStats program_stats;
+            BfProgram_stats(program, &program_stats);
+            ASSERT_TRUE((program_stats.code_bytes > 0) == (ENGINES[e] == BF_ENGINE_JIT));
+
+            uint8_t output[16];
+            BfRunOptions run = { .output = output, .output_capacity = sizeof(output) };
+            BfRunStats stats;
+            ASSERT_EQ_INT(BfProgram_run(program, &run, &stats), BF_OK);
+            ASSERT_EQ_BYTES(output, stats.output_bytes, "HELLO", 5);
+
+            // A buffer too small keeps the prefix and counts the rest
+            run.output_capacity = 3;
+            ASSERT_EQ_INT(BfProgram_run(program, &run, &stats), BF_ERR_OUTPUT_FULL);
+            ASSERT_EQ_SIZE(stats.output_bytes, 5);
+            ASSERT_EQ_BYTES(output, 3, "HEL", 3);
+
+            BfRunOptions refused = { .write = refuse_output };
+            ASSERT_EQ_INT(BfProgram_run(program, &refused, &stats), BF_ERR_IO);
+            BfProgram_free(program);
+
+            // Two runs of 255 * 255 bytes of 8-bit output, more than one
+            // 64 KiB chunk: with a buffer, nothing past it reaches the
+            // callback
+            const char *long_output = "++[>-[>-[.-]<-]<-]";
+            if (CELL_BITS[w] == 8 &&
+                BfProgram_compile(long_output, strlen(long_output), &options, &program) == BF_OK) {
+                BfRunOptions both = { .output = output, .output_capacity = 3, .write = refuse_output };
+                ASSERT_EQ_INT(BfProgram_run(program, &both, &stats), BF_ERR_OUTPUT_FULL);
+                ASSERT_EQ_SIZE(stats.output_bytes, 2 * 255 * 255);
+                ASSERT_EQ_BYTES(output, 3, "\xff\xfe\xfd", 3);
+                BfProgram_free(program);
+            }
+            if (before && !test_case_passed)
+                fprintf(stderr, "    ...with engine %d and %d-bit cells\n", (int)ENGINES[e], CELL_BITS[w]);
+        }
+    }
+
+    // Input through a callback, and each kind of failed run
+    ASSERT_EQ_INT(BfProgram_compile(",[.,]", 5, NULL, &program), BF_OK);
+    uint8_t output[4096];
+    size_t left = 3000;
+    BfRunOptions run = { .read = read_letters, .read_ctx = &left, .output = output,
+                         .output_capacity = sizeof(output), .eof = BF_EOF_ZERO };
+    BfRunStats stats;
+    ASSERT_EQ_INT(BfProgram_run(program, &run, &stats), BF_OK);
+    ASSERT_EQ_SIZE(stats.input_bytes, 3000);
+    ASSERT_EQ_SIZE(stats.output_bytes, 3000);
+    ASSERT_TRUE(output[0] == 'x' && output[2999] == 'x');
+    BfProgram_free(program);
+
+    static const struct {
+        const char *code;
+        BfStatus status;
+    } FAILURES[] = {
+        { "+[]", BF_ERR_OUT_OF_FUEL },
+        { "<+", BF_ERR_TAPE_FAULT },
+        { "!", BF_ERR_NO_LAMBDA },
+        { "(!)!", BF_ERR_STACK_OVERFLOW }, // well before the fuel runs out
+    };
+    for (size_t f = 0; f < sizeof(FAILURES) / sizeof(*FAILURES); ++f) {
+        ASSERT_EQ_INT(BfProgram_compile(FAILURES[f].code, strlen(FAILURES[f].code), NULL, &program), BF_OK);
+        BfRunOptions limited = { .fuel = 100000 };
+        ASSERT_EQ_INT(BfProgram_run(program, &limited, &stats), FAILURES[f].status);
+        if (FAILURES[f].status == BF_ERR_TAPE_FAULT)
+            ASSERT_EQ_INT(stats.fault_cell, -1);
+        BfProgram_free(program);
+    }
+
+    // One context running programs back to back matches fresh runs
+    BfContext *context = NULL;
+    ASSERT_EQ_INT(BfContext_create(&context), BF_OK);
+    ASSERT_NOT_NULL(context);
+    for (int round = 0; context && round < 3; ++round) {
+        for (size_t i = 0; i < REENTRANT_COUNT; ++i) {
+            const char *code = REENTRANT_PROGRAMS[i];
+            ASSERT_EQ_INT(BfProgram_compile(code, strlen(code), NULL, &program), BF_OK);
+            uint8_t fresh[1024], reused[1024];
+            BfRunOptions a = { .output = fresh, .output_capacity = sizeof(fresh) };
+            BfRunOptions b = { .output = reused, .output_capacity = sizeof(reused) };
+            BfRunStats fresh_stats, reused_stats;
+            ASSERT_EQ_INT(BfProgram_run(program, &a, &fresh_stats), BF_OK);
+            ASSERT_EQ_INT(BfContext_run(context, program, &b, &reused_stats), BF_OK);
+            ASSERT_EQ_BYTES(reused, reused_stats.output_bytes, fresh, fresh_stats.output_bytes);
+            BfProgram_free(program);
+        }
+    }
+    BfContext_free(context);
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Runs the brainbork binary on `source` with `options` and returns
+ * its exit status, with its stdout and stderr in `output`.
+ */
+static int run_cli(const char *options, const char *source, char *output, size_t capacity) {
+    char path[] = "/tmp/brainbork_test_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || write(fd, source, strlen(source)) != (ssize_t)strlen(source))
+        abort();
+    close(fd);
+    char command[1024];
+    snprintf(command, sizeof(command), "./brainbork %s %s 2>&1", options, path);
+    FILE *pipe = popen(command, "r");
+    if (!pipe)
+        abort();
+    size_t size = fread(output, 1, capacity - 1, pipe);
+    output[size] = '\0';
+    int status = pclose(pipe);
+    unlink(path);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/**
+ * @brief Checks fuel and timeouts stop endless loops and endless lambda
+ * calls on every engine, and leave a program with enough of both alone.
+ */
+void test_limits() {
+    TEST_CASE("Fuel and timeouts");
+
+    static const char *const ENDLESS[] = {
+        "+[]", // an empty back-edge
+        "+[>+<]", // one that does some work
+        "(+)+[!-]", // a call per iteration
+    };
+    for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+        for (size_t i = 0; i < sizeof(ENDLESS) / sizeof(*ENDLESS); ++i) {
+            RunSetup setup = DEFAULT_SETUP;
+            setup.engine = (Engine)e;
+            int before = test_case_passed;
+
+            setup.limits = (VmLimits){ 100000, 0.0 };
+            RunResult *res = run_setup(ENDLESS[i], NULL, 0, &setup);
+            ASSERT_EQ_INT(res->status, VM_OUT_OF_FUEL);
+            free(res);
+
+            setup.limits = (VmLimits){ 0, 0.2 };
+            double begin = now_seconds();
+            res = run_setup(ENDLESS[i], NULL, 0, &setup);
+            double seconds = now_seconds() - begin;
+            ASSERT_EQ_INT(res->status, VM_TIMEOUT);
+            ASSERT_TRUE(seconds >= 0.2 && seconds < 2.0);
+            free(res);
+
+            if (before && !test_case_passed)
+                fprintf(stderr, "    ...in \"%s\" with %s\n", ENDLESS[i], ENGINE_FLAGS[e]);
+        }
+
+        // Fuel counts back-edges: 8 * 8 * 8 + 8 * 8 + 8 = 584 of them
+        RunSetup setup = DEFAULT_SETUP;
+        setup.engine = (Engine)e;
+        const char *nested = "++++++++[>++++++++[>++++++++[>+.<-]<-]<-]";
+        setup.limits = (VmLimits){ 584, 60.0 };
+        RunResult *res = run_setup(nested, NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_OK);
+        ASSERT_EQ_SIZE(res->size, 512);
+        free(res);
+        setup.limits = (VmLimits){ 100, 60.0 };
+        res = run_setup(nested, NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_OUT_OF_FUEL);
+        ASSERT_TRUE(res->size < 512);
+        free(res);
+
+        // The command line reports either and fails
+        char options[64], output[4096];
+        snprintf(options, sizeof(options), "%s --fuel=1000", ENGINE_FLAGS[e]);
+        ASSERT_TRUE(run_cli(options, "+[]", output, sizeof(output)) != 0);
+        ASSERT_TRUE(strstr(output, "out of fuel") != NULL);
+        snprintf(options, sizeof(options), "%s --timeout=0.1", ENGINE_FLAGS[e]);
+        ASSERT_TRUE(run_cli(options, "+[]", output, sizeof(output)) != 0);
+        ASSERT_TRUE(strstr(output, "timed out") != NULL);
+    }
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Checks a pointer that leaves either end of the tape stops the run
+ * with VM_TAPE_FAULT at the right cell, keeps the output printed before
+ * it, and leaves the VM fit for the next run.
+ */
+void test_tape_faults() {
+    TEST_CASE("Tape faults");
+
+    for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+        RunSetup setup = DEFAULT_SETUP;
+        setup.engine = (Engine)e;
+        int before = test_case_passed;
+
+        RunResult *res = run_setup("+.<+", NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_TAPE_FAULT);
+        ASSERT_EQ_INT(res->fault_cell, -1);
+        ASSERT_EQ_BYTES(res->output, res->size, "\x01", 1);
+        free(res);
+        res = run_setup(">>+[<<<<<<<<<<.]", NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_TAPE_FAULT);
+        ASSERT_EQ_INT(res->fault_cell, -8);
+        free(res);
+        // Moving off the tape without touching it is fine
+        res = run_setup("<<<>>>+.", NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_OK);
+        free(res);
+        setup.tape_left = true;
+        res = run_setup("<<<+.", NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_OK);
+        free(res);
+
+        if (before && !test_case_passed)
+            fprintf(stderr, "    ...with %s\n", ENGINE_FLAGS[e]);
+    }
+
+    // Off the right end, a mebibyte at a time: on base pages only one page
+    // per step gets committed
+    enum { STRIDE = 1 << 20 };
+    char *stride = malloc(STRIDE + 8);
+    if (!stride)
+        abort();
+    stride[0] = '+';
+    stride[1] = '[';
+    memset(stride + 2, '>', STRIDE);
+    strcpy(stride + 2 + STRIDE, "+]");
+    huge_pages_set_enabled(false);
+    BfVm *vm = vm_create();
+    RunResult *res = malloc(sizeof(*res));
+    if (!vm || !res)
+        abort();
+    OpcodeVector code, fault, after;
+    ASSERT_TRUE(compile_code(stride, &DEFAULT_SETUP, &code));
+    ASSERT_TRUE(compile_code("<+", &DEFAULT_SETUP, &fault));
+    ASSERT_TRUE(compile_code("+.>+.", &DEFAULT_SETUP, &after));
+    for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+        RunSetup setup = DEFAULT_SETUP;
+        setup.engine = (Engine)e;
+        int before = test_case_passed;
+        run_on(vm, &code, NULL, 0, &setup, res);
+        ASSERT_EQ_INT(res->status, VM_TAPE_FAULT);
+        ASSERT_EQ_INT(res->fault_cell, (ptrdiff_t)(vm->tape_size / STRIDE * STRIDE));
+        run_on(vm, &fault, NULL, 0, &setup, res);
+        ASSERT_EQ_INT(res->status, VM_TAPE_FAULT);
+        run_on(vm, &after, NULL, 0, &setup, res);
+        ASSERT_EQ_INT(res->status, VM_OK);
+        ASSERT_EQ_BYTES(res->output, res->size, "\x01\x01", 2);
+        if (before && !test_case_passed)
+            fprintf(stderr, "    ...with %s\n", ENGINE_FLAGS[e]);
+    }
+    OpcodeVector_free(&code);
+    OpcodeVector_free(&fault);
+    OpcodeVector_free(&after);
+    vm_destroy(vm);
+    huge_pages_set_enabled(true);
+    free(res);
+    free(stride);
+
+    END_TEST_CASE;
+}
+
+
+static sigjmp_buf g_host_fault;
+
+static void host_fault_handler(int sig) {
+    (void)sig;
+    siglongjmp(g_host_fault, 1);
+}
+
+/**
+ * @brief Checks cells a run leaves behind, near cell 0 or 16 MiB out, read
+ * as zero on the VM's next run from either starting cell, and that runs
+ * need no signal handler of the VM's own except for guard hits: with a
+ * host handler installed in its place, far cells still work and the host
+ * still sees its own faults.
+ */
+void test_tape_reset() {
+    TEST_CASE("Tape reset between runs");
+
+    enum { FAR = 16 << 20 };
+    char *far_write = malloc(FAR + 16);
+    char *far_read = malloc(FAR + 16);
+    if (!far_write || !far_read)
+        abort();
+    memset(far_write, '>', FAR);
+    strcpy(far_write + FAR, "+++++.");
+    memset(far_read, '>', FAR);
+    strcpy(far_read + FAR, ".");
+
+    BfVm *vm = vm_create();
+    RunResult *res = malloc(sizeof(*res));
+    if (!vm || !res)
+        abort();
+    OpcodeVector write_far, read_far, write_near, read_near;
+    ASSERT_TRUE(compile_code(far_write, &DEFAULT_SETUP, &write_far));
+    ASSERT_TRUE(compile_code(far_read, &DEFAULT_SETUP, &read_far));
+    ASSERT_TRUE(compile_code("+++++>+++++<<+++++.", &DEFAULT_SETUP, &write_near));
+    ASSERT_TRUE(compile_code(">.<.<.", &DEFAULT_SETUP, &read_near));
+
+    for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+        for (int left = 0; left < 2; ++left) {
+            RunSetup setup = DEFAULT_SETUP;
+            setup.engine = (Engine)e;
+            setup.tape_left = left;
+            int before = test_case_passed;
+
+            run_on(vm, &write_far, NULL, 0, &setup, res);
+            ASSERT_EQ_BYTES(res->output, res->size, "\x05", 1);
+            run_on(vm, &read_far, NULL, 0, &setup, res);
+            ASSERT_EQ_BYTES(res->output, res->size, "\x00", 1);
+            if (left) {
+                run_on(vm, &write_near, NULL, 0, &setup, res);
+                ASSERT_EQ_BYTES(res->output, res->size, "\x05", 1);
+                run_on(vm, &read_near, NULL, 0, &setup, res);
+                ASSERT_EQ_BYTES(res->output, res->size, "\x00\x00\x00", 3);
+            }
+            if (before && !test_case_passed)
+                fprintf(stderr, "    ...with %s%s\n", ENGINE_FLAGS[e], left ? " --tape-left" : "");
+        }
+    }
+
+    // A host that installs its own handler after the VM's
+    struct sigaction host, saved_segv, saved_bus;
+    memset(&host, 0, sizeof(host));
+    host.sa_handler = host_fault_handler;
+    sigemptyset(&host.sa_mask);
+    sigaction(SIGSEGV, &host, &saved_segv);
+    sigaction(SIGBUS, &host, &saved_bus);
+    for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+        RunSetup setup = DEFAULT_SETUP;
+        setup.engine = (Engine)e;
+        if (sigsetjmp(g_host_fault, 1) == 0) {
+            run_on(vm, &write_far, NULL, 0, &setup, res);
+            ASSERT_EQ_INT(res->status, VM_OK);
+            ASSERT_EQ_BYTES(res->output, res->size, "\x05", 1);
+        } else {
+            ASSERT_TRUE(!"a far cell reached the host's handler");
+        }
+    }
+    volatile bool host_saw_fault = false;
+    uint8_t *page = mmap(NULL, base_page_size(), PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT_TRUE(page != MAP_FAILED);
+    if (sigsetjmp(g_host_fault, 1) == 0)
+        *(volatile uint8_t *)page = 1;
+    else
+        host_saw_fault = true;
+    ASSERT_TRUE(host_saw_fault);
+    munmap(page, base_page_size());
+    sigaction(SIGSEGV, &saved_segv, NULL);
+    sigaction(SIGBUS, &saved_bus, NULL);
+
+    OpcodeVector_free(&write_far);
+    OpcodeVector_free(&read_far);
+    OpcodeVector_free(&write_near);
+    OpcodeVector_free(&read_near);
+    vm_destroy(vm);
+    free(res);
+    free(far_write);
+    free(far_read);
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Checks arithmetic, multiply loops and scans wrap at the cell
+ * width on every engine, unoptimized and fully optimized: each program
+ * prints a zero byte only if its cell did not wrap to zero.
+ */
+void test_cell_widths() {
+    TEST_CASE("Cell widths");
+
+    char *carry_16 = malloc(65536 + 16);
+    if (!carry_16)
+        abort();
+    memset(carry_16, '+', 65536);
+    strcpy(carry_16 + 65536, "[.[-]]");
+
+    const struct {
+        const char *code;
+        int wraps_below; // cell widths below this many bits wrap to zero
+    } WRAPS[] = {
+        { "++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++"
+          "++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++"
+          "++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++"
+          "++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++"
+          "[.[-]]", 16 }, // 256
+        { "++++++++++++++++[>++++++++++++++++<-]>[.[-]]", 16 }, // 16 * 16
+        { "++++++++++++++++[>++++++++++++++++[>++++++++++++++++<-]<-]>>"
+          "[>++++++++++++++++<-]>[.[-]]", 32 }, // 16 * 16 * 16 * 16
+        { carry_16, 32 }, // 65536
+        // Cells whose low byte is zero must not stop a scan
+        { ">++++++++++++++++[>++++++++++++++++>++++++++++++++++<<-]>[>]<[.[-]]", 16 },
+        // -1 + 1 is zero at every width
+        { "-+[.[-]]-------->++++++++[<+>-]<[.[-]]", 64 },
+    };
+    for (size_t i = 0; i < sizeof(WRAPS) / sizeof(*WRAPS); ++i) {
+        for (size_t w = 0; w < CELL_WIDTH_COUNT; ++w) {
+            for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+                for (int level = 0; level <= OPTIMIZE_MAX_LEVEL; level += OPTIMIZE_MAX_LEVEL) {
+                    RunSetup setup = DEFAULT_SETUP;
+                    setup.engine = (Engine)e;
+                    setup.cell = CELL_WIDTHS[w];
+                    setup.opt_level = level;
+                    RunResult *res = run_setup(WRAPS[i].code, NULL, 0, &setup);
+                    int before = test_case_passed;
+                    ASSERT_EQ_INT(res->status, VM_OK);
+                    ASSERT_EQ_SIZE(res->size, (8 << w) < WRAPS[i].wraps_below ? 0 : 1);
+                    if (before && !test_case_passed)
+                        fprintf(stderr, "    ...in program %zu with %s -O%d --cell=%d\n", i,
+                                ENGINE_FLAGS[e], level, 8 << w);
+                    free(res);
+                }
+            }
+        }
+    }
+    free(carry_16);
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Checks the tape and JIT code cache are aligned to the huge page
+ * size where huge pages are in use, that the huge page holding cell 0
+ * stays on base pages, and that turning huge pages off leaves both on base
+ * pages.
+ */
+void test_huge_pages() {
+    TEST_CASE("Huge pages");
+
+    OpcodeVector code;
+    ASSERT_TRUE(compile_code("+[>+<-]>.", &DEFAULT_SETUP, &code));
+    RunResult *res = malloc(sizeof(*res));
+    if (!res)
+        abort();
+
+    for (int enabled = 1; enabled >= 0; --enabled) {
+        huge_pages_set_enabled(enabled);
+        size_t huge = huge_page_size();
+        if (!enabled)
+            ASSERT_EQ_SIZE(huge, 0);
+        BfVm *vm = vm_create();
+        JitRegion region;
+        ASSERT_NOT_NULL(vm);
+        ASSERT_TRUE(jit_compile(&code, CELL_8, &region));
+        if (!vm)
+            abort();
+        ASSERT_EQ_SIZE(vm->tape_huge_page, huge);
+        if (huge) {
+            ASSERT_EQ_SIZE((uintptr_t)vm->tape % huge, 0);
+            ASSERT_EQ_SIZE((uintptr_t)region.buffer.buffer % huge, 0);
+        }
+
+        // A short run only commits base pages around cell 0
+        RunSetup setup = DEFAULT_SETUP;
+        setup.engine = ENGINE_JIT;
+        run_on(vm, &code, NULL, 0, &setup, res);
+        ASSERT_EQ_BYTES(res->output, res->size, "\x01", 1);
+        PageUsage usage;
+        if (PageUsage_measure(vm->tape, huge ? huge : base_page_size(), &usage)) {
+            ASSERT_TRUE(usage.resident > 0);
+            ASSERT_EQ_SIZE(usage.huge, 0);
+        }
+
+        JitRegion_free(&region);
+        vm_destroy(vm);
+    }
+    huge_pages_set_enabled(true);
+    free(res);
+    OpcodeVector_free(&code);
+
+    END_TEST_CASE;
+}
+
+
+/**
+ * @brief Checks lambda and call semantics on every engine, and that the
+ * lambda and call stacks stop a run with VM_STACK_OVERFLOW exactly past
+ * their capacity instead of running off their arena.
+ */
+void test_lambda_stacks() {
+    TEST_CASE("Lambda and call stacks");
+
+    test_program("Repeated Calls", "(+.)!!!", "", "\x01\x02\x03");
+    test_program("Latest Lambda Wins", "(+.)(++.)!", "", "\x02");
+    test_program("Lambda Defined In Lambda", "((+++.)!)!!", "", "\x03\x06");
+    test_program("Captured Pointer", "(>+.<)>>>!.", "", "\x01\x00");
+    test_program("Recursion", "(-[!]>+<)+++++!>.", "", "\x05");
+
+    OpcodeVector code;
+    ASSERT_TRUE(!scanner("(]", &code));
+    ASSERT_TRUE(!scanner("[(])", &code));
+
+    // Each call to the lambda takes one from the counter and calls again
+    // until it is zero, so a count of N nests N calls
+    char *nested[2];
+    for (int i = 0; i < 2; ++i) {
+        size_t count = BF_CALL_DEPTH + i;
+        nested[i] = malloc(count + 8);
+        if (!nested[i])
+            abort();
+        strcpy(nested[i], "(-[!])");
+        memset(nested[i] + 6, '+', count);
+        strcpy(nested[i] + 6 + count, "!");
+    }
+
+    for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+        RunSetup setup = DEFAULT_SETUP;
+        setup.engine = (Engine)e;
+        setup.cell = CELL_32;
+        int before = test_case_passed;
+
+        RunResult *res = run_setup(nested[0], NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_OK);
+        free(res);
+        res = run_setup(nested[1], NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_STACK_OVERFLOW);
+        free(res);
+
+        setup.cell = CELL_8;
+        // Every iteration defines one more lambda
+        res = run_setup("+[()]", NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_STACK_OVERFLOW);
+        free(res);
+        res = run_setup("(!)!", NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_STACK_OVERFLOW);
+        free(res);
+        res = run_setup("+!", NULL, 0, &setup);
+        ASSERT_EQ_INT(res->status, VM_NO_LAMBDA);
+        free(res);
+
+        if (before && !test_case_passed)
+            fprintf(stderr, "    ...with %s\n", ENGINE_FLAGS[e]);
+    }
+    free(nested[0]);
+    free(nested[1]);
+
+    END_TEST_CASE;
+}
+
+
+typedef struct {
+    Engine engine;
+    int deep_status;
+    int shallow_status;
+    size_t shallow_size;
+    uint8_t shallow_out;
+} SmallStackThread;
+
+/**
+ * @brief Runs unbounded and 1000-deep recursion on a thread with a small
+ * stack and records how each ended.
+ */
+static void *small_stack_thread_main(void *arg) {
+    SmallStackThread *thread = arg;
+    RunSetup setup = DEFAULT_SETUP;
+    setup.engine = thread->engine;
+    RunResult *res = run_setup("(!)!", NULL, 0, &setup);
+    thread->deep_status = res->status;
+    free(res);
+    setup.cell = CELL_16;
+    // 1000 calls deep, each adding one to the cell right of the counter
+    res = run_setup("(-[!]>+<)++++++++++[>++++++++++<-]>[<++++++++++>-]<!>.", NULL, 0,
+                    &setup);
+    thread->shallow_status = res->status;
+    thread->shallow_size = res->size;
+    thread->shallow_out = res->output[0];
+    free(res);
+    return NULL;
+}
+
+/**
+ * @brief Checks that JIT call frames, which live on the native stack, stop
+ * at a small thread stack with VM_STACK_OVERFLOW instead of running off it,
+ * while recursion that fits still runs.
+ */
+void test_small_stacks() {
+    TEST_CASE("Lambda recursion on small thread stacks");
+
+    static const size_t STACK_SIZES[] = {256 << 10, 2 << 20};
+    for (size_t i = 0; i < sizeof(STACK_SIZES) / sizeof(*STACK_SIZES); ++i) {
+        for (int e = 0; e < (int)(sizeof(ENGINE_FLAGS) / sizeof(*ENGINE_FLAGS)); ++e) {
+            SmallStackThread thread = {(Engine)e, -1, -1, 0, 0};
+            pthread_attr_t attr;
+            pthread_t id;
+            ASSERT_TRUE(pthread_attr_init(&attr) == 0);
+            ASSERT_TRUE(pthread_attr_setstacksize(&attr, STACK_SIZES[i]) == 0);
+            ASSERT_TRUE(pthread_create(&id, &attr, small_stack_thread_main, &thread) == 0);
+            pthread_join(id, NULL);
+            pthread_attr_destroy(&attr);
+
+            int before = test_case_passed;
+            ASSERT_EQ_INT(thread.deep_status, VM_STACK_OVERFLOW);
+            ASSERT_EQ_INT(thread.shallow_status, VM_OK);
+            ASSERT_EQ_SIZE(thread.shallow_size, 1);
+            ASSERT_EQ_INT(thread.shallow_out, 1000 & 0xff);
+            if (before && !test_case_passed)
+                fprintf(stderr, "    ...with %s on a %zu KiB stack\n", ENGINE_FLAGS[e],
+                        STACK_SIZES[i] >> 10);
+        }
+    }
+
     END_TEST_CASE;
 }
 
 
 // --- Main Test Runner ---
-int main(void) {
+int main(int argc, char **argv) {
+    g_verbose = argc > 1 && strcmp(argv[1], "-v") == 0;
     printf("===== Running Brainfork Test Suite =====\n");
-    
+
     test_data_structures();
     test_scanner();
     test_optimizer();
     test_execution();
-    
+    test_examples();
+    test_random_programs();
+    test_tier_compiler();
+    test_many_regions();
+    test_large_program();
+    test_cached_cell();
+    test_branch_lengths();
+    test_flush_policies();
+    test_input();
+    test_pipe_output();
+    test_reentrant_vms();
+    test_shared_code();
+    test_batch();
+    test_library();
+    test_limits();
+    test_tape_faults();
+    test_tape_reset();
+    test_cell_widths();
+    test_huge_pages();
+    test_lambda_stacks();
+    test_small_stacks();
+
     if (g_tests_failed > 0) {
         printf("\n======= %d / %d TESTS FAILED =======\n", g_tests_failed, g_tests_run);
         return 1;
     }
-    
+
     printf("\n======= ALL %d TESTS PASSED =======\n", g_tests_run);
     return 0;
 }
-
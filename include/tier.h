@@ -0,0 +1,74 @@
+#ifndef BF_TIER_H
+#define BF_TIER_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "jit.h"
+
+/*
+ * @brief One loop the interpreter may hand to the background compiler.
+ * size_t start_pc: the loop's op_jf.
+ * size_t end_pc: one past its op_jt.
+ * entry: published by the compiler thread once the native code is ready.
+ */
+typedef struct {
+	size_t start_pc;
+	size_t end_pc;
+	atomic_bool requested;
+	_Atomic(JitRegionFn) entry;
+	JitRegion region;
+} TierLoop;
+
+/*
+ * @brief A background thread that compiles hot loops with
+ * jit_compile_region() while the interpreter keeps running.
+ * Requests go through a fixed queue sized to the loop count (each loop is
+ * requested at most once), guarded by `lock`.
+ */
+typedef struct {
+	const OpcodeVector *code;
+	CellWidth cell;
+	TierLoop *loops;
+	size_t loop_count;
+
+	size_t *queue;
+	size_t queue_head;
+	size_t queue_tail;
+	bool stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	pthread_t thread;
+
+	atomic_size_t compiled;
+} TierCompiler;
+
+/**
+ * @brief Starts the compiler thread for `loop_count` loops of `code`, to be
+ * compiled for cells of width `cell`; the caller then fills in each loop's
+ * start_pc/end_pc before requesting it.
+ */
+bool TierCompiler_start(TierCompiler *tier, const OpcodeVector *code,
+			CellWidth cell, size_t loop_count);
+
+/**
+ * @brief Queues loop `id` for compilation. Repeated requests are ignored.
+ */
+void TierCompiler_request(TierCompiler *tier, size_t id);
+
+/**
+ * @brief Returns loop `id`'s native code, or NULL if it is not ready.
+ */
+static inline JitRegionFn TierCompiler_entry(TierCompiler *tier, size_t id)
+{
+	return atomic_load_explicit(&tier->loops[id].entry,
+				    memory_order_acquire);
+}
+
+/**
+ * @brief Stops the thread (finishing the loop it is compiling) and frees
+ * all compiled code. Nothing may run native code from it afterwards.
+ */
+void TierCompiler_stop(TierCompiler *tier);
+
+#endif // BF_TIER_H
@@ -3,6 +3,8 @@
 
 #include "brainfork.h"
 
+#include <stddef.h>
+
 typedef struct OpcodeVector {
 	opcode *data;
 	size_t size;
@@ -29,29 +31,30 @@ void SizeTStack_free(SizeTStack *stk);
 /*
 * @brief Represents a lambda function in the Brainfork VM.
 * size_t start_pc: opcode index where the lambda's code starts.
-* uint32_t captured_p: data pointer (p) at the moment of definition.
+* ptrdiff_t captured_p: data pointer (p) at the moment of definition.
 * uint64_t jit_addr: actual memory address of the compiled function.
 */
 typedef struct {
 	size_t start_pc;
-	uint32_t captured_p;
+	ptrdiff_t captured_p;
 	uint64_t jit_addr;
 } Lambda;
 
 /*
 * @brief Represents a call frame for managing function calls.
 * size_t return_pc: the opcode index to return to after the call from the lambda.
-* uint32_t saved_p: the data pointer (p) to restore upon return.
+* ptrdiff_t saved_p: the data pointer (p) to restore upon return.
 */
 typedef struct {
 	size_t return_pc;
-	uint32_t saved_p;
+	ptrdiff_t saved_p;
 } CallFrame;
 
 /*
-* @brief Stack structure for managing Lambda instances.
+* @brief Stack structure for managing Lambda instances. The entries live in
+* memory the owner provides (the VM's stack arena); the stack never grows.
 * size_t size: current number of elements in the stack.
-* size_t capacity: total allocated capacity of the stack.
+* size_t capacity: fixed number of entries; a push past it fails.
 */
 typedef struct {
 	Lambda *data;
@@ -59,15 +62,15 @@ typedef struct {
 	size_t capacity;
 } LambdaStack;
 
-void LambdaStack_init(LambdaStack *stk);
+void LambdaStack_init(LambdaStack *stk, Lambda *data, size_t capacity);
 bool LambdaStack_push(LambdaStack *stk, Lambda val);
 bool LambdaStack_top(const LambdaStack *stk, Lambda *out_val);
-void LambdaStack_free(LambdaStack *stk);
 
 /*
-* @brief Stack structure for managing CallFrame instances.
+* @brief Stack structure for managing CallFrame instances, in owner-provided
+* memory like LambdaStack.
 * size_t size: current number of elements in the stack.
-* size_t capacity: total allocated capacity of the stack.
+* size_t capacity: fixed number of entries; a push past it fails.
 */
 typedef struct {
 	CallFrame *data;
@@ -75,9 +78,48 @@ typedef struct {
 	size_t capacity;
 } CallStack;
 
-void CallStack_init(CallStack *stk);
+void CallStack_init(CallStack *stk, CallFrame *data, size_t capacity);
 bool CallStack_push(CallStack *stk, CallFrame val);
 bool CallStack_pop(CallStack *stk, CallFrame *out_val);
-void CallStack_free(CallStack *stk);
+
+/*
+ * Transparent huge pages for the large anonymous reservations (the tape and
+ * the JIT code cache). Where the kernel offers them, reservations are
+ * aligned to the huge page size and advised with MADV_HUGEPAGE, so the
+ * parts a program actually commits can be backed by huge pages. Elsewhere,
+ * or once disabled, they fall back to base pages.
+ */
+void huge_pages_set_enabled(bool enabled);
+
+/* The huge page size in bytes, or 0 when huge pages are not in use. */
+size_t huge_page_size(void);
+
+/* The base page size in bytes. */
+size_t base_page_size(void);
+
+#ifndef _WIN32
+/**
+ * @brief Reserves `size` bytes of inaccessible address space, huge page
+ * aligned and advised where huge pages are in use. Release it with
+ * munmap(). Returns NULL on failure.
+ */
+void *huge_pages_reserve(size_t size);
+#endif
+
+/*
+ * @brief How much of a mapping is resident, and on which pages.
+ * size_t resident: bytes resident in memory.
+ * size_t huge: of those, bytes backed by huge pages.
+ */
+typedef struct {
+	size_t resident;
+	size_t huge;
+} PageUsage;
+
+/**
+ * @brief Reads the page usage of [addr, addr + size) from
+ * /proc/self/smaps. Returns false where that is not available.
+ */
+bool PageUsage_measure(const void *addr, size_t size, PageUsage *usage);
 
 #endif // BF_UTIL_H
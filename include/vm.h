@@ -3,16 +3,402 @@
 
 #include "util.h"
 
-/* The main VM memory tape. */
-extern uint8_t g_bf_mem[0x20000];
+#include <stdatomic.h>
+#include <stddef.h>
+#ifndef _WIN32
+#include <setjmp.h>
+#endif
 
-/* The runtime stack for defined lambdas (closures). */
-extern LambdaStack g_lambda_stack;
+/*
+ * Bytes a VM's tape reserves: as many cells at --cell=8, half or a quarter
+ * as many at 16 or 32. Only address space is taken up front: the tape is
+ * mapped MAP_NORESERVE and the kernel commits zeroed pages where a run
+ * first touches it, so a run pays only for the cells it uses.
+ * Windows commits a smaller tape up front.
+ */
+#if UINTPTR_MAX > 0xFFFFFFFFu && !defined(_WIN32)
+#define BF_TAPE_SIZE ((size_t)1 << 32)
+#else
+#define BF_TAPE_SIZE ((size_t)1 << 24)
+#endif
 
-/* The runtime call stack for function calls. */
-extern CallStack g_call_stack;
+/* Where the address space has no room for BF_TAPE_SIZE (a ulimit -v, a
+ * 32-bit host), the tape is halved until it fits, down to this. */
+#define BF_TAPE_MIN_SIZE ((size_t)0x20000)
 
-/* Executes an OpcodeVector using a simple interpreter. */
-void interpreter(const OpcodeVector *code);
+/*
+ * Bytes from cell 0 (rounded up to a page) that resetting the tape clears
+ * with a memset and keeps committed, as a short run touches little else.
+ * The rest of the tape is handed back to the kernel instead.
+ */
+#define BF_TAPE_KEEP_SIZE ((size_t)0x4000)
+
+/*
+ * Inaccessible address space mapped on each side of the tape, so an access
+ * that strays off either end faults instead of landing in other memory.
+ * Between two tape accesses a program can move the pointer at most as many
+ * cells as its source has '<' or '>' characters, so this covers every
+ * source smaller than the guard (a half or a quarter of it with 16- or
+ * 32-bit cells).
+ */
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define BF_TAPE_GUARD ((size_t)1 << 30)
+#else
+#define BF_TAPE_GUARD ((size_t)1 << 24)
+#endif
+
+/*
+ * Entries in the lambda and call stacks. Both live in one arena mapped with
+ * the VM, each followed by an inaccessible guard page, so they never move
+ * or grow and a push is one bounds check. JIT code pushes lambdas to the
+ * same arena but keeps its call frames on the native stack, BF_JIT_FRAME
+ * bytes each, so the call depth is kept to what a thread stack holds.
+ */
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define BF_LAMBDA_DEPTH ((size_t)1 << 20)
+#else
+#define BF_LAMBDA_DEPTH ((size_t)1 << 16)
+#endif
+#define BF_CALL_DEPTH ((size_t)1 << 16)
+#define BF_JIT_FRAME 16
+
+/*
+ * Native stack JIT lambda calls leave free at the bottom of a thread's
+ * stack, for the C functions JIT code calls and for signal handlers. Where
+ * the thread's stack is too small for BF_CALL_DEPTH frames above it, the
+ * call depth is cut short there instead.
+ */
+#define BF_JIT_STACK_MARGIN ((size_t)64 << 10)
+
+/* When buffered program output is written out (--flush). */
+typedef enum {
+	FLUSH_LINE, // at each '\n', when the buffer fills and at exit
+	FLUSH_FULL, // only when the buffer fills and at exit
+	FLUSH_NONE, // after every byte
+} FlushPolicy;
+
+#define BF_OUT_BUFFER_SIZE 65536
+
+/* Receives flushed output in place of write(2), for embedders. Returns
+ * false on failure. */
+typedef bool (*OutputSink)(void *ctx, const uint8_t *data, size_t size);
+
+/*
+ * Program output, shared by the interpreter and the JIT. Appending is a
+ * store at `pos` and a pointer bump; once `pos` reaches `limit` (or at a
+ * '\n' under FLUSH_LINE) OutputBuffer_flush() hands the bytes to the fd.
+ * FLUSH_NONE sets `limit` to `start`, so every append flushes.
+ *
+ * With `splice` set, full page sets go to the pipe with vmsplice(2), which
+ * passes page references instead of copying, and filling continues in the
+ * other page set. The pipe is sized to at most one page set, so once a set
+ * has been spliced in full the pipe can no longer hold pages of the other
+ * one, and that set is safe to overwrite. Partial flushes are copied with
+ * write(2) and keep the current set.
+ *
+ * With a `sink`, flushes call it instead of writing to the fd.
+ *
+ * The JIT addresses `pos`, `limit` and `policy` directly; keep `pos` and
+ * `limit` first.
+ */
+typedef struct {
+	uint8_t *pos;
+	uint8_t *limit;
+	uint8_t *start; // the page set being filled
+	FlushPolicy policy;
+	int fd;
+	bool splice; // set by OutputBuffer_init() when fd is a suitable pipe
+	OutputSink sink; // or NULL to write to fd
+	void *sink_ctx;
+	_Alignas(4096) uint8_t data[2][BF_OUT_BUFFER_SIZE];
+} OutputBuffer;
+
+/*
+ * Empties the buffer, points it at `fd` and applies a flush policy. Under
+ * FLUSH_FULL on Linux, a pipe that can be sized to one page set turns on
+ * `splice`; callers may clear it afterwards to force copying writes.
+ */
+void OutputBuffer_init(OutputBuffer *out, int fd, FlushPolicy policy);
+
+/* Like OutputBuffer_init(), but hands flushed bytes to `sink`. */
+void OutputBuffer_init_sink(OutputBuffer *out, OutputSink sink, void *ctx,
+			    FlushPolicy policy);
+
+/* Writes out buffered bytes. Returns false if the write failed; the
+ * unwritten bytes are dropped either way. */
+bool OutputBuffer_flush(OutputBuffer *out);
+
+static inline void OutputBuffer_put(OutputBuffer *out, uint8_t c)
+{
+	*out->pos++ = c;
+	if (out->pos >= out->limit || (c == '\n' && out->policy == FLUSH_LINE))
+		OutputBuffer_flush(out);
+}
+
+/* FLUSH_LINE when stdout is a terminal, FLUSH_FULL otherwise. */
+FlushPolicy OutputBuffer_default_policy(void);
+
+/* What ',' leaves in the cell once input is exhausted (--eof). */
+typedef enum {
+	EOF_MINUS_ONE, // store all ones (255), what getchar()'s EOF truncates to
+	EOF_ZERO, // store 0
+	EOF_UNCHANGED, // leave the cell as it was
+} EofPolicy;
+
+#define BF_IN_BUFFER_SIZE 65536
+
+/* Supplies input in place of read(2), for embedders: fills up to `size`
+ * bytes of `buf` and returns the count, 0 at end of input or -1 on error. */
+typedef ptrdiff_t (*InputSource)(void *ctx, uint8_t *buf, size_t size);
+
+/*
+ * Program input. A regular file on the input fd is mmap'd whole, so
+ * reading a byte is a load at `pos` and a pointer bump until `end`;
+ * pipes and terminals go through a read-ahead buffer that
+ * InputBuffer_refill() fills with read(2), or from `source` if set.
+ * Input already in memory is read in place, like a mapped file.
+ * The JIT addresses `pos` and `end` directly; keep them first.
+ */
+typedef struct {
+	const uint8_t *pos;
+	const uint8_t *end;
+	EofPolicy eof;
+	int fd;
+	bool at_eof;
+	uint8_t *map; // mmap'd file, or NULL
+	size_t map_size;
+	uint8_t *buffer; // read-ahead buffer, allocated on first refill
+	OutputBuffer *tied; // flushed before blocking under FLUSH_LINE, or NULL
+	InputSource source; // or NULL to read from fd
+	void *source_ctx;
+} InputBuffer;
+
+/* Starts reading from `fd`, mapping it if it is a regular file. `in` must
+ * be zeroed or previously initialized. */
+void InputBuffer_init(InputBuffer *in, int fd, EofPolicy eof);
+
+/* Reads the `size` bytes at `data`, which must outlive the reads. */
+void InputBuffer_init_memory(InputBuffer *in, const uint8_t *data,
+			     size_t size, EofPolicy eof);
+
+/* Reads through `source`, buffered like a pipe. */
+void InputBuffer_init_source(InputBuffer *in, InputSource source, void *ctx,
+			     EofPolicy eof);
+
+/* Unmaps or frees whatever InputBuffer_init() and refills set up. */
+void InputBuffer_free(InputBuffer *in);
+
+/* Makes more input available. Returns false at end of input. If the tied
+ * output uses FLUSH_LINE it is written out first, so prompts show up
+ * before the program blocks. */
+bool InputBuffer_refill(InputBuffer *in);
+
+/* Next input byte, or -1 at end of input. */
+static inline int InputBuffer_get(InputBuffer *in)
+{
+	if (in->pos == in->end && !InputBuffer_refill(in))
+		return -1;
+	return *in->pos++;
+}
+
+/* InputBuffer_read_slow()'s result for "leave the cell unchanged". */
+#define BF_IN_KEEP_CELL INT32_MIN
+
+/* Slow path of the JIT's inline ',': refills, then returns the next byte.
+ * At end of input it returns the value the --eof policy stores (-1 for
+ * all ones, whatever the cell width), or BF_IN_KEEP_CELL. */
+int32_t InputBuffer_read_slow(InputBuffer *in);
+
+/* Runs ',' on a cell holding `cell` and returns its new value, to be
+ * truncated to the cell width. */
+static inline uint32_t InputBuffer_read_cell(InputBuffer *in, uint32_t cell)
+{
+	int c = InputBuffer_get(in);
+	if (c >= 0)
+		return (uint32_t)c;
+	switch (in->eof) {
+	case EOF_ZERO:
+		return 0;
+	case EOF_UNCHANGED:
+		return cell;
+	default:
+		return UINT32_MAX;
+	}
+}
+
+/*
+ * Execution budget for one run; zero means no limit.
+ * uint64_t fuel: loop back-edges (taken or not) and lambda calls the
+ *                program may make.
+ * double timeout: wall-clock seconds. Checked where fuel is charged, so a
+ *                 program blocked reading input is not interrupted.
+ */
+typedef struct {
+	uint64_t fuel;
+	double timeout;
+} VmLimits;
+
+/* How a run ended. */
+typedef enum {
+	VM_OK,
+	VM_OUT_OF_FUEL,
+	VM_TIMEOUT,
+	VM_OUTPUT_FAILED, // ran to the end, but output could not be written
+	VM_TAPE_FAULT, // the pointer left the tape; see fault_cell/fault_op
+	VM_COMPILE_FAILED, // jit_run() only
+	VM_STACK_OVERFLOW, // more than BF_LAMBDA_DEPTH or BF_CALL_DEPTH entries
+	VM_NO_LAMBDA, // '!' before any lambda was defined
+} VmStatus;
+
+/*
+ * Fuel is handed to the engines in slices of at most this many checks, so
+ * a timeout is noticed within one slice of back-edges.
+ */
+#define BF_FUEL_SLICE 65536
+
+struct JitBuffer;
+
+/* fault_op when the faulting op is not known. */
+#define BF_NO_OP SIZE_MAX
+
+/*
+ * All state of one Brainbork VM: the tape, the lambda and call stacks, and
+ * program I/O. Nothing is shared between VMs, so several can run at once
+ * on different threads. Generated code takes the VM as an argument and
+ * never embeds its address.
+ * OutputBuffer is page-aligned, so allocate a BfVm statically, on the
+ * stack, or with aligned_alloc().
+ */
+typedef struct BfVm {
+	// Checks left in the current slice. The engines decrement it (JIT code
+	// keeps it in a register) and call vm_fuel_trap() once it goes
+	// negative. JIT code addresses it and jit_exit_sp directly; keep them
+	// first.
+	int64_t fuel_slice;
+	void *jit_exit_sp; // stack pointer to unwind to when a JIT run stops
+	uint64_t fuel_left; // fuel not yet handed out in slices
+	atomic_bool timed_out; // set from the timeout timer's signal handler
+	VmStatus status;
+	VmLimits limits; // for the next run; BfVm_init() clears them
+#ifndef _WIN32
+	timer_t timer;
+	bool timer_armed;
+#endif
+	uint8_t *mem; // cell 0
+	uint8_t *tape; // tape_size bytes between two BF_TAPE_GUARD regions
+	size_t tape_size;
+	uint8_t *tape_map; // start of the mapping, the left guard
+	bool tape_dirty; // a run may have written to the tape
+	// Huge page size the tape is aligned to and advised for, or 0 where
+	// it lives on base pages only
+	size_t tape_huge_page;
+	// For the next run: put cell 0 in the middle of the tape, so the
+	// pointer can go as far left of it as right. Otherwise cell 0 is the
+	// first cell and '<' there faults.
+	bool tape_left;
+	// Cell width of the next run for the interpreter; jit_execute() sets
+	// it to the width the program was compiled for
+	CellWidth cell;
+	// Code running on the tape, for mapping a fault to an op; NULL while
+	// the interpreter itself runs
+	const struct JitBuffer *native_code;
+	// Lowest stack pointer JIT lambda calls may reach on the thread
+	// running the code, or NULL where its stack bounds are unknown
+	uint8_t *jit_stack_floor;
+	ptrdiff_t fault_cell; // VM_TAPE_FAULT: the cell index accessed
+	size_t fault_op; // ...and the op, or BF_NO_OP where unknown
+#ifndef _WIN32
+	sigjmp_buf fault_jmp; // where a tape fault unwinds to
+#endif
+	LambdaStack lambda_stack; // defined lambdas (closures)
+	CallStack call_stack; // frames of active calls
+	uint8_t *stack_map; // the arena both stacks live in
+	size_t stack_map_size;
+	OutputBuffer out;
+	InputBuffer in;
+} BfVm;
+
+/* Maps the tape and connects output to stdout (default flush policy)
+ * and input to stdin (EOF_MINUS_ONE). */
+bool BfVm_init(BfVm *vm);
+
+/* Like BfVm_init(), but leaves the process's stdio alone: output is
+ * discarded and input is empty until the caller connects them. */
+bool BfVm_init_unconnected(BfVm *vm);
+
+/* Flushes output and releases everything BfVm_init() and runs set up. */
+void BfVm_free(BfVm *vm);
+
+/* Zeroes the tape and empties the runtime stacks, keeping I/O state.
+ * Only the part a run opened is cleared, and only if a run has started
+ * since the last reset. */
+void BfVm_reset(BfVm *vm);
+
+/* Starts a run: BfVm_reset(), then places cell 0 as `tape_left` asks,
+ * loads the fuel budget and arms the timeout from `limits`. */
+void BfVm_start(BfVm *vm);
+
+/* Ends a run started by BfVm_start(): disarms the timeout and flushes the
+ * output. Returns how the run ended. */
+VmStatus BfVm_finish(BfVm *vm);
+
+/*
+ * Tape faults: an engine runs the program as
+ *
+ *	if (BF_TAPE_FAULTED(vm))
+ *		...the run stopped with VM_TAPE_FAULT...
+ *	vm_guard_enter(vm, code);
+ *	...run...
+ *	vm_guard_leave(vm);
+ *
+ * Between enter and leave, an access to a guard region on the calling
+ * thread unwinds back to BF_TAPE_FAULTED(), which then yields true.
+ * `code` is the native code about to run, if any.
+ */
+#ifdef _WIN32
+#define BF_TAPE_FAULTED(vm) (0)
+#else
+#define BF_TAPE_FAULTED(vm) (sigsetjmp((vm)->fault_jmp, 1) != 0)
+#endif
+void vm_guard_enter(BfVm *vm, const struct JitBuffer *code);
+void vm_guard_leave(BfVm *vm);
+
+/* Called by the engines once `fuel_slice` goes negative. Refills it and
+ * returns false to go on, or sets `status` and returns true to stop. */
+bool vm_fuel_trap(BfVm *vm);
+
+const char *VmStatus_string(VmStatus status);
+
+/* Appends one byte to the VM's output; for JIT backends that call out
+ * rather than inline the append. */
+void vm_putchar(BfVm *vm, int c);
+
+/* ',' on a cell holding `cell`, for JIT backends that call out rather than
+ * inline the read. The result is stored truncated to the cell width. */
+uint32_t vm_read_cell(BfVm *vm, uint32_t cell);
+
+/*
+ * Interpreter settings.
+ * bool superinsn_report: print how often each superinstruction fired
+ *                        (stderr); adds a counting stub to every dispatch.
+ * bool tiered: compile hot loops on a background thread and switch to the
+ *              native code at their next iteration.
+ */
+typedef struct {
+	bool superinsn_report;
+	bool tiered;
+} InterpreterOptions;
+
+/* Executes an OpcodeVector on `vm` using a simple interpreter. */
+VmStatus interpreter(BfVm *vm, const OpcodeVector *code);
+
+/* Executes an OpcodeVector on `vm` with the given interpreter settings,
+ * then prints the time it took. */
+VmStatus interpreter_with(BfVm *vm, const OpcodeVector *code,
+			  const InterpreterOptions *options);
+
+/* Like interpreter_with(), but prints nothing. */
+VmStatus interpreter_execute(BfVm *vm, const OpcodeVector *code,
+			     const InterpreterOptions *options);
 
 #endif // BF_VM_H
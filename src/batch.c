@@ -0,0 +1,321 @@
+#include "batch.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * A Chase-Lev deque of job indices. The owner pushes and pops at `bottom`,
+ * thieves take from `top`. Every job is pushed before the pool starts, so
+ * each deque is sized for all it will ever hold and never wraps.
+ */
+typedef struct {
+	_Atomic int64_t top;
+	_Atomic int64_t bottom;
+	size_t *items;
+} WorkDeque;
+
+typedef enum { STEAL_OK, STEAL_EMPTY, STEAL_LOST } StealResult;
+
+/* Owner only. */
+static void WorkDeque_push(WorkDeque *deque, size_t job)
+{
+	int64_t b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+	deque->items[b] = job;
+	atomic_store_explicit(&deque->bottom, b + 1, memory_order_release);
+}
+
+/* Owner only: takes the most recently pushed job. */
+static bool WorkDeque_pop(WorkDeque *deque, size_t *job)
+{
+	int64_t b =
+		atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+	atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+	if (t > b) {
+		atomic_store_explicit(&deque->bottom, b + 1,
+				      memory_order_relaxed);
+		return false;
+	}
+	*job = deque->items[b];
+	if (t < b)
+		return true;
+	// Last job: race the thieves for it
+	bool won = atomic_compare_exchange_strong_explicit(
+		&deque->top, &t, t + 1, memory_order_seq_cst,
+		memory_order_relaxed);
+	atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+	return won;
+}
+
+/* Any thread: takes the oldest job. */
+static StealResult WorkDeque_steal(WorkDeque *deque, size_t *job)
+{
+	int64_t t = atomic_load_explicit(&deque->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+	if (t >= b)
+		return STEAL_EMPTY;
+	size_t item = deque->items[t];
+	if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1,
+						     memory_order_seq_cst,
+						     memory_order_relaxed))
+		return STEAL_LOST;
+	*job = item;
+	return STEAL_OK;
+}
+
+typedef struct BatchPool BatchPool;
+
+typedef struct {
+	BatchPool *pool;
+	size_t id;
+	BfVm *vm;
+	WorkDeque deque;
+	size_t steals;
+	pthread_t thread;
+	bool started;
+} BatchWorker;
+
+struct BatchPool {
+	const JitRegion *program;
+	BatchJob *jobs;
+	EofPolicy eof;
+	VmLimits limits;
+	bool tape_left;
+	BatchWorker *workers;
+	size_t worker_count;
+};
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void batch_run_job(BatchPool *pool, BfVm *vm, BatchJob *job)
+{
+	double begin = now_seconds();
+	job->ok = false;
+	job->bytes_in = job->bytes_out = 0;
+
+	int in_fd = open(job->input, O_RDONLY);
+	if (in_fd < 0) {
+		fprintf(stderr, "batch: cannot open <%s>: %s\n", job->input,
+			strerror(errno));
+		job->seconds = now_seconds() - begin;
+		return;
+	}
+	int out_fd = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (out_fd < 0) {
+		fprintf(stderr, "batch: cannot create <%s>: %s\n", job->output,
+			strerror(errno));
+		close(in_fd);
+		job->seconds = now_seconds() - begin;
+		return;
+	}
+	struct stat st;
+	if (fstat(in_fd, &st) == 0 && S_ISREG(st.st_mode))
+		job->bytes_in = (size_t)st.st_size;
+
+	InputBuffer_init(&vm->in, in_fd, pool->eof);
+	OutputBuffer_init(&vm->out, out_fd, FLUSH_FULL);
+	vm->limits = pool->limits;
+	vm->tape_left = pool->tape_left;
+	VmStatus status = jit_execute(pool->program, vm);
+	if (status == VM_OUT_OF_FUEL || status == VM_TIMEOUT)
+		fprintf(stderr, "batch: <%s> stopped: %s\n", job->input,
+			VmStatus_string(status));
+	else if (status == VM_TAPE_FAULT)
+		fprintf(stderr, "batch: <%s> stopped: %s at cell %td\n",
+			job->input, VmStatus_string(status), vm->fault_cell);
+	bool ok = status == VM_OK;
+	off_t written = lseek(out_fd, 0, SEEK_CUR);
+	if (written > 0)
+		job->bytes_out = (size_t)written;
+	InputBuffer_free(&vm->in);
+	if (close(out_fd) != 0) {
+		perror("close");
+		ok = false;
+	}
+	close(in_fd);
+	job->ok = ok;
+	job->seconds = now_seconds() - begin;
+}
+
+/*
+ * Tries every other worker's deque in turn. Nothing adds work once the pool
+ * is running, so when every deque is empty (and no steal lost a race) all
+ * jobs have been claimed.
+ */
+static bool batch_steal(BatchWorker *self, size_t *job)
+{
+	BatchPool *pool = self->pool;
+	for (;;) {
+		bool lost = false;
+		for (size_t i = 1; i < pool->worker_count; ++i) {
+			BatchWorker *victim =
+				&pool->workers[(self->id + i) %
+					       pool->worker_count];
+			StealResult r = WorkDeque_steal(&victim->deque, job);
+			if (r == STEAL_OK)
+				return true;
+			if (r == STEAL_LOST)
+				lost = true;
+		}
+		if (!lost)
+			return false;
+	}
+}
+
+static void *batch_worker_main(void *arg)
+{
+	BatchWorker *self = arg;
+	size_t job;
+	for (;;) {
+		if (!WorkDeque_pop(&self->deque, &job)) {
+			if (!batch_steal(self, &job))
+				break;
+			self->steals++;
+		}
+		batch_run_job(self->pool, self->vm, &self->pool->jobs[job]);
+	}
+	return NULL;
+}
+
+static size_t batch_thread_count(size_t requested, size_t job_count)
+{
+	size_t threads = requested;
+	if (threads == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? (size_t)cores : 1;
+	}
+	if (threads > job_count)
+		threads = job_count;
+	return threads ? threads : 1;
+}
+
+bool batch_run(const JitRegion *program, BatchJob *jobs, size_t job_count,
+	       const BatchOptions *options, BatchStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+	BatchPool pool = { program, jobs, options->eof, options->limits,
+			   options->tape_left, NULL,
+			   batch_thread_count(options->threads, job_count) };
+	size_t *items = malloc((job_count ? job_count : 1) * sizeof(size_t));
+	pool.workers = calloc(pool.worker_count, sizeof(BatchWorker));
+	if (!items || !pool.workers) {
+		perror("Failed to allocate batch state");
+		free(items);
+		free(pool.workers);
+		return false;
+	}
+
+	bool ok = true;
+	for (size_t w = 0; w < pool.worker_count; ++w) {
+		BatchWorker *worker = &pool.workers[w];
+		worker->pool = &pool;
+		worker->id = w;
+		// BfVm holds page-aligned output buffers
+		worker->vm = aligned_alloc(_Alignof(BfVm), sizeof(BfVm));
+		if (!worker->vm || !BfVm_init_unconnected(worker->vm)) {
+			perror("Failed to allocate a batch VM");
+			free(worker->vm);
+			worker->vm = NULL;
+			ok = false;
+			break;
+		}
+
+		// Deal out a contiguous block, pushed in reverse so the owner
+		// pops its jobs in order and thieves take from the far end
+		size_t begin = w * job_count / pool.worker_count;
+		size_t end = (w + 1) * job_count / pool.worker_count;
+		worker->deque.items = items + begin;
+		for (size_t i = end; i > begin; --i)
+			WorkDeque_push(&worker->deque, i - 1);
+	}
+
+	if (ok) {
+		double begin = now_seconds();
+		// The calling thread is worker 0. Any worker whose thread fails
+		// to start has its jobs stolen by the others.
+		for (size_t w = 1; w < pool.worker_count; ++w) {
+			BatchWorker *worker = &pool.workers[w];
+			int err = pthread_create(&worker->thread, NULL,
+						 batch_worker_main, worker);
+			if (err != 0)
+				fprintf(stderr,
+					"batch: failed to start worker %zu: %s\n",
+					w, strerror(err));
+			worker->started = err == 0;
+		}
+		batch_worker_main(&pool.workers[0]);
+		for (size_t w = 1; w < pool.worker_count; ++w) {
+			if (pool.workers[w].started)
+				pthread_join(pool.workers[w].thread, NULL);
+		}
+		stats->seconds = now_seconds() - begin;
+	}
+
+	stats->threads = pool.worker_count;
+	for (size_t w = 0; w < pool.worker_count; ++w) {
+		BatchWorker *worker = &pool.workers[w];
+		stats->steals += worker->steals;
+		if (worker->vm) {
+			BfVm_free(worker->vm);
+			free(worker->vm);
+		}
+	}
+	free(pool.workers);
+	free(items);
+	return ok;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+void batch_report(const BatchJob *jobs, size_t job_count,
+		  const BatchStats *stats, FILE *out)
+{
+	size_t failed = 0, bytes_in = 0, bytes_out = 0;
+	double total = 0;
+	double *latency = malloc((job_count ? job_count : 1) * sizeof(double));
+	for (size_t i = 0; i < job_count; ++i) {
+		if (!jobs[i].ok)
+			failed++;
+		bytes_in += jobs[i].bytes_in;
+		bytes_out += jobs[i].bytes_out;
+		total += jobs[i].seconds;
+		if (latency)
+			latency[i] = jobs[i].seconds;
+	}
+
+	double seconds = stats->seconds > 0 ? stats->seconds : 1e-9;
+	fprintf(out,
+		"batch: %zu jobs (%zu failed) on %zu threads in %.3fs: "
+		"%.1f jobs/s, %.1f MiB/s in, %.1f MiB/s out, %zu steals\n",
+		job_count, failed, stats->threads, stats->seconds,
+		(double)job_count / seconds,
+		(double)bytes_in / (1024.0 * 1024.0) / seconds,
+		(double)bytes_out / (1024.0 * 1024.0) / seconds, stats->steals);
+
+	if (latency && job_count) {
+		qsort(latency, job_count, sizeof(double), compare_double);
+#define PCT(p) (latency[(size_t)((p) * (double)(job_count - 1))] * 1e3)
+		fprintf(out,
+			"batch latency: min %.3fms p50 %.3fms p90 %.3fms "
+			"p99 %.3fms max %.3fms mean %.3fms\n",
+			latency[0] * 1e3, PCT(0.5), PCT(0.9), PCT(0.99),
+			latency[job_count - 1] * 1e3,
+			total / (double)job_count * 1e3);
+#undef PCT
+	}
+	free(latency);
+}
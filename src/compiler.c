@@ -15,7 +15,7 @@ bool scanner(const char *s, OpcodeVector *out_code)
 	for (size_t i = 0; i < len; /* increment inside loop */) {
 		char cmd = s[i];
 
-		if (strchr("+-<>[].,", cmd) == NULL) {
+		if (strchr("+-<>[].,()!", cmd) == NULL) {
 			if (cmd == '\n')
 				++line;
 			++i;
@@ -33,28 +33,29 @@ bool scanner(const char *s, OpcodeVector *out_code)
 			++i;
 		}
 
-		opcode op = { 0, 0 };
+		opcode op = { 0, 0, 0, 0 };
 		switch (cmd) {
 		case '+':
-			op = (opcode){ op_add, cnt };
+			op = (opcode){ op_add, cnt, 0, 0 };
 			break;
 		case '-':
-			op = (opcode){ op_sub, cnt };
+			op = (opcode){ op_sub, cnt, 0, 0 };
 			break;
 		case '>':
-			op = (opcode){ op_addp, cnt };
+			op = (opcode){ op_addp, cnt, 0, 0 };
 			break;
 		case '<':
-			op = (opcode){ op_subp, cnt };
+			op = (opcode){ op_subp, cnt, 0, 0 };
 			break;
 		case '[':
 			if (!SizeTStack_push(&stk, code.size))
 				goto error;
-			op = (opcode){ op_jf, 0 }; // Placeholder target
+			op = (opcode){ op_jf, 0, 0, 0 }; // Placeholder target
 			break;
 		case ']': {
 			size_t jf_idx;
-			if (!SizeTStack_top(&stk, &jf_idx)) {
+			if (!SizeTStack_top(&stk, &jf_idx) ||
+			    code.data[jf_idx].op != op_jf) {
 				fprintf(stderr,
 					"Error: Mismatched ']' at line %d\n",
 					line);
@@ -62,22 +63,48 @@ bool scanner(const char *s, OpcodeVector *out_code)
 			}
 			SizeTStack_pop(&stk);
 
-			op = (opcode){ op_jt,
-				       (uint32_t)jf_idx }; // Jump back to '['
+			op = (opcode){ op_jt, (uint32_t)jf_idx, 0,
+				       0 }; // Jump back to '['
 			code.data[jf_idx].num =
 				(uint32_t)(code.size +
 					   1); // Patch '[' to jump *after* ']'
 			break;
 		}
+		case '(':
+			if (!SizeTStack_push(&stk, code.size))
+				goto error;
+			op = (opcode){ op_def_lambda, 0, 0,
+				       0 }; // Placeholder end of the body
+			break;
+		case ')': {
+			size_t def_idx;
+			if (!SizeTStack_top(&stk, &def_idx) ||
+			    code.data[def_idx].op != op_def_lambda) {
+				fprintf(stderr,
+					"Error: Mismatched ')' at line %d\n",
+					line);
+				goto error;
+			}
+			SizeTStack_pop(&stk);
+
+			op = (opcode){ op_ret, 0, 0, 0 };
+			code.data[def_idx].num =
+				(uint32_t)(code.size +
+					   1); // Patch '(' to skip *past* ')'
+			break;
+		}
+		case '!':
+			op = (opcode){ op_call, 0, 0, 0 };
+			break;
 		case ',':
-			op = (opcode){ op_in, 0 };
+			op = (opcode){ op_in, 0, 0, 0 };
 			for (uint32_t j = 1; j < cnt; ++j) {
 				if (!OpcodeVector_push_back(&code, op))
 					goto error;
 			}
 			break;
 		case '.':
-			op = (opcode){ op_out, 0 };
+			op = (opcode){ op_out, 0, 0, 0 };
 			for (uint32_t j = 1; j < cnt; ++j) {
 				if (!OpcodeVector_push_back(&code, op))
 					goto error;
@@ -89,8 +116,10 @@ bool scanner(const char *s, OpcodeVector *out_code)
 			goto error;
 	}
 
-	if (!SizeTStack_empty(&stk)) {
-		fprintf(stderr, "Error: Mismatched '[' at end of file.\n");
+	size_t open_idx;
+	if (!SizeTStack_empty(&stk) && SizeTStack_top(&stk, &open_idx)) {
+		fprintf(stderr, "Error: Mismatched '%c' at end of file.\n",
+			code.data[open_idx].op == op_jf ? '[' : '(');
 		goto error;
 	}
 
@@ -104,22 +133,152 @@ error:
 	return false;
 }
 
-bool optimize(const OpcodeVector *in_code, OpcodeVector *out_code)
+#define MUL_LOOP_MAX_CELLS 32
+
+typedef struct {
+	int32_t offset;
+	uint32_t delta;
+} CellDelta;
+
+/**
+ * @brief Matches a balanced loop such as `[->+>++<<]` starting at `jf_idx`.
+ *
+ * The body may only contain +, -, > and <, must return the pointer to where
+ * it started and must change the loop cell by exactly -1 or +1 (modulo the
+ * cell width, given as `mask`). On success the net delta of every other
+ * touched cell is written to `cells` with the factor already negated for
+ * `+1` loops, so each entry becomes `p[offset] += p[0] * delta`.
+ */
+static bool match_mul_loop(const OpcodeVector *in_code, size_t jf_idx,
+			   uint32_t mask, CellDelta *cells, size_t *out_count)
 {
-	OpcodeVector_init(out_code);
+	const opcode *jf = &in_code->data[jf_idx];
+	if (jf->op != op_jf || jf->num < jf_idx + 2 || jf->num > in_code->size)
+		return false;
 
-	const size_t map_size = in_code->size + 1;
-	size_t *old_to_new_map = malloc(map_size * sizeof(size_t));
-	if (!old_to_new_map) {
-		perror("Failed to allocate optimizer map");
+	size_t jt_idx = jf->num - 1;
+	if (in_code->data[jt_idx].op != op_jt ||
+	    in_code->data[jt_idx].num != jf_idx)
 		return false;
+
+	int32_t offset = 0;
+	size_t count = 1;
+	cells[0] = (CellDelta){ 0, 0 };
+
+	for (size_t i = jf_idx + 1; i < jt_idx; ++i) {
+		const opcode *op = &in_code->data[i];
+		switch (op->op) {
+		case op_addp:
+			offset += (int32_t)op->num;
+			continue;
+		case op_subp:
+			offset -= (int32_t)op->num;
+			continue;
+		case op_add:
+		case op_sub:
+			break;
+		default:
+			return false;
+		}
+
+		size_t c = 0;
+		while (c < count && cells[c].offset != offset)
+			++c;
+		if (c == count) {
+			if (count == MUL_LOOP_MAX_CELLS)
+				return false;
+			cells[count++] = (CellDelta){ offset, 0 };
+		}
+
+		if (op->op == op_add)
+			cells[c].delta += op->num;
+		else
+			cells[c].delta -= op->num;
 	}
 
-	const size_t NOT_MAPPED = (size_t)-1;
-	for (size_t i = 0; i < map_size; ++i) {
-		old_to_new_map[i] = NOT_MAPPED;
+	if (offset != 0)
+		return false;
+
+	// A `+1` counter runs (mask + 1 - p[0]) times, so flip the factors.
+	// Deltas wrap at 32 bits, which the narrower widths divide.
+	uint32_t step = cells[0].delta & mask;
+	if (step != mask && step != 0x01)
+		return false;
+
+	size_t n = 0;
+	for (size_t c = 1; c < count; ++c) {
+		uint32_t delta = cells[c].delta & mask;
+		if (delta == 0)
+			continue;
+		cells[n].offset = cells[c].offset;
+		cells[n].delta = step == mask ? delta : -delta & mask;
+		++n;
 	}
 
+	*out_count = n;
+	return true;
+}
+
+#define NOT_MAPPED ((size_t)-1)
+
+/**
+ * @brief Allocates an old-index -> new-index map for a pass over `size` ops,
+ * with every entry (including the end-of-code slot) set to NOT_MAPPED.
+ */
+static size_t *new_index_map(size_t size)
+{
+	size_t *map = malloc((size + 1) * sizeof(size_t));
+	if (!map) {
+		perror("Failed to allocate optimizer map");
+		return NULL;
+	}
+	for (size_t i = 0; i <= size; ++i)
+		map[i] = NOT_MAPPED;
+	return map;
+}
+
+/**
+ * @brief Rewrites the targets of jf/jt/def_lambda from old to new indices.
+ */
+static bool remap_jumps(OpcodeVector *code, const size_t *old_to_new_map,
+			size_t map_size)
+{
+	for (size_t i = 0; i < code->size; ++i) {
+		opcode *op = &code->data[i];
+		if (op->op == op_jf || op->op == op_jt ||
+		    op->op == op_def_lambda) {
+			uint32_t old_target_index = op->num;
+
+			if (old_target_index >= map_size) {
+				fprintf(stderr,
+					"Optimizer: Found jump to invalid old index %u\n",
+					old_target_index);
+				return false;
+			}
+
+			size_t new_target_index =
+				old_to_new_map[old_target_index];
+
+			if (new_target_index == NOT_MAPPED) {
+				fprintf(stderr,
+					"Optimizer: Jump target %u was optimized away!\n",
+					old_target_index);
+				return false;
+			}
+
+			op->num = (uint32_t)new_target_index;
+		}
+	}
+	return true;
+}
+
+/**
+ * @brief Rewrites [-], [>], copy/multiply loops and friends into single ops.
+ */
+static bool fold_loops(const OpcodeVector *in_code, OpcodeVector *out_code,
+		       size_t *old_to_new_map, const OptimizeOptions *options)
+{
+	uint32_t mask = CellWidth_mask(options->cell);
 	for (size_t i = 0; i < in_code->size; ++i) {
 		const opcode *op = &in_code->data[i];
 
@@ -133,11 +292,9 @@ bool optimize(const OpcodeVector *in_code, OpcodeVector *out_code)
 		    (in_code->data[i + 2].num == i) && // `]` jumps to `[`
 		    (op->num == (i + 3)) // `[` jumps past `]`
 		) {
-			opcode clear_op = { op_clear, 0 };
-			if (!OpcodeVector_push_back(out_code, clear_op)) {
-				free(old_to_new_map);
+			opcode clear_op = { op_clear, 0, 0, 0 };
+			if (!OpcodeVector_push_back(out_code, clear_op))
 				return false;
-			}
 
 			old_to_new_map[i + 1] = NOT_MAPPED;
 			old_to_new_map[i + 2] = NOT_MAPPED;
@@ -146,42 +303,363 @@ bool optimize(const OpcodeVector *in_code, OpcodeVector *out_code)
 			continue;
 		}
 
-		if (!OpcodeVector_push_back(out_code, *op)) {
-			free(old_to_new_map);
-			return false;
+		if (op->op == op_jf && (i + 2 < in_code->size) &&
+		    (in_code->data[i + 1].op == op_addp ||
+		     in_code->data[i + 1].op == op_subp) &&
+		    (in_code->data[i + 2].op == op_jt) &&
+		    (in_code->data[i + 2].num == i) && // `]` jumps to `[`
+		    (op->num == (i + 3)) // `[` jumps past `]`
+		) {
+			opcode scan_op = { in_code->data[i + 1].op == op_addp ?
+						   op_scanr :
+						   op_scanl,
+					   in_code->data[i + 1].num, 0, 0 };
+			if (!OpcodeVector_push_back(out_code, scan_op))
+				return false;
+
+			old_to_new_map[i + 1] = NOT_MAPPED;
+			old_to_new_map[i + 2] = NOT_MAPPED;
+
+			i += 2; // Skip all 3 opcodes
+			continue;
 		}
+
+		CellDelta cells[MUL_LOOP_MAX_CELLS];
+		size_t cell_count;
+		if (match_mul_loop(in_code, i, mask, cells, &cell_count)) {
+			for (size_t c = 0; c < cell_count; ++c) {
+				opcode mul_op = { op_mul, cells[c].delta,
+						  cells[c].offset, 0 };
+				if (!OpcodeVector_push_back(out_code, mul_op))
+					return false;
+			}
+
+			opcode clear_op = { op_clear, 0, 0, 0 };
+			if (!OpcodeVector_push_back(out_code, clear_op))
+				return false;
+
+			size_t jt_idx = op->num - 1;
+			for (size_t j = i + 1; j <= jt_idx; ++j)
+				old_to_new_map[j] = NOT_MAPPED;
+
+			i = jt_idx; // Skip the whole loop
+			continue;
+		}
+
+		if (!OpcodeVector_push_back(out_code, *op))
+			return false;
 	}
 
-	old_to_new_map[in_code->size] = out_code->size;
+	return true;
+}
 
-	for (size_t i = 0; i < out_code->size; ++i) {
-		opcode *op = &out_code->data[i];
-		if (op->op == op_jf || op->op == op_jt) {
-			uint32_t old_target_index = op->num;
+static bool is_pointer_barrier(optype_t op)
+{
+	switch (op) {
+	case op_jf:
+	case op_jt:
+	case op_scanr:
+	case op_scanl:
+	case op_def_lambda:
+	case op_ret:
+	case op_call:
+		return true;
+	default:
+		return false;
+	}
+}
 
-			if (old_target_index >= map_size) {
-				fprintf(stderr,
-					"Optimizer: Found jump to invalid old index %u\n",
-					old_target_index);
-				free(old_to_new_map);
-				return false;
-			}
+/**
+ * @brief Folds `>`/`<` runs into the `offset` of the cell ops that follow.
+ *
+ * Pointer movement is only materialised (as one op_addp/op_subp) right
+ * before ops that need the real p: loop edges, scans and lambda ops. Inside
+ * a basic block every cell access becomes p[offset].
+ */
+static bool fold_pointer_moves(const OpcodeVector *in_code,
+			       OpcodeVector *out_code, size_t *old_to_new_map,
+			       const OptimizeOptions *options)
+{
+	(void)options;
+	int32_t pending = 0;
+	for (size_t i = 0; i < in_code->size; ++i) {
+		opcode op = in_code->data[i];
 
-			size_t new_target_index =
-				old_to_new_map[old_target_index];
+		if (op.op == op_addp || op.op == op_subp) {
+			// A jump here lands on whatever is emitted next
+			old_to_new_map[i] = out_code->size;
+			pending += op.op == op_addp ? (int32_t)op.num :
+						      -(int32_t)op.num;
+			continue;
+		}
 
-			if (new_target_index == NOT_MAPPED) {
-				fprintf(stderr,
-					"Optimizer: Jump target %u was optimized away!\n",
-					old_target_index);
-				free(old_to_new_map);
+		if (is_pointer_barrier(op.op) && pending != 0) {
+			opcode move_op = { pending > 0 ? op_addp : op_subp,
+					   pending > 0 ? (uint32_t)pending :
+							 (uint32_t)-pending,
+					   0, 0 };
+			if (!OpcodeVector_push_back(out_code, move_op))
 				return false;
-			}
+			pending = 0;
+		}
 
-			op->num = (uint32_t)new_target_index;
+		// A back-edge to `[` must not replay the move emitted above
+		old_to_new_map[i] = out_code->size;
+
+		op.offset += pending;
+		if (op.op == op_mul)
+			op.src += pending;
+
+		if (!OpcodeVector_push_back(out_code, op))
+			return false;
+	}
+
+	return true;
+}
+
+#define COMBINE_MAX_CELLS 32
+
+typedef struct {
+	int32_t offset;
+	bool known; // value is the cell's contents rather than a delta
+	uint32_t value; // wraps at 32 bits; reduced to the cell width on flush
+} CellState;
+
+/**
+ * @brief Emits the op that brings one cell to its tracked state, if any.
+ * `mask` is the cell width's CellWidth_mask(); a delta past half of it is
+ * emitted as the shorter op_sub.
+ */
+static bool flush_cell(OpcodeVector *out_code, const CellState *cell,
+		       uint32_t mask)
+{
+	uint32_t value = cell->value & mask;
+	opcode op = { op_add, value, cell->offset, 0 };
+	if (cell->known) {
+		op.op = value ? op_set : op_clear;
+	} else if (value == 0) {
+		return true;
+	} else if (value > mask / 2 + 1) {
+		op.op = op_sub;
+		op.num = -value & mask;
+	}
+	return OpcodeVector_push_back(out_code, op);
+}
+
+static bool flush_cells(OpcodeVector *out_code, CellState *cells,
+			size_t *count, uint32_t mask)
+{
+	for (size_t i = 0; i < *count; ++i)
+		if (!flush_cell(out_code, &cells[i], mask))
+			return false;
+	*count = 0;
+	return true;
+}
+
+/**
+ * @brief Flushes and forgets the tracked state for `offset`, so the real
+ * cell can be read.
+ */
+static bool flush_offset(OpcodeVector *out_code, CellState *cells,
+			 size_t *count, int32_t offset, uint32_t mask)
+{
+	for (size_t i = 0; i < *count; ++i) {
+		if (cells[i].offset != offset)
+			continue;
+		if (!flush_cell(out_code, &cells[i], mask))
+			return false;
+		cells[i] = cells[--*count];
+		return true;
+	}
+	return true;
+}
+
+static CellState *find_cell(CellState *cells, size_t *count, int32_t offset)
+{
+	for (size_t i = 0; i < *count; ++i)
+		if (cells[i].offset == offset)
+			return &cells[i];
+	if (*count == COMBINE_MAX_CELLS)
+		return NULL;
+	cells[*count] = (CellState){ offset, false, 0 };
+	return &cells[(*count)++];
+}
+
+/**
+ * @brief Combines add/sub/clear/set on the same cell within a basic block.
+ *
+ * Each touched cell is tracked either as a net delta or as a known value
+ * (after op_clear/op_set). The tracked state is only written back when the
+ * cell is read (op_out, op_mul), before an op_in (which leaves the cell as
+ * it was at EOF under EOF_UNCHANGED), at a block boundary, or never if an
+ * op_clear or op_set overwrites it first. A zero delta emits nothing, and a
+ * known value becomes a single op_set (or op_clear for 0).
+ */
+static bool combine_cell_ops(const OpcodeVector *in_code,
+			     OpcodeVector *out_code, size_t *old_to_new_map,
+			     const OptimizeOptions *options)
+{
+	uint32_t mask = CellWidth_mask(options->cell);
+	CellState cells[COMBINE_MAX_CELLS];
+	size_t count = 0;
+	bool ok = true;
+
+	for (size_t i = 0; ok && i < in_code->size; ++i) {
+		opcode op = in_code->data[i];
+		CellState *cell;
+
+		switch (op.op) {
+		case op_add:
+		case op_sub:
+		case op_clear:
+		case op_set:
+			cell = find_cell(cells, &count, op.offset);
+			if (!cell) {
+				ok = flush_cells(out_code, cells, &count, mask);
+				if (!ok)
+					continue;
+				cell = find_cell(cells, &count, op.offset);
+			}
+			if (op.op == op_add)
+				cell->value += op.num;
+			else if (op.op == op_sub)
+				cell->value -= op.num;
+			else {
+				cell->known = true;
+				cell->value = op.op == op_set ? op.num : 0;
+			}
+			// Only jumps into the block's first op exist, and those
+			// land on whatever the block emits first
+			old_to_new_map[i] = out_code->size;
+			continue;
+		case op_in:
+		case op_out:
+			ok = flush_offset(out_code, cells, &count, op.offset,
+					  mask);
+			break;
+		case op_mul:
+			ok = flush_offset(out_code, cells, &count, op.src,
+					  mask) &&
+			     flush_offset(out_code, cells, &count, op.offset,
+					  mask);
+			break;
+		default:
+			ok = flush_cells(out_code, cells, &count, mask);
+			break;
 		}
+
+		old_to_new_map[i] = out_code->size;
+		if (ok)
+			ok = OpcodeVector_push_back(out_code, op);
 	}
 
+	return ok && flush_cells(out_code, cells, &count, mask);
+}
+
+typedef bool (*OptPassFn)(const OpcodeVector *in_code, OpcodeVector *out_code,
+			  size_t *old_to_new_map,
+			  const OptimizeOptions *options);
+
+/**
+ * @brief One optimizer pass. `run` writes its output into an empty vector
+ * and records, for every input index, the output index a jump to it should
+ * land on (NOT_MAPPED if nothing may jump there). The driver owns the map
+ * and rewrites jump targets afterwards.
+ */
+typedef struct {
+	const char *name;
+	int min_level; // Lowest -O level that runs this pass
+	OptPassFn run;
+} OptPass;
+
+static const OptPass g_passes[] = {
+	{ "fold-loops", 1, fold_loops },
+	{ "fold-pointer-moves", 2, fold_pointer_moves },
+	{ "combine-cell-ops", 3, combine_cell_ops },
+};
+
+static bool run_pass(const OptPass *pass, const OpcodeVector *in_code,
+		     OpcodeVector *out_code, const OptimizeOptions *options)
+{
+	OpcodeVector_init(out_code);
+
+	size_t *old_to_new_map = new_index_map(in_code->size);
+	if (!old_to_new_map)
+		return false;
+
+	bool ok = pass->run(in_code, out_code, old_to_new_map, options);
+	old_to_new_map[in_code->size] = out_code->size;
+	if (ok)
+		ok = remap_jumps(out_code, old_to_new_map, in_code->size + 1);
+
 	free(old_to_new_map);
+	if (!ok)
+		OpcodeVector_free(out_code);
+	return ok;
+}
+
+static double elapsed_ms(const struct timespec *begin,
+			 const struct timespec *end)
+{
+	return (double)(end->tv_sec - begin->tv_sec) * 1e3 +
+	       (double)(end->tv_nsec - begin->tv_nsec) / 1e6;
+}
+
+bool optimize_with(const OpcodeVector *in_code, OpcodeVector *out_code,
+		   const OptimizeOptions *options)
+{
+	OpcodeVector current;
+	OpcodeVector_init(&current);
+	for (size_t i = 0; i < in_code->size; ++i) {
+		if (!OpcodeVector_push_back(&current, in_code->data[i])) {
+			OpcodeVector_free(&current);
+			return false;
+		}
+	}
+
+	if (options->time_passes)
+		fprintf(stderr, "pass timing (-O%d):\n", options->level);
+
+	double total_ms = 0;
+	for (size_t i = 0; i < sizeof(g_passes) / sizeof(g_passes[0]); ++i) {
+		const OptPass *pass = &g_passes[i];
+		if (pass->min_level > options->level)
+			continue;
+
+		OpcodeVector next;
+		struct timespec begin, end;
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		bool ok = run_pass(pass, &current, &next, options);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		if (ok && options->time_passes) {
+			double ms = elapsed_ms(&begin, &end);
+			total_ms += ms;
+			fprintf(stderr,
+				"  %-20s %10.3f ms %10zu -> %10zu ops (%zd removed)\n",
+				pass->name, ms, current.size, next.size,
+				(ssize_t)current.size - (ssize_t)next.size);
+		}
+
+		OpcodeVector_free(&current);
+		if (!ok) {
+			fprintf(stderr, "Optimizer: pass %s failed\n",
+				pass->name);
+			return false;
+		}
+		current = next;
+	}
+
+	if (options->time_passes)
+		fprintf(stderr, "  %-20s %10.3f ms %24zu ops\n", "total",
+			total_ms, current.size);
+
+	*out_code = current;
 	return true;
 }
+
+bool optimize(const OpcodeVector *in_code, OpcodeVector *out_code)
+{
+	OptimizeOptions options = { OPTIMIZE_MAX_LEVEL, false, CELL_8 };
+	return optimize_with(in_code, out_code, &options);
+}
@@ -1,17 +1,15 @@
 #include "jit_aarch64.h"
 #include "jit_common.h"
-#include "jit_runtime.h"
 #include "vm.h"
 
 static bool jit_movz_w(JitBuffer *jit, uint8_t rd, uint16_t imm)
 {
-	uint32_t insn = (0x52800000) | (0x2 << 21) | ((uint32_t)imm << 5) | rd;
+	uint32_t insn = (0x52800000) | ((uint32_t)imm << 5) | rd;
 	return JitBuffer_push32(jit, insn);
 }
 static bool jit_movk_w(JitBuffer *jit, uint8_t rd, uint16_t imm)
 {
-	uint32_t insn = (0x52800000) | (0x3 << 21) | (1 << 21) |
-			((uint32_t)imm << 5) | rd;
+	uint32_t insn = (0x72800000) | (1 << 21) | ((uint32_t)imm << 5) | rd;
 	return JitBuffer_push32(jit, insn);
 }
 static bool jit_mov_reg_imm32(JitBuffer *jit, uint8_t rd, uint32_t imm)
@@ -73,21 +71,75 @@ static bool jit_sub_reg_reg_w(JitBuffer *jit, uint8_t rd, uint8_t rn,
 	uint32_t insn = (0x4B000000) | (rm << 16) | (rn << 5) | rd;
 	return JitBuffer_push32(jit, insn);
 }
-static bool jit_ldrb_reg_reg(JitBuffer *jit, uint8_t rt, uint8_t rn)
+static bool jit_mul_reg_reg_w(JitBuffer *jit, uint8_t rd, uint8_t rn,
+			      uint8_t rm)
 {
-	uint32_t insn = (0x39400000) | (rn << 5) | rt;
+	// mul w{rd}, w{rn}, w{rm} (alias for madd with wzr)
+	uint32_t insn = (0x1B007C00) | (rm << 16) | (rn << 5) | rd;
 	return JitBuffer_push32(jit, insn);
 }
-static bool jit_ldrsb_reg_reg(JitBuffer *jit, uint8_t rt, uint8_t rn)
+/*
+ * Cell loads and stores. The byte forms (ldrb/strb and ldurb/sturb) widen
+ * to halfword and word accesses through the size field in bits 31:30,
+ * which holds log2 of the access size just as CellWidth does. Loads
+ * zero-extend into w{rt}.
+ */
+static uint32_t jit_cell_size(const JitBuffer *jit)
 {
-	uint32_t insn = (0x39800000) | (rn << 5) | rt;
-	return JitBuffer_push32(jit, insn);
+	return (uint32_t)jit->cell << 30;
 }
-static bool jit_strb_reg_reg(JitBuffer *jit, uint8_t rt, uint8_t rn)
+static bool jit_ldrc_reg_reg(JitBuffer *jit, uint8_t rt, uint8_t rn)
 {
-	uint32_t insn = (0x39000000) | (rn << 5) | rt;
+	uint32_t insn = (0x39400000) | jit_cell_size(jit) | (rn << 5) | rt;
 	return JitBuffer_push32(jit, insn);
 }
+/**
+ * @brief Emits a cell load/store of [rn + disp].
+ * Uses the scaled uimm12 form for cell-aligned 0..4095 cells, the unscaled
+ * simm9 form (ldur/stur) for -256..-1, and otherwise builds the address in
+ * the x16 scratch register first.
+ */
+static bool jit_memc_disp(JitBuffer *jit, uint32_t uimm_insn,
+			  uint32_t simm_insn, uint8_t rt, uint8_t rn,
+			  int32_t disp)
+{
+	uimm_insn |= jit_cell_size(jit);
+	simm_insn |= jit_cell_size(jit);
+	int32_t align = (int32_t)CellWidth_bytes(jit->cell) - 1;
+	if (disp >= 0 && disp <= (4095 << jit->cell) && (disp & align) == 0)
+		return JitBuffer_push32(jit,
+					uimm_insn |
+						((uint32_t)(disp >> jit->cell)
+						 << 10) |
+						(rn << 5) | rt);
+	if (disp >= -256 && disp < 0)
+		return JitBuffer_push32(jit,
+					simm_insn |
+						(((uint32_t)disp & 0x1FF) << 12) |
+						(rn << 5) | rt);
+	if (disp < 0) {
+		if (!jit_mov_reg_imm32(jit, 16, (uint32_t)-disp))
+			return false;
+		if (!jit_sub_reg_reg(jit, 16, rn, 16))
+			return false;
+	} else {
+		if (!jit_mov_reg_imm32(jit, 16, (uint32_t)disp))
+			return false;
+		if (!jit_add_reg_reg(jit, 16, rn, 16))
+			return false;
+	}
+	return JitBuffer_push32(jit, uimm_insn | (16 << 5) | rt);
+}
+static bool jit_ldrc_reg_disp(JitBuffer *jit, uint8_t rt, uint8_t rn,
+			      int32_t disp)
+{
+	return jit_memc_disp(jit, 0x39400000, 0x38400000, rt, rn, disp);
+}
+static bool jit_strc_reg_disp(JitBuffer *jit, uint8_t rt, uint8_t rn,
+			      int32_t disp)
+{
+	return jit_memc_disp(jit, 0x39000000, 0x38000000, rt, rn, disp);
+}
 static bool jit_blr_reg(JitBuffer *jit, uint8_t rn)
 {
 	uint32_t insn = (0xD63F0000) | (rn << 5);
@@ -114,9 +166,46 @@ static bool jit_ldp_post(JitBuffer *jit, uint8_t rt, uint8_t rt2,
 		(0xA8C00000) | (imm7 << 15) | (rt2 << 10) | (31 << 5) | rt;
 	return JitBuffer_push32(jit, insn);
 }
+/* stp/ldp x{rt}, x{rt2}, [x{rn}, #imm_div_8 * 8], without writeback. */
+static bool jit_stp_off(JitBuffer *jit, uint8_t rt, uint8_t rt2, uint8_t rn,
+			int8_t imm_div_8)
+{
+	uint32_t imm7 = (uint32_t)(imm_div_8 & 0x7F);
+	uint32_t insn =
+		(0xA9000000) | (imm7 << 15) | (rt2 << 10) | (rn << 5) | rt;
+	return JitBuffer_push32(jit, insn);
+}
+static bool jit_ldp_off(JitBuffer *jit, uint8_t rt, uint8_t rt2, uint8_t rn,
+			int8_t imm_div_8)
+{
+	uint32_t imm7 = (uint32_t)(imm_div_8 & 0x7F);
+	uint32_t insn =
+		(0xA9400000) | (imm7 << 15) | (rt2 << 10) | (rn << 5) | rt;
+	return JitBuffer_push32(jit, insn);
+}
+/* ldr/str x{rt}, [x{rn}, #disp] for a multiple of 8 below 32 KiB. */
+static bool jit_ldr_reg_disp64(JitBuffer *jit, uint8_t rt, uint8_t rn,
+			       uint32_t disp)
+{
+	uint32_t insn = (0xF9400000) | ((disp / 8) << 10) | (rn << 5) | rt;
+	return JitBuffer_push32(jit, insn);
+}
+static bool jit_str_reg_disp64(JitBuffer *jit, uint8_t rt, uint8_t rn,
+			       uint32_t disp)
+{
+	uint32_t insn = (0xF9000000) | ((disp / 8) << 10) | (rn << 5) | rt;
+	return JitBuffer_push32(jit, insn);
+}
+static bool jit_cmp_reg_reg(JitBuffer *jit, uint8_t rn, uint8_t rm)
+{
+	// cmp x{rn}, x{rm} (alias for subs xzr, x{rn}, x{rm})
+	uint32_t insn = (0xEB00001F) | (rm << 16) | (rn << 5);
+	return JitBuffer_push32(jit, insn);
+}
 static bool jit_mov_reg_sp(JitBuffer *jit, uint8_t rd)
 {
-	uint32_t insn = (0x910003FF) | rd;
+	// mov x{rd}, sp (alias for add x{rd}, sp, #0)
+	uint32_t insn = (0x910003E0) | rd;
 	return JitBuffer_push32(jit, insn);
 }
 static bool jit_cbz_reg(JitBuffer *jit, uint8_t rt, size_t target_opcode_index)
@@ -133,12 +222,495 @@ static bool jit_cbnz_reg(JitBuffer *jit, uint8_t rt, size_t target_opcode_index)
 		return false; // 1 = cbnz
 	return JitBuffer_push32(jit, insn);
 }
+
+/*
+ * cbz/cbnz only reach +/-1 MiB. A loop whose ops could compile to more than
+ * that (at a generous JIT_MAX_OP_BYTES each) branches with the inverted
+ * condition over a `b` (imm26, +/-128 MiB) instead.
+ */
+#define JIT_MAX_OP_BYTES 256
+#define JIT_CBZ_RANGE (1 << 20)
+#define JUMP_TYPE_B 2
+
+static bool jit_loop_needs_long_branch(size_t from_pc, size_t to_pc)
+{
+	size_t span = from_pc > to_pc ? from_pc - to_pc : to_pc - from_pc;
+	return span >= JIT_CBZ_RANGE / JIT_MAX_OP_BYTES;
+}
+
+/**
+ * @brief Branches to `target_opcode_index` if w{rt} is zero (`if_zero`) or
+ * non-zero, using the long form when the loop is too large for cbz/cbnz.
+ */
+static bool jit_cond_branch(JitBuffer *jit, uint8_t rt, bool if_zero,
+			    size_t pc, size_t target_opcode_index)
+{
+	if (!jit_loop_needs_long_branch(pc, target_opcode_index))
+		return if_zero ? jit_cbz_reg(jit, rt, target_opcode_index) :
+				 jit_cbnz_reg(jit, rt, target_opcode_index);
+
+	// cbnz/cbz w{rt}, #8 ; b target
+	uint32_t skip = (if_zero ? 0x35000000 : 0x34000000) | (2 << 5) | rt;
+	if (!JitBuffer_push32(jit, skip))
+		return false;
+	if (!JitBuffer_add_jump_patch(jit, target_opcode_index, JUMP_TYPE_B))
+		return false;
+	return JitBuffer_push32(jit, 0x14000000);
+}
 static bool jit_mov_reg_reg(JitBuffer *jit, uint8_t rd, uint8_t rn)
 {
 	// mov x{rd}, x{rn} (alias for orr x{rd}, xzr, x{rn})
 	uint32_t insn = (0xAA0003E0) | (rn << 16) | rd;
 	return JitBuffer_push32(jit, insn);
 }
+/**
+ * @brief Points the b/cbz/cbnz at `at` to `target`. Used for labels local
+ * to a single op; opcode-level jumps go through JitBuffer_patch_jumps().
+ */
+static void jit_patch_local_branch(JitBuffer *jit, size_t at, size_t target)
+{
+	int32_t offset_div_4 = (int32_t)(((intptr_t)target - (intptr_t)at) / 4);
+	uint32_t *insn = (uint32_t *)(jit->buffer + at);
+	if ((*insn & 0xFC000000) == 0x14000000) // b (imm26)
+		*insn = (*insn & 0xFC000000) |
+			((uint32_t)offset_div_4 & 0x03FFFFFF);
+	else // cbz/cbnz (imm19)
+		*insn = (*insn & 0xFF00001F) |
+			(((uint32_t)offset_div_4 & 0x7FFFF) << 5);
+}
+
+/**
+ * @brief Emits w2 = (right ? p : ~p) & mask, for a mask of the form
+ * (2^k - 1) << s.
+ */
+static bool jit_scan_lane_index(JitBuffer *jit, uint32_t mask, bool right)
+{
+	uint32_t imms = (uint32_t)__builtin_popcount(mask) - 1;
+	uint32_t immr = (32 - (uint32_t)__builtin_ctz(mask)) & 31;
+	uint8_t rn = 19;
+	if (!right) {
+		// mvn w2, w19 (orn w2, wzr, w19)
+		if (!JitBuffer_push32(jit, (0x2A2003E0) | (19 << 16) | 2))
+			return false;
+		rn = 2;
+	}
+	// and w2, w{rn}, #mask
+	if (!JitBuffer_push32(jit, (0x12000000) | (immr << 16) | (imms << 10) |
+					   (rn << 5) | 2))
+		return false;
+	// lsl w2, w2, #2 (one nibble per lane)
+	return JitBuffer_push32(jit, 0x531E7442);
+}
+
+/**
+ * @brief Emits op_scanr/op_scanl: move x19 by `stride` cells until the
+ * cell at [x19] is zero.
+ *
+ * Same scheme as the x86-64 backend, using NEON on aligned 16-byte chunks.
+ * AArch64 has no pmovmskb, so cmeq (on bytes, halfwords or words) + shrn #4
+ * packs the chunk into a 64-bit mask with one nibble per byte, which is
+ * ANDed with the first byte of each cell reachable at this stride. Steps
+ * of a power of two up to 16 bytes take this path; others use a scalar
+ * loop.
+ *
+ * Clobbers x0-x3, v0.
+ */
+static bool jit_scan(JitBuffer *jit, uint32_t stride, bool right)
+{
+	size_t done_patch, found_patch;
+	uint32_t width = (uint32_t)CellWidth_bytes(jit->cell);
+	int32_t step;
+	if (!JitBuffer_cell_disp(jit, stride, &step))
+		return false;
+
+	if (step > 16 || (step & (step - 1)) != 0) {
+		size_t loop_start = jit->size;
+		if (!jit_ldrc_reg_reg(jit, 0, 19))
+			return false;
+		done_patch = jit->size;
+		if (!JitBuffer_push32(jit, 0x34000000)) // cbz w0, done
+			return false;
+		if (!jit_mov_reg_imm32(jit, 1, (uint32_t)step))
+			return false;
+		if (right) {
+			if (!jit_add_reg_reg(jit, 19, 19, 1))
+				return false;
+		} else {
+			if (!jit_sub_reg_reg(jit, 19, 19, 1))
+				return false;
+		}
+		size_t loop_patch = jit->size;
+		if (!JitBuffer_push32(jit, 0x14000000)) // b loop
+			return false;
+		jit_patch_local_branch(jit, loop_patch, loop_start);
+		jit_patch_local_branch(jit, done_patch, jit->size);
+		return true;
+	}
+
+	// Lanes reachable from lane 0 (right) or the last cell (left)
+	uint64_t pattern = 0;
+	for (uint32_t i = 0; i < 16; i += (uint32_t)step)
+		pattern |= (uint64_t)0xF << (4 * i);
+	if (!right)
+		pattern <<= 4 * ((uint32_t)step - width);
+
+	const uint32_t shift_x3_x2 = right ? 0x9AC22063 : 0x9AC22463; // lsl/lsr
+	const uint32_t test_chunk[] = {
+		0x3DC00000, // ldr q0, [x0]
+		0x4E209800 | ((uint32_t)jit->cell << 22), // cmeq v0.16b/8h/4s, #0
+		0x0F0C8400, // shrn v0.8b, v0.8h, #4
+		0x9E660001, // fmov x1, d0
+		0x8A030021, // and x1, x1, x3
+	};
+
+	// Fast path: already on a zero cell
+	if (!jit_ldrc_reg_reg(jit, 0, 19))
+		return false;
+	done_patch = jit->size;
+	if (!JitBuffer_push32(jit, 0x34000000)) // cbz w0, done
+		return false;
+
+	// and x0, x19, #~15
+	if (!JitBuffer_push32(jit, 0x927CEE60))
+		return false;
+	if (!jit_scan_lane_index(jit, 16 - width, right))
+		return false;
+	if (!jit_mov_reg_imm64(jit, 3, pattern))
+		return false;
+	if (!JitBuffer_push32(jit, shift_x3_x2))
+		return false;
+
+	// First (partial) chunk
+	for (size_t i = 0; i < sizeof(test_chunk) / sizeof(test_chunk[0]); ++i)
+		if (!JitBuffer_push32(jit, test_chunk[i]))
+			return false;
+	found_patch = jit->size;
+	if (!JitBuffer_push32(jit, 0xB5000001)) // cbnz x1, found
+		return false;
+
+	// Mask for all following chunks
+	if (stride > 1) {
+		if (!jit_scan_lane_index(jit, (uint32_t)step - width, right))
+			return false;
+	}
+	if (!jit_mov_reg_imm64(jit, 3, pattern))
+		return false;
+	if (stride > 1) {
+		if (!JitBuffer_push32(jit, shift_x3_x2))
+			return false;
+	}
+
+	// loop: add/sub x0, x0, #16 ; test chunk ; cbz x1, loop
+	size_t loop_start = jit->size;
+	if (!JitBuffer_push32(jit, right ? 0x91004000 : 0xD1004000))
+		return false;
+	for (size_t i = 0; i < sizeof(test_chunk) / sizeof(test_chunk[0]); ++i)
+		if (!JitBuffer_push32(jit, test_chunk[i]))
+			return false;
+	size_t loop_patch = jit->size;
+	if (!JitBuffer_push32(jit, 0xB4000001)) // cbz x1, loop
+		return false;
+	jit_patch_local_branch(jit, loop_patch, loop_start);
+
+	// found: x1 = lane index of the first/last set nibble
+	jit_patch_local_branch(jit, found_patch, jit->size);
+	if (right) {
+		if (!JitBuffer_push32(jit, 0xDAC00021)) // rbit x1, x1
+			return false;
+		if (!JitBuffer_push32(jit, 0xDAC01021)) // clz x1, x1
+			return false;
+	} else {
+		if (!JitBuffer_push32(jit, 0xDAC01021)) // clz x1, x1
+			return false;
+		if (!jit_mov_reg_imm32(jit, 2, 63))
+			return false;
+		if (!jit_sub_reg_reg(jit, 1, 2, 1)) // x1 = 63 - clz
+			return false;
+	}
+	if (!JitBuffer_push32(jit, 0xD342FC21)) // lsr x1, x1, #2
+		return false;
+	if (!jit_add_reg_reg(jit, 19, 0, 1))
+		return false;
+
+	jit_patch_local_branch(jit, done_patch, jit->size);
+	return true;
+}
+
+/**
+ * @brief Opens a run of op_mul that share p[src], whose value is in w0.
+ * Same scheme as jit_mul_run_guard() on x86-64: when `reach` does not
+ * already place the run's targets on the tape, they are bounds-checked,
+ * and out of bounds the run is skipped if w0 is zero.
+ * Sets *out_end to the op after the run, and *out_skip to the cbz that
+ * jit_patch_local_branch() points there, or to 0 when there is no guard.
+ * Clobbers x9 to x11.
+ */
+static bool jit_mul_run_guard(JitBuffer *jit, const OpcodeVector *code,
+			      size_t pc, size_t end_pc,
+			      const JitTapeReach *reach, size_t *out_end,
+			      size_t *out_skip)
+{
+	int32_t src = code->data[pc].src;
+	int64_t lo = INT64_MAX, hi = INT64_MIN;
+	size_t end = pc;
+	for (; end < end_pc; ++end) {
+		const opcode *op = &code->data[end];
+		if (op->op != op_mul || op->src != src || op->offset == src)
+			break;
+		lo = op->offset < lo ? op->offset : lo;
+		hi = op->offset > hi ? op->offset : hi;
+	}
+	*out_end = end;
+	*out_skip = 0;
+	if (end == pc || JitTapeReach_covers(reach, lo, hi))
+		return true;
+
+	// Bytes from the first target cell to the last byte of the last one
+	int64_t width = (int64_t)CellWidth_bytes(jit->cell);
+	int64_t span = (hi - lo) * width + width - 1;
+	int32_t lo_disp;
+	if (!JitBuffer_cell_disp(jit, lo, &lo_disp))
+		return false;
+	size_t body_patch = 0;
+	if (span < (int64_t)BF_TAPE_MIN_SIZE) {
+		// x10 = p + lo - tape, unsigned below tape_size - span
+		if (!jit_ldr_reg_disp64(jit, 9, 20, offsetof(BfVm, tape)) ||
+		    !jit_sub_reg_reg(jit, 10, 19, 9))
+			return false;
+		if (lo_disp < 0) {
+			if (!jit_mov_reg_imm32(jit, 11, (uint32_t)-lo_disp) ||
+			    !jit_sub_reg_reg(jit, 10, 10, 11))
+				return false;
+		} else if (lo_disp > 0) {
+			if (!jit_mov_reg_imm32(jit, 11, (uint32_t)lo_disp) ||
+			    !jit_add_reg_reg(jit, 10, 10, 11))
+				return false;
+		}
+		if (!jit_ldr_reg_disp64(jit, 11, 20,
+					offsetof(BfVm, tape_size)) ||
+		    !jit_mov_reg_imm32(jit, 9, (uint32_t)span) ||
+		    !jit_sub_reg_reg(jit, 11, 11, 9))
+			return false;
+		// cmp x10, x11 ; b.lo body
+		if (!JitBuffer_push32(jit, 0xEB00001F | (11 << 16) | (10 << 5)))
+			return false;
+		body_patch = jit->size;
+		if (!JitBuffer_push32(jit, 0x54000003))
+			return false;
+	}
+	*out_skip = jit->size;
+	if (!JitBuffer_push32(jit, 0x34000000)) // cbz w0, past the run
+		return false;
+	if (body_patch)
+		jit_patch_local_branch(jit, body_patch, jit->size);
+	return true;
+}
+
+/*
+ * Lambdas run on the registers of the region that defined them: x19 is the
+ * data pointer, x20 the BfVm, x21 the fuel slice, x22 the next free entry
+ * of the lambda stack, x23 its end and x24 the lowest sp a call may push a
+ * frame below. A call passes the captured pointer in x9; the lambda's
+ * frame is just the caller's x19 and its own x30, BF_JIT_FRAME bytes.
+ */
+_Static_assert(BF_JIT_FRAME == 16, "a lambda saves x19 and x30");
+_Static_assert(offsetof(Lambda, jit_addr) ==
+			       offsetof(Lambda, captured_p) + 8 &&
+		       offsetof(Lambda, captured_p) % 8 == 0 &&
+		       sizeof(Lambda) <= 64,
+	       "lambda ops move {captured_p, jit_addr} with one stp/ldp");
+_Static_assert(offsetof(BfVm, lambda_stack) + sizeof(LambdaStack) < 32768,
+	       "lambda_stack is reached with a scaled 12-bit offset");
+
+/*
+ * Saves the callee-saved registers a region uses in a 64-byte frame:
+ * x29/x30, x19/x20, x21/x22 and x23/x24.
+ */
+static bool jit_prologue(JitBuffer *jit)
+{
+	return jit_stp_pre(jit, 29, 30, -8) && // stp x29, x30, [sp, #-64]!
+	       jit_mov_reg_sp(jit, 29) && jit_stp_off(jit, 19, 20, 31, 2) &&
+	       jit_stp_off(jit, 21, 22, 31, 4) &&
+	       jit_stp_off(jit, 23, 24, 31, 6);
+}
+static bool jit_epilogue(JitBuffer *jit)
+{
+	return jit_ldp_off(jit, 23, 24, 31, 6) &&
+	       jit_ldp_off(jit, 21, 22, 31, 4) &&
+	       jit_ldp_off(jit, 19, 20, 31, 2) &&
+	       jit_ldp_post(jit, 29, 30, 8) && // ldp x29, x30, [sp], #64
+	       jit_ret(jit);
+}
+static bool jit_lambda_return(JitBuffer *jit)
+{
+	// ldp x19, x30, [sp], #16 ; ret
+	return jit_ldp_post(jit, 19, 30, 2) && jit_ret(jit);
+}
+
+/*
+ * Loads the lambda registers on region entry, with the BfVm in x20 and the
+ * region's sp in x9.
+ */
+static bool jit_lambda_setup(JitBuffer *jit)
+{
+	uint32_t stack = offsetof(BfVm, lambda_stack);
+	// x24 = sp - BF_CALL_DEPTH * BF_JIT_FRAME
+	if (!jit_mov_reg_imm32(jit, 10, BF_CALL_DEPTH * BF_JIT_FRAME) ||
+	    !jit_sub_reg_reg(jit, 24, 9, 10))
+		return false;
+	// Not below the thread's stack: x24 = max(x24, jit_stack_floor)
+	if (!jit_ldr_reg_disp64(jit, 10, 20, offsetof(BfVm, jit_stack_floor)) ||
+	    !jit_cmp_reg_reg(jit, 24, 10) ||
+	    !JitBuffer_push32(jit, 0x9A800000 | (24 << 16) | (0x3 << 12) |
+					   (10 << 5) | 24)) // csel x24, x10, x24, lo
+		return false;
+	// x22 = data + size * sizeof(Lambda) ; x23 = data + capacity * ...
+	if (!jit_ldr_reg_disp64(jit, 9, 20,
+				stack + offsetof(LambdaStack, data)) ||
+	    !jit_mov_reg_imm32(jit, 11, sizeof(Lambda)) ||
+	    !jit_ldr_reg_disp64(jit, 10, 20,
+				stack + offsetof(LambdaStack, size)) ||
+	    !JitBuffer_push32(jit, 0x9B000000 | (11 << 16) | (9 << 10) |
+					   (10 << 5) | 22)) // madd
+		return false;
+	if (!jit_ldr_reg_disp64(jit, 10, 20,
+				stack + offsetof(LambdaStack, capacity)))
+		return false;
+	return JitBuffer_push32(jit, 0x9B000000 | (11 << 16) | (9 << 10) |
+					     (10 << 5) | 23); // madd
+}
+
+/*
+ * Fuel: x21 holds the rest of the VM's fuel slice while a region runs.
+ * Every back-edge and lambda entry costs a `subs` and a not-taken `b.mi`
+ * to a per-site stub emitted after the function, which calls the shared
+ * trap routine and branches back.
+ */
+_Static_assert(offsetof(BfVm, fuel_slice) == 0 &&
+		       offsetof(BfVm, jit_exit_sp) == 8,
+	       "JIT code addresses the fuel fields directly");
+_Static_assert(sizeof(VmStatus) == 4 && offsetof(BfVm, status) % 4 == 0,
+	       "stops store vm->status as a word");
+
+static bool jit_fuel_check(JitBuffer *jit, size_t pc, size_t end_pc)
+{
+	if (!JitBuffer_push32(jit, 0xF10006B5)) // subs x21, x21, #1
+		return false;
+	if (jit_loop_needs_long_branch(pc, end_pc)) {
+		// The stubs follow the function: b.pl #8 ; b <stub>
+		if (!JitBuffer_push32(jit, 0x54000045))
+			return false;
+		if (!JitBuffer_add_fuel_site(jit, jit->size))
+			return false;
+		return JitBuffer_push32(jit, 0x14000000);
+	}
+	if (!JitBuffer_add_fuel_site(jit, jit->size))
+		return false;
+	return JitBuffer_push32(jit, 0x54000004); // b.mi <stub>
+}
+
+/**
+ * @brief Emits the stubs for the fuel checks pushed since `first_site`:
+ * `bl <trap routine> ; b <after the check>`. x30 is free to clobber, as
+ * every function saved it on entry.
+ */
+static bool jit_fuel_stubs(JitBuffer *jit, size_t first_site)
+{
+	for (size_t i = first_site; i < jit->fuel_site_count; ++i) {
+		size_t site = jit->fuel_sites[i];
+		jit_patch_local_branch(jit, site, jit->size);
+
+		int32_t to_trap =
+			(int32_t)(((intptr_t)jit->fuel_trap - (intptr_t)jit->size) /
+				  4);
+		if (!JitBuffer_push32(jit, 0x94000000 |
+						   ((uint32_t)to_trap & 0x03FFFFFF)))
+			return false;
+		int32_t to_resume =
+			(int32_t)(((intptr_t)site + 4 - (intptr_t)jit->size) / 4);
+		if (!JitBuffer_push32(jit, 0x14000000 |
+						   ((uint32_t)to_resume & 0x03FFFFFF)))
+			return false;
+	}
+	jit->fuel_site_count = first_site;
+	return true;
+}
+
+/**
+ * @brief Emits the routine fuel stubs call. It hands x21 back to the VM and
+ * asks vm_fuel_trap() whether to go on: if so it reloads the refilled slice
+ * and returns; if not it unwinds straight out of the region, however many
+ * lambda frames deep, from the stack pointer the region saved on entry.
+ * Ahead of the unwinding tail sit the stops lambda ops branch to when a
+ * stack check fails (see jit_b_stop()).
+ */
+static bool jit_fuel_trap_routine(JitBuffer *jit)
+{
+	jit->fuel_trap = jit->size;
+	if (!jit_str_reg_disp64(jit, 21, 20, offsetof(BfVm, fuel_slice)))
+		return false;
+	if (!jit_stp_pre(jit, 29, 30, -2)) // stp x29, x30, [sp, #-16]!
+		return false;
+	if (!jit_mov_reg_reg(jit, 0, 20))
+		return false;
+	if (!jit_mov_reg_imm64(jit, 2, (uint64_t)vm_fuel_trap))
+		return false;
+	if (!jit_blr_reg(jit, 2))
+		return false;
+	if (!jit_ldp_post(jit, 29, 30, 2)) // ldp x29, x30, [sp], #16
+		return false;
+	if (!jit_ldr_reg_disp64(jit, 21, 20, offsetof(BfVm, fuel_slice)))
+		return false;
+	if (!JitBuffer_push32(jit, 0x72001C1F)) // tst w0, #0xff
+		return false;
+	size_t stop = jit->size;
+	if (!JitBuffer_push32(jit, 0x54000001)) // b.ne <tail>
+		return false;
+	if (!jit_ret(jit))
+		return false;
+
+	// The stops: w9 = status ; str w9, [x20 + status]
+	jit->stack_overflow = jit->size;
+	if (!jit_mov_reg_imm32(jit, 9, VM_STACK_OVERFLOW))
+		return false;
+	size_t to_store = jit->size;
+	if (!JitBuffer_push32(jit, 0x14000000)) // b <store>
+		return false;
+	jit->no_lambda = jit->size;
+	if (!jit_mov_reg_imm32(jit, 9, VM_NO_LAMBDA))
+		return false;
+	jit_patch_local_branch(jit, to_store, jit->size);
+	if (!JitBuffer_push32(jit, 0xB9000000 |
+					   ((offsetof(BfVm, status) / 4) << 10) |
+					   (20 << 5) | 9))
+		return false;
+
+	// mov sp, <jit_exit_sp> ; mov x0, x19
+	jit_patch_local_branch(jit, stop, jit->size);
+	if (!jit_ldr_reg_disp64(jit, 9, 20, offsetof(BfVm, jit_exit_sp)))
+		return false;
+	if (!JitBuffer_push32(jit, 0x9100013F))
+		return false;
+	if (!jit_mov_reg_reg(jit, 0, 19))
+		return false;
+	return jit_epilogue(jit);
+}
+
+/**
+ * @brief Branches to `stop` (jit->stack_overflow or jit->no_lambda) unless
+ * the condition `skip_cond` holds: `b.<skip_cond> #8 ; b <stop>`, as b.cond
+ * reaches only 1 MiB.
+ */
+static bool jit_b_stop(JitBuffer *jit, uint8_t skip_cond, size_t stop)
+{
+	if (!JitBuffer_push32(jit, 0x54000040u | skip_cond))
+		return false;
+	int32_t to_stop =
+		(int32_t)(((intptr_t)stop - (intptr_t)jit->size) / 4);
+	return JitBuffer_push32(jit,
+				0x14000000 | ((uint32_t)to_stop & 0x03FFFFFF));
+}
+
 /**
  * @brief AArch64 implementation of the jump patcher.
  */
@@ -146,14 +718,14 @@ void JitBuffer_patch_jumps(JitBuffer *jit)
 {
 	for (size_t i = 0; i < jit->jump_patch_count; ++i) {
 		JumpPatch *patch = &jit->jump_patches[i];
-		if (patch->target_opcode_index >= jit->opcode_count) {
+		if (!JitBuffer_has_opcode(jit, patch->target_opcode_index)) {
 			fprintf(stderr,
 				"Error: Invalid target opcode index %zu in jump patch.\n",
 				patch->target_opcode_index);
 			continue;
 		}
-		size_t target_buffer_offset =
-			jit->opcode_addresses[patch->target_opcode_index];
+		size_t target_buffer_offset = JitBuffer_opcode_address(
+			jit, patch->target_opcode_index);
 		size_t jump_instruction_start_offset =
 			patch->instruction_offset;
 		intptr_t relative_offset_ptr =
@@ -165,6 +737,22 @@ void JitBuffer_patch_jumps(JitBuffer *jit)
 				(long)relative_offset_ptr);
 			continue;
 		}
+		uint32_t *patch_addr =
+			(uint32_t *)(jit->buffer +
+				     jump_instruction_start_offset);
+		if (patch->jump_type == JUMP_TYPE_B) {
+			intptr_t offset_div_4 = relative_offset_ptr / 4;
+			if (offset_div_4 < -0x2000000 ||
+			    offset_div_4 > 0x1FFFFFF) {
+				fprintf(stderr,
+					"Error: Jump offset %ld out of +/-128MB range for b.\n",
+					(long)relative_offset_ptr);
+				continue;
+			}
+			*patch_addr = (*patch_addr & 0xFC000000) |
+				      ((uint32_t)offset_div_4 & 0x3FFFFFF);
+			continue;
+		}
 		int32_t offset_div_4 = (int32_t)(relative_offset_ptr / 4);
 		if (offset_div_4 < -0x40000 || offset_div_4 > 0x3FFFF) {
 			fprintf(stderr,
@@ -173,9 +761,6 @@ void JitBuffer_patch_jumps(JitBuffer *jit)
 			continue;
 		}
 		uint32_t imm19_field = (uint32_t)(offset_div_4 & 0x7FFFF);
-		uint32_t *patch_addr =
-			(uint32_t *)(jit->buffer +
-				     jump_instruction_start_offset);
 		*patch_addr = (*patch_addr & 0xFF00001F) | (imm19_field << 5);
 	}
 }
@@ -184,10 +769,20 @@ void JitBuffer_patch_jumps(JitBuffer *jit)
  * @brief Recursively compiles a function (or main body) for AArch64.
  * @return The 64-bit memory address of the start of the compiled function.
  */
+/*
+ * as_region: emit a JitRegionFn, taking the data pointer in x0 and the BfVm
+ * in x1 and returning the final data pointer in x0, rather than a lambda
+ * that shares the region's registers (see jit_prologue()).
+ */
 static uint64_t jit_compile_function_aarch64(JitBuffer *jit,
 					     const OpcodeVector *code,
-					     size_t start_pc, size_t end_pc)
+					     size_t start_pc, size_t end_pc,
+					     bool as_region)
 {
+	// A region's fuel stubs call a trap routine placed just ahead of it
+	if (as_region && !jit_fuel_trap_routine(jit))
+		return 0;
+
 	/* Align to 16-bytes for function entry */
 	size_t alignment = 16 - (jit->size % 16);
 	if (alignment != 16) {
@@ -198,185 +793,239 @@ static uint64_t jit_compile_function_aarch64(JitBuffer *jit,
 
 	uint64_t function_start_addr = (uint64_t)(jit->buffer + jit->size);
 	size_t pc = start_pc;
+	size_t first_fuel_site = jit->fuel_site_count;
 
-	// x19 = data pointer, x20 = scratch/runtime arg
-	// stp x29, x30, [sp, #-32]!  (Save FP, LR)
-	if (!jit_stp_pre(jit, 29, 30, -4))
-		goto error;
-	// mov x29, sp
-	if (!jit_mov_reg_sp(jit, 29))
-		goto error;
-	// stp x19, x20, [sp, #16]   (Save callee-saved x19, x20)
-	uint32_t stp_x19_x20 =
-		(0xA9010000) | (2 << 15) | (20 << 10) | (31 << 5) | 19;
-	if (!JitBuffer_push32(jit, stp_x19_x20))
-		goto error;
+	if (as_region) {
+		// mov x19, x0 ; mov x20, x1
+		if (!jit_prologue(jit) || !jit_mov_reg_reg(jit, 19, 0) ||
+		    !jit_mov_reg_reg(jit, 20, 1))
+			goto error;
+		if (!jit_ldr_reg_disp64(jit, 21, 20, offsetof(BfVm, fuel_slice)))
+			goto error;
+		// mov x9, sp ; str x9, [x20 + jit_exit_sp]
+		if (!jit_mov_reg_sp(jit, 9) ||
+		    !jit_str_reg_disp64(jit, 9, 20, offsetof(BfVm, jit_exit_sp)))
+			goto error;
+		if (!jit_lambda_setup(jit))
+			goto error;
+	} else {
+		// stp x19, x30, [sp, #-16]! ; mov x19, x9
+		if (!jit_stp_pre(jit, 19, 30, -2) || !jit_mov_reg_reg(jit, 19, 9))
+			goto error;
+		if (!jit_fuel_check(jit, start_pc, end_pc)) // lambda entry
+			goto error;
+	}
 
+	size_t mul_end = 0, mul_skip = 0; // see jit_mul_run_guard()
+	JitTapeReach reach = { false, 0, 0 };
 	while (pc < end_pc) {
 		const opcode *op = &code->data[pc];
+		if (mul_skip && pc == mul_end) {
+			jit_patch_local_branch(jit, mul_skip, jit->size);
+			mul_skip = 0;
+		}
 		JitBuffer_record_opcode_address(jit, pc);
+		int32_t disp, src_disp; // op->offset and op->src in bytes
+		if (!JitBuffer_cell_disp(jit, op->offset, &disp) ||
+		    !JitBuffer_cell_disp(jit, op->src, &src_disp))
+			goto error;
 
 		switch (op->op) {
 		case op_add:
-			if (!jit_ldrb_reg_reg(jit, 0, 19))
+			if (!jit_ldrc_reg_disp(jit, 0, 19, disp))
 				goto error;
 			if (!jit_mov_reg_imm32(jit, 1, op->num))
 				goto error;
 			if (!jit_add_reg_reg_w(jit, 0, 0, 1))
 				goto error;
-			if (!jit_strb_reg_reg(jit, 0, 19))
+			if (!jit_strc_reg_disp(jit, 0, 19, disp))
 				goto error;
 			break;
 		case op_sub:
-			if (!jit_ldrb_reg_reg(jit, 0, 19))
+			if (!jit_ldrc_reg_disp(jit, 0, 19, disp))
 				goto error;
 			if (!jit_mov_reg_imm32(jit, 1, op->num))
 				goto error;
 			if (!jit_sub_reg_reg_w(jit, 0, 0, 1))
 				goto error;
-			if (!jit_strb_reg_reg(jit, 0, 19))
+			if (!jit_strc_reg_disp(jit, 0, 19, disp))
 				goto error;
 			break;
 		case op_addp:
-			if (!jit_mov_reg_imm32(jit, 0, op->num))
+		case op_subp: {
+			int32_t step;
+			if (!JitBuffer_cell_disp(jit, op->num, &step) ||
+			    !jit_mov_reg_imm32(jit, 0, (uint32_t)step))
 				goto error;
-			if (!jit_add_reg_reg(jit, 19, 19, 0))
-				goto error;
-			break;
-		case op_subp:
-			if (!jit_mov_reg_imm32(jit, 0, op->num))
-				goto error;
-			if (!jit_sub_reg_reg(jit, 19, 19, 0))
+			if (op->op == op_addp) {
+				if (!jit_add_reg_reg(jit, 19, 19, 0))
+					goto error;
+			} else if (!jit_sub_reg_reg(jit, 19, 19, 0)) {
 				goto error;
+			}
 			break;
+		}
 		case op_jt:
-			if (!jit_ldrb_reg_reg(jit, 0, 19))
+			if (!jit_fuel_check(jit, pc, end_pc))
 				goto error;
-			if (!jit_cbnz_reg(jit, 0, op->num))
+			if (!jit_ldrc_reg_reg(jit, 0, 19))
+				goto error;
+			if (!jit_cond_branch(jit, 0, false, pc, op->num))
 				goto error;
 			break;
 		case op_jf:
-			if (!jit_ldrb_reg_reg(jit, 0, 19))
+			if (!jit_ldrc_reg_reg(jit, 0, 19))
 				goto error;
-			if (!jit_cbz_reg(jit, 0, op->num))
+			if (!jit_cond_branch(jit, 0, true, pc, op->num))
 				goto error;
 			break;
 		case op_in:
-			if (!jit_mov_reg_imm64(jit, 0, (uint64_t)getchar))
+			// w0 = vm_read_cell(vm, old value), which applies --eof
+			if (!jit_ldrc_reg_disp(jit, 1, 19, disp))
+				goto error;
+			if (!jit_mov_reg_reg(jit, 0, 20))
 				goto error;
-			if (!jit_blr_reg(jit, 0))
+			if (!jit_mov_reg_imm64(jit, 2, (uint64_t)vm_read_cell))
+				goto error;
+			if (!jit_blr_reg(jit, 2))
 				goto error;
-			if (!jit_strb_reg_reg(jit, 0, 19))
+			if (!jit_strc_reg_disp(jit, 0, 19, disp))
 				goto error;
 			break;
 		case op_out:
-			if (!jit_ldrsb_reg_reg(jit, 0, 19))
+			// vm_putchar(vm, cell)
+			if (!jit_ldrc_reg_disp(jit, 1, 19, disp))
 				goto error;
-			if (!jit_mov_reg_imm64(jit, 1, (uint64_t)putchar))
+			if (!jit_mov_reg_reg(jit, 0, 20))
 				goto error;
-			if (!jit_blr_reg(jit, 1))
+			if (!jit_mov_reg_imm64(jit, 2, (uint64_t)vm_putchar))
+				goto error;
+			if (!jit_blr_reg(jit, 2))
 				goto error;
 			break;
 		case op_clear:
 			if (!jit_mov_reg_imm32(jit, 0, 0))
 				goto error;
-			if (!jit_strb_reg_reg(jit, 0, 19))
+			if (!jit_strc_reg_disp(jit, 0, 19, disp))
+				goto error;
+			break;
+		case op_set:
+			if (!jit_mov_reg_imm32(jit, 0,
+					       op->num & CellWidth_mask(jit->cell)))
+				goto error;
+			if (!jit_strc_reg_disp(jit, 0, 19, disp))
+				goto error;
+			break;
+		case op_scanr:
+			if (!jit_scan(jit, op->num, true))
+				goto error;
+			break;
+		case op_scanl:
+			if (!jit_scan(jit, op->num, false))
+				goto error;
+			break;
+		case op_mul: {
+			// p[offset] += p[src] * num, guarded per run of muls by
+			// jit_mul_run_guard()
+			if (!jit_ldrc_reg_disp(jit, 0, 19, src_disp))
+				goto error;
+			if (pc >= mul_end &&
+			    !jit_mul_run_guard(jit, code, pc, end_pc, &reach,
+					       &mul_end, &mul_skip))
+				goto error;
+			if (op->num != 1) {
+				if (!jit_mov_reg_imm32(jit, 1, op->num))
+					goto error;
+				if (!jit_mul_reg_reg_w(jit, 0, 0, 1))
+					goto error;
+			}
+			if (!jit_ldrc_reg_disp(jit, 1, 19, disp))
+				goto error;
+			if (!jit_add_reg_reg_w(jit, 1, 1, 0))
+				goto error;
+			if (!jit_strc_reg_disp(jit, 1, 19, disp))
 				goto error;
 			break;
+		}
 
 		case op_def_lambda: {
+			// The body is compiled in line, behind a b that skips it
+			size_t skip_body = jit->size;
+			if (!JitBuffer_push32(jit, 0x14000000))
+				return 0;
 			uint64_t lambda_addr = jit_compile_function_aarch64(
-				jit, code, pc + 1, op->num);
+				jit, code, pc + 1, op->num, false);
 			if (lambda_addr == 0)
 				return 0;
+			jit_patch_local_branch(jit, skip_body, jit->size);
 
-			// Emit call to runtime helper
-			// void jit_runtime_push_lambda(uint64_t jit_addr, uint32_t captured_p);
-			// x0 = jit_addr, w1 = captured_p (x19)
-			if (!jit_mov_reg_imm64(jit, 0, lambda_addr))
-				goto error;
-			if (!jit_mov_reg_reg(jit, 1, 19))
-				return 0; // w1 <- x19
-			if (!jit_mov_reg_imm64(
-				    jit, 2, (uint64_t)jit_runtime_push_lambda))
+			// Push {captured_p = x19, jit_addr} unless the stack is
+			// full: cmp x22, x23 ; b.lo #8 ; b <overflow>
+			if (!jit_cmp_reg_reg(jit, 22, 23) ||
+			    !jit_b_stop(jit, 0x3, jit->stack_overflow))
 				return 0;
-			if (!jit_blr_reg(jit, 2))
+			// stp x19, x9, [x22, #captured_p] ; add x22, x22, #size
+			if (!jit_mov_reg_imm64(jit, 9, lambda_addr) ||
+			    !jit_stp_off(jit, 19, 9, 22,
+					 offsetof(Lambda, captured_p) / 8) ||
+			    !JitBuffer_push32(jit, 0x91000000 |
+							   (sizeof(Lambda) << 10) |
+							   (22 << 5) | 22))
 				return 0;
 
 			// Skip body
 			pc = op->num;
+			reach.known = false;
 			continue;
 		}
 
 		case op_ret:
-			// ldp x19, x20, [sp, #16]
-			if (!JitBuffer_push32(jit, (0xA9410000) | (2 << 15) |
-							   (20 << 10) |
-							   (31 << 5) | 19))
-				return 0;
-			// ldp x29, x30, [sp], #32
-			if (!jit_ldp_post(jit, 29, 30, 4))
-				return 0;
-			if (!jit_ret(jit))
+			if (!jit_lambda_return(jit))
 				return 0;
 			break;
 
 		case op_call: {
-			// mov x20, <placeholder>
-			if (!jit_mov_reg_imm64(jit, 20, 0xDEADBEEFCAFEBABE))
-				return 0;
-			size_t ret_addr_patch_loc =
-				jit->size - 8; // Start of the 64-bit imm
-
-			// Lambda jit_runtime_pre_call(uint32_t current_p, uint64_t return_pc);
-			// w0 = current_p (x19), x1 = return_pc (x20)
-			if (!jit_mov_reg_reg(jit, 0, 19))
-				return 0; // w0 <- x19
-			if (!jit_mov_reg_reg(jit, 1, 20))
-				return 0; // x1 <- x20
-			if (!jit_mov_reg_imm64(jit, 2,
-					       (uint64_t)jit_runtime_pre_call))
-				return 0;
-			if (!jit_blr_reg(jit, 2))
+			int8_t top = -(int8_t)sizeof(Lambda);
+			// ldr x9, [x20 + lambda_stack.data] ; cmp x22, x9 ;
+			// b.ne #8 ; b <no lambda>
+			if (!jit_ldr_reg_disp64(jit, 9, 20,
+						offsetof(BfVm, lambda_stack) +
+							offsetof(LambdaStack,
+								 data)) ||
+			    !jit_cmp_reg_reg(jit, 22, 9) ||
+			    !jit_b_stop(jit, 0x1, jit->no_lambda))
 				return 0;
-			// Lambda struct is returned in x0 (jit_addr) and x1 (captured_p)
-
-			if (!jit_mov_reg_reg(jit, 19, 1))
-				return 0; // x19 <- x1 (new data ptr)
-			if (!jit_blr_reg(jit, 0))
-				return 0; // call lambda
-
-			// uint32_t jit_runtime_post_ret(uint64_t* out_return_pc);
-			// x0 will have our *out_return_pc (not needed)
-			// w0 will have the saved_p
-			if (!jit_mov_reg_imm64(jit, 2,
-					       (uint64_t)jit_runtime_post_ret))
+			// cmp sp, x24 ; b.hi #8 ; b <overflow>
+			if (!JitBuffer_push32(jit, 0xEB2063FF | (24 << 16)) ||
+			    !jit_b_stop(jit, 0x8, jit->stack_overflow))
 				return 0;
-			if (!jit_blr_reg(jit, 2))
+			// ldp x9, x16, [x22, #top.captured_p] ; blr x16
+			if (!jit_ldp_off(jit, 9, 16, 22,
+					 (top + (int8_t)offsetof(Lambda,
+								 captured_p)) /
+						 8) ||
+			    !jit_blr_reg(jit, 16))
 				return 0;
-			// w0 now holds the saved_p
-			if (!jit_mov_reg_reg(jit, 19, 0))
-				return 0; // x19 <- w0
-
-			// Patch the return address
-			uint64_t ret_addr = (uint64_t)(jit->buffer + jit->size);
-			memcpy(jit->buffer + ret_addr_patch_loc, &ret_addr,
-			       sizeof(uint64_t));
 			break;
 		}
 		}
+		JitTapeReach_update(&reach, op);
 		pc++;
 	}
+	if (mul_skip)
+		jit_patch_local_branch(jit, mul_skip, jit->size);
 
 	JitBuffer_record_opcode_address(jit, pc);
-	// ldp x19, x20, [sp, #16]
-	if (!JitBuffer_push32(jit, (0xA9410000) | (2 << 15) | (20 << 10) |
-					   (31 << 5) | 19))
-		return 0;
-	// ldp x29, x30, [sp], #32
-	if (!jit_ldp_post(jit, 29, 30, 4))
+	// str x21, [x20 + fuel_slice] ; mov x0, x19
+	if (as_region) {
+		if (!jit_str_reg_disp64(jit, 21, 20,
+					offsetof(BfVm, fuel_slice)) ||
+		    !jit_mov_reg_reg(jit, 0, 19) || !jit_epilogue(jit))
+			return 0;
+	} else if (!jit_lambda_return(jit)) {
 		return 0;
-	if (!jit_ret(jit))
+	}
+	if (!jit_fuel_stubs(jit, first_fuel_site))
 		return 0;
 
 	return function_start_addr;
@@ -385,63 +1034,15 @@ error:
 	return 0;
 }
 
-bool jit_exec_aarch64(const OpcodeVector *code)
+JitRegionFn jit_compile_region_aarch64(JitBuffer *jit, const OpcodeVector *code,
+				       size_t start_pc, size_t end_pc)
 {
-	JitBuffer jit_mem;
-	memset(&jit_mem, 0, sizeof(jit_mem));
-	bool success = false;
-
-	if (!JitBuffer_create(&jit_mem, 65536, code->size + 1)) {
-		fprintf(stderr, "Failed to initialize JIT memory.\n");
-		return false;
-	}
-
-	// init VM state
-	memset(g_bf_mem, 0, sizeof(g_bf_mem));
-	LambdaStack_init(&g_lambda_stack);
-	CallStack_init(&g_call_stack);
+	uint64_t entry_addr =
+		jit_compile_function_aarch64(jit, code, start_pc, end_pc, true);
+	if (entry_addr == 0)
+		return NULL;
 
-	uint64_t main_func_addr =
-		jit_compile_function_aarch64(&jit_mem, code, 0, code->size);
-	if (main_func_addr == 0) {
-		fprintf(stderr, "JIT compilation failed.\n");
-		goto error;
-	}
-
-	uint64_t start_addr = (uint64_t)(jit_mem.buffer + jit_mem.size);
-	// mov x19, g_bf_mem
-	if (!jit_mov_reg_imm64(&jit_mem, 19, (uint64_t)g_bf_mem))
-		goto error;
-	// mov x0, main_func_addr
-	if (!jit_mov_reg_imm64(&jit_mem, 0, main_func_addr))
-		goto error;
-	// blr x0
-	if (!jit_blr_reg(&jit_mem, 0))
-		goto error;
-	// ret
-	if (!jit_ret(&jit_mem))
-		goto error;
-
-	JitBuffer_patch_jumps(&jit_mem);
-
-	// mprotect is the same for both
-	if (mprotect(jit_mem.buffer, jit_mem.size, PROT_READ | PROT_EXEC) ==
-	    -1) {
-		perror("mprotect failed");
-		goto error;
-	}
-
-	__builtin___clear_cache((char *)jit_mem.buffer,
-				(char *)(jit_mem.buffer + jit_mem.size));
-
-	void (*func)(void) = (void (*)(void))start_addr;
-	func();
-
-	success = true;
-
-error:
-	JitBuffer_destroy(&jit_mem);
-	LambdaStack_free(&g_lambda_stack);
-	CallStack_free(&g_call_stack);
-	return success;
+	if (!JitBuffer_seal(jit))
+		return NULL;
+	return (JitRegionFn)entry_addr;
 }
@@ -1,7 +1,7 @@
 #include "jit_x86_64.h"
 #include "jit_common.h"
-#include "jit_runtime.h"
 #include "vm.h"
+#include <stddef.h>
 
 typedef enum {
 	REG_RAX = 0,
@@ -65,28 +65,31 @@ static bool jit_mov_reg_imm64(JitBuffer *jit, X86Reg reg, uint64_t imm)
 		return false;
 	return JitBuffer_push64(jit, imm);
 }
-static bool jit_add_mem8_imm8(JitBuffer *jit, X86Reg reg, uint8_t imm)
-{
-	// This helper is only ever called with RBX, which doesn't need REX.B
-	// If it were, we'd need to add REX.B prefix here.
-	if (!JitBuffer_push8(jit, 0x80))
-		return false;
-	if (!JitBuffer_push8(jit, 0x00 + (reg & 0x07)))
-		return false;
-	return JitBuffer_push8(jit, imm);
-}
-static bool jit_sub_mem8_imm8(JitBuffer *jit, X86Reg reg, uint8_t imm)
+/**
+ * @brief Pushes the ModRM byte (and disp8/disp32) for a [base + disp]
+ * operand, picking the shortest displacement form.
+ * `base` must not be RSP/R12 (those need a SIB byte); a zero displacement
+ * on RBP/R13 still needs a disp8, since mod = 00 there means RIP-relative.
+ */
+static bool jit_modrm_mem(JitBuffer *jit, uint8_t reg_field, X86Reg base,
+			  int32_t disp)
 {
-	if (!JitBuffer_push8(jit, 0x80))
-		return false;
-	if (!JitBuffer_push8(jit, 0x28 + (reg & 0x07)))
+	uint8_t regs = ((reg_field & 0x07) << 3) | (base & 0x07);
+	if (disp == 0 && (base & 0x07) != REG_RBP)
+		return JitBuffer_push8(jit, 0x00 | regs);
+	if (disp >= INT8_MIN && disp <= INT8_MAX) {
+		if (!JitBuffer_push8(jit, 0x40 | regs))
+			return false;
+		return JitBuffer_push8(jit, (uint8_t)(int8_t)disp);
+	}
+	if (!JitBuffer_push8(jit, 0x80 | regs))
 		return false;
-	return JitBuffer_push8(jit, imm);
+	return JitBuffer_push32(jit, (uint32_t)disp);
 }
 static bool jit_add_reg_imm32(JitBuffer *jit, X86Reg reg, uint32_t imm)
 {
-	// This helper is only ever called with RBX.
-	if (!jit_rex_prefix(jit, true, false, false, false))
+	// Only called with RBX and R15.
+	if (!jit_rex_prefix(jit, true, false, false, reg >= REG_R8))
 		return false; // REX.W
 	if (!JitBuffer_push8(jit, 0x81))
 		return false;
@@ -96,7 +99,7 @@ static bool jit_add_reg_imm32(JitBuffer *jit, X86Reg reg, uint32_t imm)
 }
 static bool jit_sub_reg_imm32(JitBuffer *jit, X86Reg reg, uint32_t imm)
 {
-	// This helper is only ever called with RBX.
+	// Only RAX .. RDI: no REX.B.
 	if (!jit_rex_prefix(jit, true, false, false, false))
 		return false; // REX.W
 	if (!JitBuffer_push8(jit, 0x81))
@@ -105,30 +108,196 @@ static bool jit_sub_reg_imm32(JitBuffer *jit, X86Reg reg, uint32_t imm)
 		return false;
 	return JitBuffer_push32(jit, imm);
 }
-static bool jit_mov_mem8_reg8(JitBuffer *jit, X86Reg mem_reg, X86Reg val_reg)
+static bool jit_imul_reg_imm32(JitBuffer *jit, X86Reg reg, uint32_t imm)
+{
+	// imul r32, r32, imm32. Only called with EAX. No REX prefix needed.
+	if (!JitBuffer_push8(jit, 0x69))
+		return false;
+	if (!JitBuffer_push8(jit, 0xc0 | ((reg & 0x07) << 3) | (reg & 0x07)))
+		return false;
+	return JitBuffer_push32(jit, imm);
+}
+/*
+ * Cell-sized operations. Memory forms access exactly one cell: a byte, or
+ * with an operand-size prefix a word, or a dword. Register forms work on a
+ * cell held zero-extended in a register (DL, DX or EDX for the cached cell).
+ * For wide cells they use the whole 32-bit register, which leaves the low
+ * bits the same and avoids the 0x66 prefix; only stores and tests look at
+ * the cell's own width.
+ */
+
+/* True when `imm` at the cell width fits the sign-extended imm8 of 0x83. */
+static bool jit_cell_imm8_fits(const JitBuffer *jit, uint32_t imm)
+{
+	uint32_t mask = CellWidth_mask(jit->cell);
+	imm &= mask;
+	return imm <= 0x7f || imm >= mask - 0x7f;
+}
+static bool jit_cell_imm(JitBuffer *jit, uint32_t imm, bool imm8)
+{
+	if (imm8)
+		return JitBuffer_push8(jit, (uint8_t)imm);
+	if (jit->cell == CELL_16)
+		return JitBuffer_push8(jit, (uint8_t)imm) &&
+		       JitBuffer_push8(jit, (uint8_t)(imm >> 8));
+	return JitBuffer_push32(jit, imm);
+}
+/**
+ * @brief Pushes the prefix and opcode of a cell-sized memory op: `op8` for
+ * byte cells, else `op8 + 1`, after a 0x66 prefix for 16-bit cells.
+ */
+static bool jit_cell_opcode(JitBuffer *jit, uint8_t op8)
+{
+	if (jit->cell == CELL_16 && !JitBuffer_push8(jit, 0x66))
+		return false;
+	return JitBuffer_push8(jit, jit->cell == CELL_8 ? op8 : op8 + 1);
+}
+/**
+ * @brief `<op> cell [reg + disp], imm` for the 0x80 group, /`ext` picking
+ * the operation (0 add, 5 sub, 7 cmp). Wide cells use the imm8 form when
+ * the immediate allows it.
+ */
+static bool jit_alu_memc_imm(JitBuffer *jit, uint8_t ext, X86Reg reg,
+			     int32_t disp, uint32_t imm)
+{
+	// Only called with RBX. No REX prefix needed.
+	bool imm8 = jit_cell_imm8_fits(jit, imm);
+	if (jit->cell == CELL_16 && !JitBuffer_push8(jit, 0x66))
+		return false;
+	if (!JitBuffer_push8(jit, jit->cell == CELL_8 ? 0x80 :
+				  imm8		      ? 0x83 :
+							0x81))
+		return false;
+	if (!jit_modrm_mem(jit, ext, reg, disp))
+		return false;
+	return jit_cell_imm(jit, imm, imm8 || jit->cell == CELL_8);
+}
+static bool jit_add_memc_imm(JitBuffer *jit, X86Reg reg, int32_t disp,
+			     uint32_t imm)
+{
+	return jit_alu_memc_imm(jit, 0, reg, disp, imm);
+}
+static bool jit_sub_memc_imm(JitBuffer *jit, X86Reg reg, int32_t disp,
+			     uint32_t imm)
+{
+	return jit_alu_memc_imm(jit, 5, reg, disp, imm);
+}
+static bool jit_cmp_memc_zero(JitBuffer *jit, X86Reg reg, int32_t disp)
+{
+	return jit_alu_memc_imm(jit, 7, reg, disp, 0);
+}
+static bool jit_mov_memc_imm(JitBuffer *jit, X86Reg reg, int32_t disp,
+			     uint32_t imm)
+{
+	// Only called with RBX. No REX prefix needed.
+	if (!jit_cell_opcode(jit, 0xc6))
+		return false;
+	if (!jit_modrm_mem(jit, 0, reg, disp))
+		return false;
+	return jit_cell_imm(jit, imm, jit->cell == CELL_8);
+}
+static bool jit_mov_memc_reg(JitBuffer *jit, X86Reg mem_reg, int32_t disp,
+			     X86Reg val_reg)
+{
+	// Only called with RBX and AL/DL. No REX prefix needed.
+	if (!jit_cell_opcode(jit, 0x88))
+		return false;
+	return jit_modrm_mem(jit, val_reg, mem_reg, disp);
+}
+static bool jit_add_memc_reg(JitBuffer *jit, X86Reg mem_reg, int32_t disp,
+			     X86Reg val_reg)
 {
 	// Only called with RBX and AL. No REX prefix needed.
-	if (!JitBuffer_push8(jit, 0x88))
+	if (!jit_cell_opcode(jit, 0x00))
+		return false;
+	return jit_modrm_mem(jit, val_reg, mem_reg, disp);
+}
+static bool jit_movzx_reg_memc(JitBuffer *jit, X86Reg dest_reg, X86Reg mem_reg,
+			       int32_t disp)
+{
+	// Only called with EAX/EDX (dest) and RBX (mem). No REX prefix needed.
+	// movzx r32, byte / movzx r32, word / mov r32, dword
+	if (jit->cell == CELL_32) {
+		if (!JitBuffer_push8(jit, 0x8b))
+			return false;
+	} else if (!JitBuffer_push8(jit, 0x0f) ||
+		   !JitBuffer_push8(jit, jit->cell == CELL_8 ? 0xb6 : 0xb7)) {
 		return false;
-	return JitBuffer_push8(jit, 0x00 | ((val_reg & 0x07) << 3) |
-					    (mem_reg & 0x07));
+	}
+	return jit_modrm_mem(jit, dest_reg, mem_reg, disp);
 }
-static bool jit_mov_reg8_mem8(JitBuffer *jit, X86Reg val_reg, X86Reg mem_reg)
+static bool jit_alu_regc_imm(JitBuffer *jit, uint8_t ext, X86Reg reg,
+			     uint32_t imm)
 {
-	// Only called with AL and RBX. No REX prefix needed.
-	if (!JitBuffer_push8(jit, 0x8a))
+	// Only called with DL/EDX. No REX prefix needed. A 16-bit immediate
+	// is sign-extended, so small negative steps still fit an imm8.
+	if (jit->cell == CELL_16)
+		imm = (uint32_t)(int32_t)(int16_t)imm;
+	bool imm8 = jit->cell == CELL_8 || (int32_t)imm == (int8_t)imm;
+	if (!JitBuffer_push8(jit, jit->cell == CELL_8 ? 0x80 :
+				  imm8		      ? 0x83 :
+							0x81))
+		return false;
+	if (!JitBuffer_push8(jit, 0xc0 | (ext << 3) | (reg & 0x07)))
 		return false;
-	return JitBuffer_push8(jit, 0x00 | ((val_reg & 0x07) << 3) |
-					    (mem_reg & 0x07));
+	return imm8 ? JitBuffer_push8(jit, (uint8_t)imm) :
+		      JitBuffer_push32(jit, imm);
 }
-static bool jit_test_reg8_reg8(JitBuffer *jit, X86Reg reg1, X86Reg reg2)
+static bool jit_add_regc_imm(JitBuffer *jit, X86Reg reg, uint32_t imm)
 {
-	// Only called with AL. No REX prefix needed.
-	if (!JitBuffer_push8(jit, 0x84))
+	return jit_alu_regc_imm(jit, 0, reg, imm);
+}
+static bool jit_sub_regc_imm(JitBuffer *jit, X86Reg reg, uint32_t imm)
+{
+	return jit_alu_regc_imm(jit, 5, reg, imm);
+}
+static bool jit_mov_regc_imm(JitBuffer *jit, X86Reg reg, uint32_t imm)
+{
+	// mov r8, imm8 / mov r32, imm32. Only called with DL/EDX.
+	if (jit->cell == CELL_8)
+		return JitBuffer_push8(jit, 0xb0 + (reg & 0x07)) &&
+		       JitBuffer_push8(jit, (uint8_t)imm);
+	return JitBuffer_push8(jit, 0xb8 + (reg & 0x07)) &&
+	       JitBuffer_push32(jit, imm & CellWidth_mask(jit->cell));
+}
+static bool jit_add_regc_regc(JitBuffer *jit, X86Reg dest, X86Reg src)
+{
+	// Only called with DL and AL. No REX prefix needed.
+	if (!JitBuffer_push8(jit, jit->cell == CELL_8 ? 0x00 : 0x01))
+		return false;
+	return JitBuffer_push8(jit, 0xc0 | ((src & 0x07) << 3) | (dest & 0x07));
+}
+static bool jit_mov_regc_regc(JitBuffer *jit, X86Reg dest, X86Reg src)
+{
+	// Only called with DL and AL. No REX prefix needed.
+	if (!JitBuffer_push8(jit, jit->cell == CELL_8 ? 0x88 : 0x89))
+		return false;
+	return JitBuffer_push8(jit, 0xc0 | ((src & 0x07) << 3) | (dest & 0x07));
+}
+static bool jit_test_regc_regc(JitBuffer *jit, X86Reg reg1, X86Reg reg2)
+{
+	// Only called with DL or AL. No REX prefix needed.
+	if (jit->cell == CELL_16 && !JitBuffer_push8(jit, 0x66))
+		return false;
+	if (!JitBuffer_push8(jit, jit->cell == CELL_8 ? 0x84 : 0x85))
 		return false;
 	return JitBuffer_push8(jit,
 			       0xc0 | ((reg2 & 0x07) << 3) | (reg1 & 0x07));
 }
+static bool jit_movzx_reg_regc(JitBuffer *jit, X86Reg dest, X86Reg src)
+{
+	// Only called with EAX and DL. No REX prefix needed.
+	// movzx r32, r8 / movzx r32, r16 / mov r32, r32
+	if (jit->cell == CELL_32)
+		return JitBuffer_push8(jit, 0x89) &&
+		       JitBuffer_push8(jit, 0xc0 | ((src & 0x07) << 3) |
+						    (dest & 0x07));
+	if (!JitBuffer_push8(jit, 0x0f))
+		return false;
+	if (!JitBuffer_push8(jit, jit->cell == CELL_8 ? 0xb6 : 0xb7))
+		return false;
+	return JitBuffer_push8(jit, 0xc0 | ((dest & 0x07) << 3) | (src & 0x07));
+}
 static bool jit_call_reg(JitBuffer *jit, X86Reg reg)
 {
 	bool B = (reg >= REG_R8);
@@ -139,16 +308,6 @@ static bool jit_call_reg(JitBuffer *jit, X86Reg reg)
 		return false;
 	return JitBuffer_push8(jit, 0xd0 + (reg & 0x07));
 }
-static bool jit_movsx_reg_mem8(JitBuffer *jit, X86Reg dest_reg, X86Reg mem_reg)
-{
-	// Only called with RDI/RCX (dest) and RBX (mem). No REX prefix needed.
-	if (!JitBuffer_push8(jit, 0x0f))
-		return false;
-	if (!JitBuffer_push8(jit, 0xbe))
-		return false;
-	return JitBuffer_push8(jit, 0x00 | ((dest_reg & 0x07) << 3) |
-					    (mem_reg & 0x07));
-}
 static bool jit_push_reg(JitBuffer *jit, X86Reg reg)
 {
 	bool B = (reg >= REG_R8);
@@ -176,61 +335,391 @@ static bool jit_mov_reg_reg(JitBuffer *jit, X86Reg dest, X86Reg src)
 		return false;
 	return JitBuffer_push8(jit, 0xc0 | ((src & 0x07) << 3) | (dest & 0x07));
 }
-static bool jit_ret(JitBuffer *jit)
+static bool jit_lea_reg_mem(JitBuffer *jit, X86Reg dest, X86Reg base,
+			    int32_t disp)
 {
-	return JitBuffer_push8(jit, 0xc3);
+	// lea r64, [base + disp]
+	if (!jit_rex_prefix(jit, true, dest >= REG_R8, false, base >= REG_R8))
+		return false;
+	if (!JitBuffer_push8(jit, 0x8d))
+		return false;
+	return jit_modrm_mem(jit, dest, base, disp);
 }
-static bool jit_mov_mem8_imm8(JitBuffer *jit, X86Reg reg, uint8_t imm)
+/**
+ * @brief lea dest, [rip + rel32] pointing at `target`, an address inside the
+ * buffer. Keeps code position-independent: nothing in the buffer holds an
+ * absolute address of the buffer itself.
+ */
+static bool jit_lea_reg_rip(JitBuffer *jit, X86Reg dest, uint64_t target)
 {
-	// Only called with RBX. No REX prefix needed.
-	if (!JitBuffer_push8(jit, 0xc6))
+	if (!jit_rex_prefix(jit, true, dest >= REG_R8, false, false))
+		return false;
+	if (!JitBuffer_push8(jit, 0x8d))
 		return false;
-	if (!JitBuffer_push8(jit, 0x00 + (reg & 0x07)))
+	if (!JitBuffer_push8(jit, 0x05 | ((dest & 0x07) << 3)))
 		return false;
-	return JitBuffer_push8(jit, imm);
+	int64_t rel = (int64_t)target -
+		      (int64_t)(uint64_t)(jit->buffer + jit->size + 4);
+	return JitBuffer_push32(jit, (uint32_t)(int32_t)rel);
+}
+static bool jit_mov_mem64_reg(JitBuffer *jit, X86Reg base, int32_t disp,
+			      X86Reg src)
+{
+	// mov [base + disp], r64
+	if (!jit_rex_prefix(jit, true, src >= REG_R8, false, base >= REG_R8))
+		return false;
+	if (!JitBuffer_push8(jit, 0x89))
+		return false;
+	return jit_modrm_mem(jit, src, base, disp);
+}
+static bool jit_mov_reg_mem64(JitBuffer *jit, X86Reg dest, X86Reg base,
+			      int32_t disp)
+{
+	// mov r64, [base + disp]
+	if (!jit_rex_prefix(jit, true, dest >= REG_R8, false, base >= REG_R8))
+		return false;
+	if (!JitBuffer_push8(jit, 0x8b))
+		return false;
+	return jit_modrm_mem(jit, dest, base, disp);
+}
+static bool jit_sub_reg_mem64(JitBuffer *jit, X86Reg dest, X86Reg base,
+			      int32_t disp)
+{
+	// sub r64, [base + disp]
+	if (!jit_rex_prefix(jit, true, dest >= REG_R8, false, base >= REG_R8))
+		return false;
+	if (!JitBuffer_push8(jit, 0x2b))
+		return false;
+	return jit_modrm_mem(jit, dest, base, disp);
+}
+static bool jit_cmp_reg_mem64(JitBuffer *jit, X86Reg reg, X86Reg base,
+			      int32_t disp)
+{
+	// cmp r64, [base + disp]
+	if (!jit_rex_prefix(jit, true, reg >= REG_R8, false, base >= REG_R8))
+		return false;
+	if (!JitBuffer_push8(jit, 0x3b))
+		return false;
+	return jit_modrm_mem(jit, reg, base, disp);
+}
+static bool jit_add_reg_mem64(JitBuffer *jit, X86Reg dest, X86Reg base,
+			      int32_t disp)
+{
+	// add r64, [base + disp]
+	if (!jit_rex_prefix(jit, true, dest >= REG_R8, false, base >= REG_R8))
+		return false;
+	if (!JitBuffer_push8(jit, 0x03))
+		return false;
+	return jit_modrm_mem(jit, dest, base, disp);
+}
+static bool jit_imul_reg_mem64_imm8(JitBuffer *jit, X86Reg dest, X86Reg base,
+				    int32_t disp, int8_t imm)
+{
+	// imul r64, [base + disp], imm8
+	if (!jit_rex_prefix(jit, true, dest >= REG_R8, false, base >= REG_R8))
+		return false;
+	if (!JitBuffer_push8(jit, 0x6b))
+		return false;
+	if (!jit_modrm_mem(jit, dest, base, disp))
+		return false;
+	return JitBuffer_push8(jit, (uint8_t)imm);
+}
+static bool jit_mov_mem32_imm(JitBuffer *jit, X86Reg base, int32_t disp,
+			      uint32_t imm)
+{
+	// mov dword [base + disp], imm32
+	if (!jit_rex_prefix(jit, false, false, false, base >= REG_R8))
+		return false;
+	if (!JitBuffer_push8(jit, 0xc7))
+		return false;
+	if (!jit_modrm_mem(jit, 0, base, disp))
+		return false;
+	return JitBuffer_push32(jit, imm);
+}
+static bool jit_cmp_reg_reg(JitBuffer *jit, X86Reg reg1, X86Reg reg2)
+{
+	// cmp r64, r64
+	if (!jit_rex_prefix(jit, true, reg2 >= REG_R8, false, reg1 >= REG_R8))
+		return false;
+	if (!JitBuffer_push8(jit, 0x39))
+		return false;
+	return JitBuffer_push8(jit, 0xc0 | ((reg2 & 0x07) << 3) | (reg1 & 0x07));
+}
+static bool jit_ret(JitBuffer *jit)
+{
+	return JitBuffer_push8(jit, 0xc3);
+}
+#define JUMP_TYPE_JE 0
+#define JUMP_TYPE_JNE 1
+#define JUMP_TYPE_JE8 2
+#define JUMP_TYPE_JNE8 3
+
+static bool jit_is_short_branch(const JitBuffer *jit,
+				size_t target_opcode_index)
+{
+	return jit->short_branch != NULL &&
+	       jit->short_branch[target_opcode_index - jit->opcode_base];
 }
 static bool jit_je(JitBuffer *jit, size_t target_opcode_index)
 {
+	if (jit_is_short_branch(jit, target_opcode_index)) {
+		uint8_t je8_op[] = { 0x74, 0x00 };
+		if (!JitBuffer_add_jump_patch(jit, target_opcode_index,
+					      JUMP_TYPE_JE8))
+			return false;
+		return JitBuffer_push_bytes(jit, je8_op, sizeof(je8_op));
+	}
 	uint8_t je_op[] = { 0x0f, 0x84, 0x00, 0x00, 0x00, 0x00 };
-	if (!JitBuffer_add_jump_patch(jit, target_opcode_index, 0))
+	if (!JitBuffer_add_jump_patch(jit, target_opcode_index, JUMP_TYPE_JE))
 		return false;
 	return JitBuffer_push_bytes(jit, je_op, sizeof(je_op));
 }
 static bool jit_jne(JitBuffer *jit, size_t target_opcode_index)
 {
+	if (jit_is_short_branch(jit, target_opcode_index)) {
+		uint8_t jne8_op[] = { 0x75, 0x00 };
+		if (!JitBuffer_add_jump_patch(jit, target_opcode_index,
+					      JUMP_TYPE_JNE8))
+			return false;
+		return JitBuffer_push_bytes(jit, jne8_op, sizeof(jne8_op));
+	}
 	uint8_t jne_op[] = { 0x0f, 0x85, 0x00, 0x00, 0x00, 0x00 };
-	if (!JitBuffer_add_jump_patch(jit, target_opcode_index, 1))
+	if (!JitBuffer_add_jump_patch(jit, target_opcode_index, JUMP_TYPE_JNE))
 		return false;
 	return JitBuffer_push_bytes(jit, jne_op, sizeof(jne_op));
 }
 
 /**
- * @brief x86-64 implementation of the jump patcher. (Unchanged)
+ * @brief Emits a 2-byte short jump (0x70+cc, or 0xeb for jmp) to a label
+ * inside the current op. The rel8 is filled in by jit_patch_rel8().
+ */
+static bool jit_jcc_rel8(JitBuffer *jit, uint8_t opcode, size_t *out_patch)
+{
+	*out_patch = jit->size + 1;
+	if (!JitBuffer_push8(jit, opcode))
+		return false;
+	return JitBuffer_push8(jit, 0x00);
+}
+static void jit_patch_rel8(JitBuffer *jit, size_t patch, size_t target)
+{
+	intptr_t rel = (intptr_t)target - (intptr_t)(patch + 1);
+	jit->buffer[patch] = (uint8_t)(int8_t)rel;
+}
+/**
+ * @brief jit_jcc_rel8() for labels further than a rel8 reaches: emits
+ * 0x0f 0x80+cc with a rel32 filled in by jit_patch_rel32().
+ */
+static bool jit_jcc_rel32(JitBuffer *jit, uint8_t cc, size_t *out_patch)
+{
+	if (!JitBuffer_push8(jit, 0x0f) || !JitBuffer_push8(jit, 0x80 | cc))
+		return false;
+	*out_patch = jit->size;
+	return JitBuffer_push32(jit, 0);
+}
+static void jit_patch_rel32(JitBuffer *jit, size_t patch, size_t target)
+{
+	int32_t rel = (int32_t)((intptr_t)target - (intptr_t)(patch + 4));
+	memcpy(jit->buffer + patch, &rel, sizeof(rel));
+}
+
+/**
+ * @brief Emits op_scanr/op_scanl: move RBX by `stride` cells until the cell
+ * at [rbx] is zero.
+ *
+ * When the step in bytes is a power of two up to 16, an SSE2 search runs
+ * over aligned 16-byte chunks (an aligned load never crosses into the next
+ * page). pcmpeqb/w/d compares whole cells, and pmovmskb gives a 16-bit "is
+ * zero" mask per chunk, which is ANDed with the first byte of each cell the
+ * stride can land on. Because chunks are 16-aligned and the step divides
+ * 16, that lane set is the same for every chunk, so only the first chunk
+ * needs an extra mask for the lanes behind the start. Other strides use a
+ * scalar loop.
+ *
+ * Clobbers RAX, RCX, RDX, XMM0 and XMM1.
+ */
+static bool jit_scan(JitBuffer *jit, uint32_t stride, bool right)
+{
+	size_t done_patch, found_patch, loop_patch;
+	uint32_t width = (uint32_t)CellWidth_bytes(jit->cell);
+	int32_t step;
+	if (!JitBuffer_cell_disp(jit, stride, &step))
+		return false;
+
+	if (step > 16 || (step & (step - 1)) != 0) {
+		size_t loop_start = jit->size;
+		// cmp cell [rbx], 0 ; je done
+		if (!jit_cmp_memc_zero(jit, REG_RBX, 0))
+			return false;
+		if (!jit_jcc_rel8(jit, 0x74, &done_patch))
+			return false;
+		if (right) {
+			if (!jit_add_reg_imm32(jit, REG_RBX, (uint32_t)step))
+				return false;
+		} else {
+			if (!jit_sub_reg_imm32(jit, REG_RBX, (uint32_t)step))
+				return false;
+		}
+		// jmp loop
+		if (!jit_jcc_rel8(jit, 0xeb, &loop_patch))
+			return false;
+		jit_patch_rel8(jit, loop_patch, loop_start);
+		jit_patch_rel8(jit, done_patch, jit->size);
+		return true;
+	}
+
+	// Lanes reachable from lane 0 (right) or the last cell (left)
+	uint32_t pattern = 0;
+	for (uint32_t i = 0; i < 16; i += (uint32_t)step)
+		pattern |= 1u << i;
+	if (!right)
+		pattern <<= (uint32_t)step - width;
+
+	const uint8_t shift_edx_cl = right ? 0xe2 : 0xea; // shl / shr
+	const uint8_t test_chunk[] = {
+		0x66, 0x0f, 0x6f, 0x00, // movdqa xmm0, [rax]
+		0x66, 0x0f, (uint8_t)(0x74 + jit->cell), 0xc1, // pcmpeqb/w/d
+		0x66, 0x0f, 0xd7, 0xc8, // pmovmskb ecx, xmm0
+		0x21, 0xd1, // and ecx, edx
+	};
+
+	// Fast path: already on a zero cell
+	// cmp cell [rbx], 0 ; je done
+	if (!jit_cmp_memc_zero(jit, REG_RBX, 0))
+		return false;
+	if (!jit_jcc_rel8(jit, 0x74, &done_patch))
+		return false;
+
+	// pxor xmm1, xmm1 ; mov rax, rbx ; and rax, -16 ; mov ecx, ebx
+	if (!JitBuffer_push_bytes(jit,
+				  (uint8_t[]){ 0x66, 0x0f, 0xef, 0xc9, 0x48,
+					       0x89, 0xd8, 0x48, 0x83, 0xe0,
+					       0xf0, 0x89, 0xd9 },
+				  13))
+		return false;
+	if (!right) {
+		// not ecx (left: shift by 16 - width - (p & 15))
+		if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0xf7, 0xd1 }, 2))
+			return false;
+	}
+	// and ecx, 16 - width ; mov edx, pattern ; shl/shr edx, cl
+	if (!JitBuffer_push_bytes(jit,
+				  (uint8_t[]){ 0x83, 0xe1,
+					       (uint8_t)(16 - width), 0xba },
+				  4))
+		return false;
+	if (!JitBuffer_push32(jit, pattern))
+		return false;
+	if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0xd3, shift_edx_cl }, 2))
+		return false;
+
+	// First (partial) chunk ; jnz found
+	if (!JitBuffer_push_bytes(jit, test_chunk, sizeof(test_chunk)))
+		return false;
+	if (!jit_jcc_rel8(jit, 0x75, &found_patch))
+		return false;
+
+	// Mask for all following chunks
+	if (stride == 1) {
+		// mov edx, pattern
+		if (!JitBuffer_push8(jit, 0xba))
+			return false;
+		if (!JitBuffer_push32(jit, pattern))
+			return false;
+	} else {
+		// mov ecx, ebx
+		if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0x89, 0xd9 }, 2))
+			return false;
+		if (!right) {
+			// not ecx
+			if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0xf7, 0xd1 },
+						  2))
+				return false;
+		}
+		// and ecx, step - width ; mov edx, pattern ; shl/shr edx, cl
+		if (!JitBuffer_push_bytes(jit,
+					  (uint8_t[]){ 0x83, 0xe1,
+						       (uint8_t)(step - width),
+						       0xba },
+					  4))
+			return false;
+		if (!JitBuffer_push32(jit, pattern))
+			return false;
+		if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0xd3, shift_edx_cl },
+					  2))
+			return false;
+	}
+
+	// loop: add/sub rax, 16 ; test chunk ; jz loop
+	size_t loop_start = jit->size;
+	if (!JitBuffer_push_bytes(jit,
+				  (uint8_t[]){ 0x48, 0x83, right ? 0xc0 : 0xe8,
+					       0x10 },
+				  4))
+		return false;
+	if (!JitBuffer_push_bytes(jit, test_chunk, sizeof(test_chunk)))
+		return false;
+	if (!jit_jcc_rel8(jit, 0x74, &loop_patch))
+		return false;
+	jit_patch_rel8(jit, loop_patch, loop_start);
+
+	// found: bsf/bsr ecx, ecx ; lea rbx, [rax + rcx]
+	jit_patch_rel8(jit, found_patch, jit->size);
+	if (!JitBuffer_push_bytes(jit,
+				  (uint8_t[]){ 0x0f, right ? 0xbc : 0xbd, 0xc9,
+					       0x48, 0x8d, 0x1c, 0x08 },
+				  7))
+		return false;
+
+	jit_patch_rel8(jit, done_patch, jit->size);
+	return true;
+}
+
+/**
+ * @brief x86-64 implementation of the jump patcher: points each recorded
+ * jump at the native address of its target opcode. A JE8/JNE8 patch is a
+ * 2-byte `je`/`jne rel8`, whose displacement byte follows the opcode; any
+ * other is a 6-byte `0f 8x rel32`, whose displacement starts 2 bytes in.
+ * Both are relative to the end of the instruction. A displacement out of
+ * its range is reported and the jump left unpatched.
  */
 void JitBuffer_patch_jumps(JitBuffer *jit)
 {
 	for (size_t i = 0; i < jit->jump_patch_count; ++i) {
 		JumpPatch *patch = &jit->jump_patches[i];
-		if (patch->target_opcode_index >= jit->opcode_count) {
+		if (!JitBuffer_has_opcode(jit, patch->target_opcode_index)) {
 			fprintf(stderr,
 				"Error: Invalid target opcode index %zu in jump patch.\n",
 				patch->target_opcode_index);
 			continue;
 		}
-		size_t target_buffer_offset =
-			jit->opcode_addresses[patch->target_opcode_index];
+		size_t target_buffer_offset = JitBuffer_opcode_address(
+			jit, patch->target_opcode_index);
 		size_t jump_instruction_start_offset =
 			patch->instruction_offset;
+		bool is_short = patch->jump_type == JUMP_TYPE_JE8 ||
+				patch->jump_type == JUMP_TYPE_JNE8;
 		size_t jump_instruction_end_offset =
-			jump_instruction_start_offset + 6;
+			jump_instruction_start_offset + (is_short ? 2 : 6);
 		intptr_t relative_offset_ptr =
 			(intptr_t)target_buffer_offset -
 			(intptr_t)jump_instruction_end_offset;
+		if (is_short) {
+			if (relative_offset_ptr < INT8_MIN ||
+			    relative_offset_ptr > INT8_MAX) {
+				fprintf(stderr,
+					"Error: Jump offset out of 8-bit range for patch %zu.\n",
+					i);
+				continue;
+			}
+			jit->buffer[jump_instruction_start_offset + 1] =
+				(uint8_t)(int8_t)relative_offset_ptr;
+			continue;
+		}
 		if (relative_offset_ptr < INT32_MIN ||
 		    relative_offset_ptr > INT32_MAX) {
 			fprintf(stderr,
 				"Error: Jump offset out of 32-bit range for patch %zu.\n",
-				(size_t)relative_offset_ptr);
+				i);
 			continue;
 		}
 		int32_t relative_offset = (int32_t)relative_offset_ptr;
@@ -247,17 +736,467 @@ void JitBuffer_patch_jumps(JitBuffer *jit)
 	}
 }
 
+/**
+ * @brief Appends AL to the VM's output inline: store at `pos`, bump it, and
+ * call OutputBuffer_flush() only once `pos` reaches `limit` (or, under
+ * FLUSH_LINE, after a '\n'). The policy is read at run time, so the code
+ * does not depend on how the VM was set up.
+ *
+ * Clobbers RAX, RCX and R11, plus the caller-saved registers on the flush
+ * path. RDX is preserved so a cached cell survives.
+ */
+static bool jit_out(JitBuffer *jit)
+{
+	_Static_assert(offsetof(OutputBuffer, pos) == 0 &&
+			       offsetof(OutputBuffer, limit) == 8 &&
+			       offsetof(OutputBuffer, policy) <= INT8_MAX,
+		       "jit_out addresses pos, limit and policy directly");
+	size_t flush_patch, done_patch, policy_patch;
+
+	// lea rcx, [r13 + out]
+	if (!jit_lea_reg_mem(jit, REG_RCX, REG_R13, offsetof(BfVm, out)))
+		return false;
+	// mov r11, [rcx] ; mov [r11], al ; inc r11 ; mov [rcx], r11
+	if (!JitBuffer_push_bytes(jit,
+				  (uint8_t[]){ 0x4c, 0x8b, 0x19, 0x41, 0x88,
+					       0x03, 0x49, 0xff, 0xc3, 0x4c,
+					       0x89, 0x19 },
+				  12))
+		return false;
+	// cmp r11, [rcx + 8]
+	if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0x4c, 0x3b, 0x59, 0x08 },
+				  4))
+		return false;
+	if (!jit_jcc_rel8(jit, 0x73, &flush_patch)) // jae flush
+		return false;
+	// cmp al, '\n'
+	if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0x3c, 0x0a }, 2))
+		return false;
+	if (!jit_jcc_rel8(jit, 0x75, &done_patch)) // jne done
+		return false;
+	// cmp dword [rcx + policy], FLUSH_LINE
+	if (!JitBuffer_push_bytes(jit,
+				  (uint8_t[]){ 0x83, 0x79,
+					       offsetof(OutputBuffer, policy),
+					       FLUSH_LINE },
+				  4))
+		return false;
+	if (!jit_jcc_rel8(jit, 0x75, &policy_patch)) // jne done
+		return false;
+	jit_patch_rel8(jit, flush_patch, jit->size);
+
+	// flush: two pushes keep the stack 16-byte aligned for the call
+	if (!jit_push_reg(jit, REG_RDX) || !jit_push_reg(jit, REG_RDX))
+		return false;
+#ifndef _WIN32
+	if (!jit_mov_reg_reg(jit, REG_RDI, REG_RCX))
+		return false;
+#endif
+	if (!jit_mov_reg_imm64(jit, REG_RAX, (uint64_t)OutputBuffer_flush))
+		return false;
+	if (!jit_call_reg(jit, REG_RAX))
+		return false;
+	if (!jit_pop_reg(jit, REG_RDX) || !jit_pop_reg(jit, REG_RDX))
+		return false;
+	jit_patch_rel8(jit, done_patch, jit->size);
+	jit_patch_rel8(jit, policy_patch, jit->size);
+	return true;
+}
+
+/**
+ * @brief Runs ',' inline: load the byte at the VM's input `pos` and bump it,
+ * calling InputBuffer_read_slow() only once the mapped file or read-ahead
+ * buffer runs out. The byte goes to DL when `to_dl`, else to the cell at
+ * [rbx + disp], zero-extended to its width. At end of input the slow path
+ * applies the --eof policy; BF_IN_KEEP_CELL skips the store, so DL must
+ * already hold the cell when `to_dl`.
+ *
+ * Clobbers RAX, RCX and R11, plus the caller-saved registers on the slow
+ * path. RDX is preserved so a cached cell survives.
+ */
+static bool jit_in(JitBuffer *jit, bool to_dl, int32_t disp)
+{
+	_Static_assert(offsetof(InputBuffer, pos) == 0 &&
+			       offsetof(InputBuffer, end) == 8,
+		       "jit_in addresses pos and end directly");
+	size_t slow_patch, store_patch, done_patch;
+
+	// lea rcx, [r13 + in]
+	if (!jit_lea_reg_mem(jit, REG_RCX, REG_R13, offsetof(BfVm, in)))
+		return false;
+	// mov r11, [rcx] ; cmp r11, [rcx + 8]
+	if (!JitBuffer_push_bytes(jit,
+				  (uint8_t[]){ 0x4c, 0x8b, 0x19, 0x4c, 0x3b,
+					       0x59, 0x08 },
+				  7))
+		return false;
+	if (!jit_jcc_rel8(jit, 0x73, &slow_patch)) // jae slow
+		return false;
+	// movzx eax, byte [r11] ; inc r11 ; mov [rcx], r11
+	if (!JitBuffer_push_bytes(jit,
+				  (uint8_t[]){ 0x41, 0x0f, 0xb6, 0x03, 0x49,
+					       0xff, 0xc3, 0x4c, 0x89, 0x19 },
+				  10))
+		return false;
+	if (!jit_jcc_rel8(jit, 0xeb, &store_patch)) // jmp store
+		return false;
+
+	// slow: two pushes keep the stack 16-byte aligned for the call
+	jit_patch_rel8(jit, slow_patch, jit->size);
+	if (!jit_push_reg(jit, REG_RDX) || !jit_push_reg(jit, REG_RDX))
+		return false;
+#ifndef _WIN32
+	if (!jit_mov_reg_reg(jit, REG_RDI, REG_RCX))
+		return false;
+#endif
+	if (!jit_mov_reg_imm64(jit, REG_RAX, (uint64_t)InputBuffer_read_slow))
+		return false;
+	if (!jit_call_reg(jit, REG_RAX))
+		return false;
+	if (!jit_pop_reg(jit, REG_RDX) || !jit_pop_reg(jit, REG_RDX))
+		return false;
+	// cmp eax, BF_IN_KEEP_CELL ; je done
+	if (!JitBuffer_push8(jit, 0x3d) ||
+	    !JitBuffer_push32(jit, (uint32_t)BF_IN_KEEP_CELL))
+		return false;
+	if (!jit_jcc_rel8(jit, 0x74, &done_patch))
+		return false;
+
+	// store:
+	jit_patch_rel8(jit, store_patch, jit->size);
+	if (to_dl) {
+		if (!jit_mov_regc_regc(jit, REG_RDX, REG_RAX))
+			return false;
+	} else if (!jit_mov_memc_reg(jit, REG_RBX, disp, REG_RAX)) {
+		return false;
+	}
+	jit_patch_rel8(jit, done_patch, jit->size);
+	return true;
+}
+
+/**
+ * @brief Tracks the current cell [rbx] while it is held in DL, or DX or
+ * EDX for wide cells.
+ *
+ * Within a basic block, ops on offset 0 work on DL instead of memory. The
+ * value is written back only when the pointer moves, before I/O and calls,
+ * at loop edges and at the end of the function. Loop edges leave DL clean
+ * and holding [rbx] on every path, so both jump targets (jf + 1 and
+ * jt + 1) start with the cell already cached.
+ */
+typedef struct {
+	bool cached; // DL holds [rbx]
+	bool dirty; // DL has not been written back yet
+} CellCache;
+
+static bool cell_flush(JitBuffer *jit, CellCache *cell)
+{
+	if (!cell->dirty)
+		return true;
+	cell->dirty = false;
+	return jit_mov_memc_reg(jit, REG_RBX, 0, REG_RDX);
+}
+static bool cell_load(JitBuffer *jit, CellCache *cell)
+{
+	if (cell->cached)
+		return true;
+	cell->cached = true;
+	return jit_movzx_reg_memc(jit, REG_RDX, REG_RBX, 0);
+}
+static bool cell_drop(JitBuffer *jit, CellCache *cell)
+{
+	if (!cell_flush(jit, cell))
+		return false;
+	cell->cached = false;
+	return true;
+}
+
+/**
+ * @brief Opens a run of op_mul that share p[src], whose value is
+ * zero-extended in EAX.
+ *
+ * The interpreter skips a mul when p[src] is zero, and p[offset] may then
+ * lie in a guard region. Branching on the value mispredicts on real
+ * programs, so the run's targets are checked against the tape instead,
+ * which a given site almost always passes or always fails: in bounds the
+ * adds run unconditionally; out of bounds they are skipped when p[src] is
+ * zero and otherwise fault like the interpreter's.
+ *
+ * No guard is needed when `reach` shows the targets are on the tape.
+ * Sets *out_end to the op after the run, and *out_skip to the rel32 that
+ * jit_patch_rel32() points there, or to 0 when the run needs no guard.
+ * Clobbers RCX and RSI.
+ */
+static bool jit_mul_run_guard(JitBuffer *jit, const OpcodeVector *code,
+			      size_t pc, size_t end_pc, bool dl_cached,
+			      const JitTapeReach *reach, size_t *out_end,
+			      size_t *out_skip)
+{
+	int32_t src = code->data[pc].src;
+	int64_t lo = INT64_MAX, hi = INT64_MIN;
+	size_t end = pc;
+	for (; end < end_pc; ++end) {
+		const opcode *op = &code->data[end];
+		if (op->op != op_mul || op->src != src || op->offset == src)
+			break;
+		if (op->offset == 0 && dl_cached)
+			continue; // adds to DL
+		lo = op->offset < lo ? op->offset : lo;
+		hi = op->offset > hi ? op->offset : hi;
+	}
+	*out_end = end;
+	*out_skip = 0;
+	if (lo > hi || JitTapeReach_covers(reach, lo, hi))
+		return true;
+
+	// Bytes from the first target cell to the last byte of the last one
+	int64_t width = (int64_t)CellWidth_bytes(jit->cell);
+	int64_t span = (hi - lo) * width + width - 1;
+	int32_t lo_disp;
+	if (!JitBuffer_cell_disp(jit, lo, &lo_disp))
+		return false;
+	size_t body_patch = 0;
+	if (span < (int64_t)BF_TAPE_MIN_SIZE) {
+		// p + lo .. p + hi all on the tape: (p + lo - tape) unsigned
+		// below tape_size - span
+		if (!jit_lea_reg_mem(jit, REG_RCX, REG_RBX, lo_disp) ||
+		    !jit_sub_reg_mem64(jit, REG_RCX, REG_R13,
+				       offsetof(BfVm, tape)) ||
+		    !jit_mov_reg_mem64(jit, REG_RSI, REG_R13,
+				       offsetof(BfVm, tape_size)) ||
+		    !jit_sub_reg_imm32(jit, REG_RSI, (uint32_t)span) ||
+		    !jit_cmp_reg_reg(jit, REG_RCX, REG_RSI) ||
+		    !jit_jcc_rel8(jit, 0x72, &body_patch)) // jb body
+			return false;
+	}
+	if (!jit_test_regc_regc(jit, REG_RAX, REG_RAX) ||
+	    !jit_jcc_rel32(jit, 0x04, out_skip)) // jz past the run
+		return false;
+	if (body_patch)
+		jit_patch_rel8(jit, body_patch, jit->size);
+	return true;
+}
+
+/*
+ * Lambdas have no prologue of their own: they run on the registers of the
+ * region that defined them. RBX is the data pointer, R13 the BfVm, R14 the
+ * fuel slice, R15 the next free entry of the lambda stack and R12 the
+ * lowest RSP a call may push a frame below. The region's frame keeps the
+ * end of the lambda stack at JIT_LAMBDA_END, as RBP stays the region's.
+ * A call frame is the caller's RBX and the return address, BF_JIT_FRAME
+ * bytes, so RSP is 16-byte aligned in every body.
+ */
+#define JIT_LAMBDA_END (-48)
+_Static_assert(BF_JIT_FRAME == 16, "a call pushes RBX and a return address");
+_Static_assert(sizeof(Lambda) <= INT8_MAX &&
+		       offsetof(Lambda, captured_p) < sizeof(Lambda) &&
+		       offsetof(Lambda, jit_addr) < sizeof(Lambda),
+	       "lambda stack entries are addressed with a disp8");
+
+static bool jit_prologue(JitBuffer *jit)
+{
+	if (!jit_push_reg(jit, REG_RBP))
+		return false;
+	if (!jit_mov_reg_reg(jit, REG_RBP, REG_RSP))
+		return false;
+	if (!jit_push_reg(jit, REG_RBX) || !jit_push_reg(jit, REG_R12) ||
+	    !jit_push_reg(jit, REG_R13) || !jit_push_reg(jit, REG_R14) ||
+	    !jit_push_reg(jit, REG_R15))
+		return false;
+	// sub rsp, 8: the JIT_LAMBDA_END slot
+	return JitBuffer_push_bytes(jit, (uint8_t[]){ 0x48, 0x83, 0xec, 0x08 },
+				    4);
+}
+static bool jit_epilogue(JitBuffer *jit)
+{
+	// add rsp, 8
+	if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0x48, 0x83, 0xc4, 0x08 },
+				  4))
+		return false;
+	if (!jit_pop_reg(jit, REG_R15) || !jit_pop_reg(jit, REG_R14) ||
+	    !jit_pop_reg(jit, REG_R13) || !jit_pop_reg(jit, REG_R12) ||
+	    !jit_pop_reg(jit, REG_RBX) || !jit_pop_reg(jit, REG_RBP))
+		return false;
+	return jit_ret(jit);
+}
+
+/**
+ * @brief Loads the lambda registers on region entry, after the BfVm is in
+ * R13 and its stack pointer in jit_exit_sp.
+ */
+static bool jit_lambda_setup(JitBuffer *jit)
+{
+	int32_t stack = (int32_t)offsetof(BfVm, lambda_stack);
+	int32_t data = stack + (int32_t)offsetof(LambdaStack, data);
+	// lea r12, [rsp - BF_CALL_DEPTH * BF_JIT_FRAME]
+	if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0x4c, 0x8d, 0xa4, 0x24 },
+				  4) ||
+	    !JitBuffer_push32(jit, (uint32_t)-(int32_t)(BF_CALL_DEPTH *
+							BF_JIT_FRAME)))
+		return false;
+	// Not below the thread's stack: mov rax, [r13 + jit_stack_floor] ;
+	// cmp r12, rax ; cmovb r12, rax
+	if (!jit_mov_reg_mem64(jit, REG_RAX, REG_R13,
+			       offsetof(BfVm, jit_stack_floor)) ||
+	    !JitBuffer_push_bytes(
+		    jit, (uint8_t[]){ 0x49, 0x39, 0xc4, 0x4c, 0x0f, 0x42, 0xe0 },
+		    7))
+		return false;
+	// r15 = data + size * sizeof(Lambda)
+	if (!jit_imul_reg_mem64_imm8(
+		    jit, REG_R15, REG_R13,
+		    stack + (int32_t)offsetof(LambdaStack, size),
+		    (int8_t)sizeof(Lambda)) ||
+	    !jit_add_reg_mem64(jit, REG_R15, REG_R13, data))
+		return false;
+	// [rbp + JIT_LAMBDA_END] = data + capacity * sizeof(Lambda)
+	if (!jit_imul_reg_mem64_imm8(
+		    jit, REG_RAX, REG_R13,
+		    stack + (int32_t)offsetof(LambdaStack, capacity),
+		    (int8_t)sizeof(Lambda)) ||
+	    !jit_add_reg_mem64(jit, REG_RAX, REG_R13, data))
+		return false;
+	return jit_mov_mem64_reg(jit, REG_RBP, JIT_LAMBDA_END, REG_RAX);
+}
+
+/*
+ * Fuel: R14 holds the rest of the VM's fuel slice while a region runs.
+ * Every back-edge and lambda entry costs one `dec r14` and a not-taken
+ * `js` to a per-site stub emitted after the function. The stub calls the
+ * shared trap routine and jumps back.
+ */
+_Static_assert(offsetof(BfVm, fuel_slice) == 0 &&
+		       offsetof(BfVm, jit_exit_sp) == 8,
+	       "JIT code addresses the fuel fields directly");
+_Static_assert(sizeof(VmStatus) == 4, "stops store vm->status as a dword");
+
+static bool jit_fuel_check(JitBuffer *jit)
+{
+	// dec r14 ; js <stub>
+	if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0x49, 0xff, 0xce }, 3))
+		return false;
+	if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0x0f, 0x88 }, 2))
+		return false;
+	if (!JitBuffer_add_fuel_site(jit, jit->size))
+		return false;
+	return JitBuffer_push32(jit, 0);
+}
+
+/**
+ * @brief Emits the stubs for the fuel checks pushed since `first_site`:
+ * `call <trap routine> ; jmp <after the check>`.
+ */
+static bool jit_fuel_stubs(JitBuffer *jit, size_t first_site)
+{
+	for (size_t i = first_site; i < jit->fuel_site_count; ++i) {
+		size_t site = jit->fuel_sites[i];
+		int32_t rel = (int32_t)(jit->size - (site + 4));
+		memcpy(jit->buffer + site, &rel, sizeof(rel));
+
+		if (!JitBuffer_push8(jit, 0xe8))
+			return false;
+		if (!JitBuffer_push32(jit, (uint32_t)(int32_t)(jit->fuel_trap -
+							      (jit->size + 4))))
+			return false;
+		if (!JitBuffer_push8(jit, 0xe9))
+			return false;
+		if (!JitBuffer_push32(jit, (uint32_t)(int32_t)(site + 4 -
+							      (jit->size + 4))))
+			return false;
+	}
+	jit->fuel_site_count = first_site;
+	return true;
+}
+
+/**
+ * @brief Emits the routine fuel stubs call. It hands R14 back to the VM
+ * and asks vm_fuel_trap() whether to go on: if so it reloads the refilled
+ * slice and returns; if not it unwinds straight out of the region,
+ * however many lambda frames deep, from the stack pointer the region
+ * saved on entry. Preserves RDX, which may hold a cached cell. Ahead of
+ * the unwinding tail sit the stops lambda ops jump to when a stack check
+ * fails (see jit_jcc_stop()).
+ */
+static bool jit_fuel_trap_routine(JitBuffer *jit)
+{
+	jit->fuel_trap = jit->size;
+	if (!jit_mov_mem64_reg(jit, REG_R13, offsetof(BfVm, fuel_slice),
+			       REG_R14))
+		return false;
+	if (!jit_push_reg(jit, REG_RDX))
+		return false;
+	if (!jit_mov_reg_reg(jit, REG_RDI, REG_R13))
+		return false;
+	if (!jit_mov_reg_imm64(jit, REG_RAX, (uint64_t)vm_fuel_trap))
+		return false;
+	if (!jit_call_reg(jit, REG_RAX))
+		return false;
+	if (!jit_pop_reg(jit, REG_RDX))
+		return false;
+	if (!jit_mov_reg_mem64(jit, REG_R14, REG_R13,
+			       offsetof(BfVm, fuel_slice)))
+		return false;
+	// test al, al
+	if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0x84, 0xc0 }, 2))
+		return false;
+	size_t stop;
+	if (!jit_jcc_rel8(jit, 0x75, &stop)) // jnz
+		return false;
+	if (!jit_ret(jit))
+		return false;
+
+	size_t overflow_stop;
+	jit->stack_overflow = jit->size;
+	if (!jit_mov_mem32_imm(jit, REG_R13, offsetof(BfVm, status),
+			       VM_STACK_OVERFLOW) ||
+	    !jit_jcc_rel8(jit, 0xeb, &overflow_stop)) // jmp
+		return false;
+	jit->no_lambda = jit->size;
+	if (!jit_mov_mem32_imm(jit, REG_R13, offsetof(BfVm, status),
+			       VM_NO_LAMBDA))
+		return false;
+
+	jit_patch_rel8(jit, stop, jit->size);
+	jit_patch_rel8(jit, overflow_stop, jit->size);
+	if (!jit_mov_reg_mem64(jit, REG_RSP, REG_R13,
+			       offsetof(BfVm, jit_exit_sp)))
+		return false;
+	if (!jit_mov_reg_reg(jit, REG_RAX, REG_RBX))
+		return false;
+	return jit_epilogue(jit);
+}
+
+/**
+ * @brief Emits `jcc` (0x80 + cc) to `stop`, jit->stack_overflow or
+ * jit->no_lambda.
+ */
+static bool jit_jcc_stop(JitBuffer *jit, uint8_t cc, size_t stop)
+{
+	if (!JitBuffer_push8(jit, 0x0f) || !JitBuffer_push8(jit, 0x80 | cc))
+		return false;
+	return JitBuffer_push32(jit,
+				(uint32_t)(int32_t)(stop - (jit->size + 4)));
+}
+
 /**
  * @brief Recursively compiles a function (or main body).
  * @param jit The JIT buffer.
  * @param code The full opcode vector.
  * @param start_pc The opcode index to start compiling.
  * @param end_pc The opcode index to stop compiling (exclusive).
+ * @param as_region Emit a JitRegionFn: take the data pointer in RDI and the
+ * BfVm in RSI and return the final data pointer in RAX, rather than a
+ * lambda that shares the region's registers (see jit_prologue()).
  * @return The 64-bit memory address of the start of the compiled function.
  */
 static uint64_t jit_compile_function(JitBuffer *jit, const OpcodeVector *code,
-				     size_t start_pc, size_t end_pc)
+				     size_t start_pc, size_t end_pc,
+				     bool as_region)
 {
+	// A region's fuel stubs call a trap routine placed just ahead of it
+	if (as_region && !jit_fuel_trap_routine(jit))
+		return 0;
+
 	// Align to 16-bytes for function entry
 	size_t alignment = 16 - (jit->size % 16);
 	if (alignment != 16) {
@@ -269,270 +1208,377 @@ static uint64_t jit_compile_function(JitBuffer *jit, const OpcodeVector *code,
 
 	uint64_t function_start_addr = (uint64_t)(jit->buffer + jit->size);
 	size_t pc = start_pc;
+	size_t first_fuel_site = jit->fuel_site_count;
+	CellCache cell = { false, false };
+	size_t mul_end = 0, mul_skip = 0; // see jit_mul_run_guard()
+	JitTapeReach reach = { false, 0, 0 };
 
-	if (!jit_push_reg(jit, REG_RBP))
-		return 0;
-	if (!jit_mov_reg_reg(jit, REG_RBP, REG_RSP))
+	if (as_region) {
+		if (!jit_prologue(jit))
+			return 0;
+		if (!jit_mov_reg_reg(jit, REG_RBX, REG_RDI) ||
+		    !jit_mov_reg_reg(jit, REG_R13, REG_RSI))
+			return 0;
+		if (!jit_mov_reg_mem64(jit, REG_R14, REG_R13,
+				       offsetof(BfVm, fuel_slice)))
+			return 0;
+		// mov [r13 + jit_exit_sp], rsp
+		if (!jit_mov_mem64_reg(jit, REG_R13,
+				       offsetof(BfVm, jit_exit_sp), REG_RSP))
+			return 0;
+		if (!jit_lambda_setup(jit))
+			return 0;
+	} else if (!jit_fuel_check(jit)) { // lambda entry
 		return 0;
-	// Save callee-saved registers (RBX is our data pointer)
-	if (!jit_push_reg(jit, REG_RBX))
-		return 0;
-	if (!jit_push_reg(jit, REG_R12))
-		return 0; // Use R12 for return PC
-	// other saved registers if needed
+	}
 
 	while (pc < end_pc) {
 		const opcode *op = &code->data[pc];
+		if (mul_skip && pc == mul_end) {
+			jit_patch_rel32(jit, mul_skip, jit->size);
+			mul_skip = 0;
+		}
 		JitBuffer_record_opcode_address(jit, pc);
+		int32_t disp, src_disp; // op->offset and op->src in bytes
+		if (!JitBuffer_cell_disp(jit, op->offset, &disp) ||
+		    !JitBuffer_cell_disp(jit, op->src, &src_disp))
+			return 0;
 
 		switch (op->op) {
 		case op_add:
-			if (!jit_add_mem8_imm8(jit, REG_RBX,
-					       (uint8_t)(op->num & 0xff)))
+			if (op->offset == 0) {
+				if (!cell_load(jit, &cell))
+					return 0;
+				if (!jit_add_regc_imm(jit, REG_RDX, op->num))
+					return 0;
+				cell.dirty = true;
+				break;
+			}
+			if (!jit_add_memc_imm(jit, REG_RBX, disp, op->num))
 				return 0;
 			break;
 		case op_sub:
-			if (!jit_sub_mem8_imm8(jit, REG_RBX,
-					       (uint8_t)(op->num & 0xff)))
+			if (op->offset == 0) {
+				if (!cell_load(jit, &cell))
+					return 0;
+				if (!jit_sub_regc_imm(jit, REG_RDX, op->num))
+					return 0;
+				cell.dirty = true;
+				break;
+			}
+			if (!jit_sub_memc_imm(jit, REG_RBX, disp, op->num))
 				return 0;
 			break;
 		case op_addp:
-			if (!jit_add_reg_imm32(jit, REG_RBX, op->num))
+		case op_subp: {
+			int32_t step;
+			if (!cell_drop(jit, &cell) ||
+			    !JitBuffer_cell_disp(jit, op->num, &step))
 				return 0;
-			break;
-		case op_subp:
-			if (!jit_sub_reg_imm32(jit, REG_RBX, op->num))
+			if (op->op == op_addp) {
+				if (!jit_add_reg_imm32(jit, REG_RBX, (uint32_t)step))
+					return 0;
+			} else if (!jit_sub_reg_imm32(jit, REG_RBX,
+						      (uint32_t)step)) {
 				return 0;
+			}
 			break;
+		}
 		case op_jt:
-			if (!jit_mov_reg8_mem8(jit, REG_AL, REG_RBX))
+			// Taken back-edges skip the matching jf's re-test and
+			// resume at the first op of the body.
+			if (!cell_flush(jit, &cell))
+				return 0;
+			if (!jit_fuel_check(jit))
 				return 0;
-			if (!jit_test_reg8_reg8(jit, REG_AL, REG_AL))
+			if (!cell_load(jit, &cell))
 				return 0;
-			if (!jit_jne(jit, op->num))
+			if (!jit_test_regc_regc(jit, REG_RDX, REG_RDX))
+				return 0;
+			if (!jit_jne(jit, op->num + 1))
 				return 0;
 			break;
 		case op_jf:
-			if (!jit_mov_reg8_mem8(jit, REG_AL, REG_RBX))
+			if (!cell_flush(jit, &cell))
+				return 0;
+			if (!cell_load(jit, &cell))
 				return 0;
-			if (!jit_test_reg8_reg8(jit, REG_AL, REG_AL))
+			if (!jit_test_regc_regc(jit, REG_RDX, REG_RDX))
 				return 0;
 			if (!jit_je(jit, op->num))
 				return 0;
 			break;
 		case op_in:
-			if (!jit_mov_reg_imm64(jit, REG_RAX,
-					       (uint64_t)(int (*)(void))getchar))
-				return 0;
-			if (!jit_call_reg(jit, REG_RAX))
+			if (op->offset != 0) {
+				if (!jit_in(jit, false, disp))
+					return 0;
+				break;
+			}
+			// Read straight into DL. EOF_UNCHANGED skips the store,
+			// so DL has to hold the old value first.
+			if (!cell_load(jit, &cell))
 				return 0;
-			if (!jit_mov_mem8_reg8(jit, REG_RBX, REG_AL))
+			if (!jit_in(jit, true, 0))
 				return 0;
+			cell.cached = true;
+			cell.dirty = true;
 			break;
 		case op_out:
-			if (!jit_mov_reg_imm64(jit, REG_RAX,
-					       (uint64_t)(int (*)(int))putchar))
+			// The cached cell stays valid: jit_out preserves RDX and
+			// the flush does not touch the tape.
+			if (op->offset == 0 && cell.cached) {
+				if (!jit_movzx_reg_regc(jit, REG_RAX, REG_RDX))
+					return 0;
+			} else if (!jit_movzx_reg_memc(jit, REG_RAX, REG_RBX,
+						       disp)) {
 				return 0;
-#ifndef _WIN32
-			if (!jit_movsx_reg_mem8(jit, REG_RDI, REG_RBX))
+			}
+			if (!jit_out(jit))
 				return 0;
-#else
-			if (!jit_movsx_reg_mem8(jit, REG_RCX, REG_RBX))
+			break;
+		case op_clear:
+			if (op->offset == 0) {
+				if (!jit_mov_regc_imm(jit, REG_RDX, 0))
+					return 0;
+				cell.cached = true;
+				cell.dirty = true;
+				break;
+			}
+			if (!jit_mov_memc_imm(jit, REG_RBX, disp, 0))
 				return 0;
-#endif
-			if (!jit_call_reg(jit, REG_RAX))
+			break;
+		case op_set:
+			if (op->offset == 0) {
+				if (!jit_mov_regc_imm(jit, REG_RDX, op->num))
+					return 0;
+				cell.cached = true;
+				cell.dirty = true;
+				break;
+			}
+			if (!jit_mov_memc_imm(jit, REG_RBX, disp, op->num))
 				return 0;
 			break;
-		case op_clear:
-			if (!jit_mov_mem8_imm8(jit, REG_RBX, 0))
+		case op_scanr:
+			if (!cell_drop(jit, &cell))
+				return 0;
+			if (!jit_scan(jit, op->num, true))
+				return 0;
+			break;
+		case op_scanl:
+			if (!cell_drop(jit, &cell))
+				return 0;
+			if (!jit_scan(jit, op->num, false))
+				return 0;
+			break;
+		case op_mul:
+			// p[offset] += p[src] * num, guarded per run of muls by
+			// jit_mul_run_guard()
+			if (op->src == 0 && cell.cached) {
+				if (!jit_movzx_reg_regc(jit, REG_RAX, REG_RDX))
+					return 0;
+			} else if (!jit_movzx_reg_memc(jit, REG_RAX, REG_RBX,
+						       src_disp)) {
+				return 0;
+			}
+			if (pc >= mul_end &&
+			    !jit_mul_run_guard(jit, code, pc, end_pc,
+					       cell.cached, &reach, &mul_end,
+					       &mul_skip))
+				return 0;
+			if (op->num != 1) {
+				if (!jit_imul_reg_imm32(jit, REG_RAX, op->num))
+					return 0;
+			}
+			if (op->offset == 0 && cell.cached) {
+				if (!jit_add_regc_regc(jit, REG_RDX, REG_RAX))
+					return 0;
+				cell.dirty = true;
+				break;
+			}
+			if (!jit_add_memc_reg(jit, REG_RBX, disp, REG_RAX))
 				return 0;
 			break;
 
 		case op_def_lambda: {
-			// recursively compile the lambda body
+			if (!cell_drop(jit, &cell))
+				return 0;
+			// recursively compile the lambda body in line, behind a
+			// jmp that skips it
+			if (!JitBuffer_push8(jit, 0xe9))
+				return 0;
+			size_t skip_body = jit->size;
+			if (!JitBuffer_push32(jit, 0))
+				return 0;
 			uint64_t lambda_addr = jit_compile_function(
-				jit, code, pc + 1, op->num);
+				jit, code, pc + 1, op->num, false);
 			if (lambda_addr == 0)
 				return 0; // compilation failed
+			jit_patch_rel32(jit, skip_body, jit->size);
 
-			// Emit code to call the runtime helper to push the closure
-			// void jit_runtime_push_lambda(uint64_t jit_addr, uint32_t captured_p);
-			// RDI = jit_addr, RSI = captured_p (RBX)
-			if (!jit_mov_reg_imm64(jit, REG_RDI, lambda_addr))
-				return 0;
-			if (!jit_mov_reg_reg(jit, REG_RSI, REG_RBX))
-				return 0; // captured_p
-			if (!jit_mov_reg_imm64(
-				    jit, REG_RAX,
-				    (uint64_t)jit_runtime_push_lambda))
+			// Push {captured_p = RBX, jit_addr} unless the stack is
+			// full:
+			// cmp r15, [rbp + JIT_LAMBDA_END] ; jae <overflow>
+			if (!jit_cmp_reg_mem64(jit, REG_R15, REG_RBP,
+					       JIT_LAMBDA_END) ||
+			    !jit_jcc_stop(jit, 0x03, jit->stack_overflow))
 				return 0;
-			if (!jit_call_reg(jit, REG_RAX))
+			if (!jit_lea_reg_rip(jit, REG_RAX, lambda_addr) ||
+			    !jit_mov_mem64_reg(jit, REG_R15,
+					       offsetof(Lambda, captured_p),
+					       REG_RBX) ||
+			    !jit_mov_mem64_reg(jit, REG_R15,
+					       offsetof(Lambda, jit_addr),
+					       REG_RAX) ||
+			    !jit_add_reg_imm32(jit, REG_R15, sizeof(Lambda)))
 				return 0;
 
 			// Skip this function's body in the current compilation
 			pc = op->num;
+			reach.known = false;
 			continue; // Continue to next opcode after the lambda body
 		}
 
 		case op_ret:
-			// Emit function epilogue and return
-			if (!jit_pop_reg(jit, REG_R12))
-				return 0;
-			if (!jit_pop_reg(jit, REG_RBX))
-				return 0;
-			if (!jit_pop_reg(jit, REG_RBP))
+			if (!cell_drop(jit, &cell))
 				return 0;
 			if (!jit_ret(jit))
 				return 0;
 			break;
 
 		case op_call: {
-			// Get the address after this call instruction group
-			// mov r12, [rip + 0] ; 4c 8b 25 00 00 00 00 (REX.W + REX.R)
-			if (!JitBuffer_push_bytes(jit,
-						  (uint8_t[]){ 0x4c, 0x8b, 0x25,
-							       0x00, 0x00, 0x00,
-							       0x00 },
-						  7))
-				return 0;
-			size_t ret_addr_patch_loc = jit->size;
-			if (!JitBuffer_push64(jit, 0))
-				return 0; // Placeholder address
-
-			// Call pre_call runtime helper
-			// Lambda jit_runtime_pre_call(uint32_t current_p, uint64_t return_pc);
-			// RDI = current_p (RBX), RSI = return_pc (R12)
-			if (!jit_mov_reg_reg(jit, REG_RDI, REG_RBX))
-				return 0;
-			if (!jit_mov_reg_reg(jit, REG_RSI, REG_R12))
-				return 0;
-			if (!jit_mov_reg_imm64(jit, REG_RAX,
-					       (uint64_t)jit_runtime_pre_call))
-				return 0;
-			if (!jit_call_reg(jit, REG_RAX))
-				return 0;
-			// Lambda struct is returned in RAX (jit_addr) and RDX (captured_p)
-
-			// Set up and make the call
-			if (!jit_mov_reg_reg(jit, REG_RBX, REG_RDX))
-				return 0; // Set new data ptr
-			if (!jit_call_reg(jit, REG_RAX))
-				return 0; // Call the lambda
-
-			// Call post_ret runtime helper
-			// uint32_t jit_runtime_post_ret(uint64_t* out_return_pc);
-			// RDI = &return_pc (stack) -> Not needed, return PC is implicit
-			if (!jit_rex_prefix(jit, true, false, false, false))
-				return 0;
-			if (!JitBuffer_push_bytes(
-				    jit, (uint8_t[]){ 0x83, 0xec, 0x08 }, 3))
+			if (!cell_drop(jit, &cell))
 				return 0;
-			// mov rdi, rsp
-			if (!jit_mov_reg_reg(jit, REG_RDI, REG_RSP))
+			int32_t top = -(int32_t)sizeof(Lambda);
+			// cmp r15, [r13 + lambda_stack.data] ; je <no lambda>
+			if (!jit_cmp_reg_mem64(
+				    jit, REG_R15, REG_R13,
+				    (int32_t)(offsetof(BfVm, lambda_stack) +
+					      offsetof(LambdaStack, data))) ||
+			    !jit_jcc_stop(jit, 0x04, jit->no_lambda))
 				return 0;
-			if (!jit_mov_reg_imm64(jit, REG_RAX,
-					       (uint64_t)jit_runtime_post_ret))
+			// cmp rsp, r12 ; jbe <overflow>
+			if (!jit_cmp_reg_reg(jit, REG_RSP, REG_R12) ||
+			    !jit_jcc_stop(jit, 0x06, jit->stack_overflow))
 				return 0;
-			if (!jit_call_reg(jit, REG_RAX))
+			// push rbx ; mov rbx, [top.captured_p] ;
+			// call [top.jit_addr] ; pop rbx
+			if (!jit_push_reg(jit, REG_RBX) ||
+			    !jit_mov_reg_mem64(
+				    jit, REG_RBX, REG_R15,
+				    top + (int32_t)offsetof(Lambda, captured_p)))
 				return 0;
-			// add rsp, 8
-			if (!jit_rex_prefix(jit, true, false, false, false))
+			if (!JitBuffer_push_bytes(jit, (uint8_t[]){ 0x41, 0xff },
+						  2) ||
+			    !jit_modrm_mem(jit, 2, REG_R15,
+					   top + (int32_t)offsetof(Lambda,
+								   jit_addr)))
 				return 0;
-			if (!JitBuffer_push_bytes(
-				    jit, (uint8_t[]){ 0x83, 0xc4, 0x08 }, 3))
+			if (!jit_pop_reg(jit, REG_RBX))
 				return 0;
-
-			if (!jit_mov_reg_reg(jit, REG_RBX, REG_RAX))
-				return 0; // Restore data ptr
-
-			// Patch the return address
-			uint64_t ret_addr = (uint64_t)(jit->buffer + jit->size);
-			memcpy(jit->buffer + ret_addr_patch_loc, &ret_addr,
-			       sizeof(uint64_t));
-
-			int32_t rel_offset = 8;
-			memcpy(jit->buffer + ret_addr_patch_loc - 4,
-			       &rel_offset, sizeof(int32_t));
-
 			break;
 		}
 		}
+		JitTapeReach_update(&reach, op);
 		pc++; // Move to the next opcode
 	}
+	if (mul_skip)
+		jit_patch_rel32(jit, mul_skip, jit->size);
 
+	if (!cell_flush(jit, &cell))
+		return 0;
 	JitBuffer_record_opcode_address(jit,
 					pc); // Record end-of-function address
-	if (!jit_pop_reg(jit, REG_R12))
+	if (as_region) {
+		if (!jit_mov_mem64_reg(jit, REG_R13,
+				       offsetof(BfVm, fuel_slice), REG_R14) ||
+		    !jit_mov_reg_reg(jit, REG_RAX, REG_RBX) ||
+		    !jit_epilogue(jit))
+			return 0;
+	} else if (!jit_ret(jit)) {
 		return 0;
-	if (!jit_pop_reg(jit, REG_RBX))
-		return 0;
-	if (!jit_pop_reg(jit, REG_RBP))
-		return 0;
-	if (!jit_ret(jit))
+	}
+	if (!jit_fuel_stubs(jit, first_fuel_site))
 		return 0;
 
 	return function_start_addr;
 }
 
-bool jit_exec_x86_64(const OpcodeVector *code)
-{
-    JitBuffer jit_mem;
-    memset(&jit_mem, 0, sizeof(jit_mem));
-    bool success = false;
-
-    // allocate JIT buffer (+1 for the final "end of program" address)
-    if (!JitBuffer_create(&jit_mem, 65536, code->size + 1)) {
-        fprintf(stderr, "Failed to initialize JIT memory.\n");
-        return false;
-    }
-
-    // init VM state
-    memset(g_bf_mem, 0, sizeof(g_bf_mem));
-    LambdaStack_init(&g_lambda_stack);
-    CallStack_init(&g_call_stack);
-
-    uint64_t main_func_addr =
-        jit_compile_function(&jit_mem, code, 0, code->size);
-    if (main_func_addr == 0) {
-        fprintf(stderr, "JIT compilation failed.\n");
-        goto error;
-    }
-
-    // Set data pointer for the main function and call it
-    uint64_t start_addr = (uint64_t)(jit_mem.buffer + jit_mem.size);
-    if (!jit_mov_reg_imm64(&jit_mem, REG_RBX, (uint64_t)g_bf_mem))
-        goto error;
-    if (!jit_mov_reg_imm64(&jit_mem, REG_RAX, main_func_addr))
-        goto error;
-    if (!jit_call_reg(&jit_mem, REG_RAX))
-        goto error;
-    if (!jit_ret(&jit_mem))
-        goto error;
-
-    // patch jumps before making executable
-    JitBuffer_patch_jumps(&jit_mem);
-
-#ifdef _WIN32
-    DWORD oldProtect;
-    if (!VirtualProtect(jit_mem.buffer, jit_mem.size, PAGE_EXECUTE_READ, &oldProtect)) {
-        perror("VirtualProtect failed");
-        goto error;
-    }
-#else
-    if (mprotect(jit_mem.buffer, jit_mem.size, PROT_READ | PROT_EXEC) == -1) {
-        perror("mprotect failed");
-        goto error;
-    }
-#endif
+/**
+ * @brief Compiles [start_pc, end_pc) with branch relaxation.
+ *
+ * The first pass lays out every loop branch as a 6-byte jcc rel32. Each
+ * branch whose displacement would also fit a rel8 is marked short and the
+ * range is compiled again. Shrinking branches only brings the others
+ * closer, except that a lambda's 16-byte entry alignment can grow its
+ * padding, so a short branch that no longer fits is demoted and the range
+ * recompiled until the layout is stable.
+ */
+static uint64_t jit_compile_relaxed(JitBuffer *jit, const OpcodeVector *code,
+				    size_t start_pc, size_t end_pc,
+				    bool as_region)
+{
+	size_t start_size = jit->size;
+	size_t start_patch_count = jit->jump_patch_count;
+
+	if (jit->short_branch == NULL) {
+		jit->short_branch =
+			(bool *)calloc(jit->opcode_count, sizeof(bool));
+		if (jit->short_branch == NULL) {
+			// Not fatal: every branch stays rel32
+			if (!jit->quiet)
+				perror("Failed to allocate short_branch");
+			return jit_compile_function(jit, code, start_pc, end_pc,
+						    as_region);
+		}
+	}
+
+	bool first_pass = true;
+	for (;;) {
+		uint64_t addr = jit_compile_function(jit, code, start_pc,
+						     end_pc, as_region);
+		if (addr == 0)
+			return 0;
 
-    void (*func)(void) = (void (*)(void))start_addr;
-    func();
+		bool changed = false;
+		for (size_t i = start_patch_count; i < jit->jump_patch_count;
+		     ++i) {
+			const JumpPatch *patch = &jit->jump_patches[i];
+			size_t target = patch->target_opcode_index;
+			if (!JitBuffer_has_opcode(jit, target))
+				continue;
+			// Displacement as if this jump were the 2-byte form
+			intptr_t rel =
+				(intptr_t)JitBuffer_opcode_address(jit, target) -
+				(intptr_t)(patch->instruction_offset + 2);
+			bool fits = rel >= INT8_MIN && rel <= INT8_MAX;
+			bool *slot = &jit->short_branch[target - jit->opcode_base];
+			if (fits == *slot)
+				continue;
+			// Only promote after the all-rel32 pass, so the loop
+			// can only demote from then on and must terminate
+			if (fits && !first_pass)
+				continue;
+			*slot = fits;
+			changed = true;
+		}
+		if (!changed)
+			return addr;
+
+		first_pass = false;
+		jit->size = start_size;
+		jit->jump_patch_count = start_patch_count;
+	}
+}
 
-    success = true;
+JitRegionFn jit_compile_region_x86_64(JitBuffer *jit, const OpcodeVector *code,
+				      size_t start_pc, size_t end_pc)
+{
+	uint64_t entry_addr =
+		jit_compile_relaxed(jit, code, start_pc, end_pc, true);
+	if (entry_addr == 0)
+		return NULL;
 
-error:
-    JitBuffer_destroy(&jit_mem);
-    LambdaStack_free(&g_lambda_stack);
-    CallStack_free(&g_call_stack);
-    return success;
-}
\ No newline at end of file
+	if (!JitBuffer_seal(jit))
+		return NULL;
+	return (JitRegionFn)entry_addr;
+}
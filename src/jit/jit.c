@@ -7,16 +7,112 @@
 #include "jit_aarch64.h"
 #endif
 
-bool jit(const OpcodeVector *code)
+// Initial commit for a code cache; it grows as needed
+#define JIT_REGION_INITIAL_BYTES 4096
+#define JIT_PROGRAM_INITIAL_BYTES 65536
+
+/*
+ * Address space reserved for a region: a fixed part for the prologue,
+ * epilogue and trap routines, and a part per op. No op of any width takes
+ * more than about 100 bytes, fuel stubs included, so this is several
+ * times what a region can use, yet a tier compiler with thousands of hot
+ * loops reserves megabytes rather than a gigabyte per loop. A region
+ * never reserves more than a whole program.
+ */
+#define JIT_REGION_FIXED_BYTES ((size_t)64 << 10)
+#define JIT_REGION_BYTES_PER_OP 512
+
+static bool jit_compile_range(const OpcodeVector *code, size_t start_pc,
+			      size_t end_pc, CellWidth cell, size_t capacity,
+			      size_t reserve, bool quiet, JitRegion *out)
 {
+	memset(out, 0, sizeof(*out));
+#if defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__)
+	out->buffer.quiet = quiet;
+	// One address slot per op of the range and one for its end
+	if (!JitBuffer_create(&out->buffer, capacity, reserve, start_pc,
+			      end_pc - start_pc + 1))
+		return false;
+	out->buffer.cell = cell;
 #if defined(__x86_64__) || defined(_M_X64)
-	return jit_exec_x86_64(code);
-#elif defined(__aarch64__)
-	return jit_exec_aarch64(code);
+	out->entry = jit_compile_region_x86_64(&out->buffer, code, start_pc,
+					       end_pc);
+#else
+	out->entry = jit_compile_region_aarch64(&out->buffer, code, start_pc,
+						end_pc);
+#endif
+	if (!out->entry) {
+		JitBuffer_destroy(&out->buffer);
+		return false;
+	}
+	return true;
+#else
+	(void)code;
+	(void)start_pc;
+	(void)end_pc;
+	(void)cell;
+	(void)capacity;
+	(void)reserve;
+	(void)quiet;
+	return false;
+#endif
+}
+
+bool jit_compile_region(const OpcodeVector *code, size_t start_pc,
+			size_t end_pc, CellWidth cell, JitRegion *out)
+{
+	size_t ops = end_pc - start_pc;
+	size_t reserve = JIT_RESERVE_BYTES;
+	if (ops < (JIT_RESERVE_BYTES - JIT_REGION_FIXED_BYTES) /
+			  JIT_REGION_BYTES_PER_OP)
+		reserve = JIT_REGION_FIXED_BYTES +
+			  ops * JIT_REGION_BYTES_PER_OP;
+	return jit_compile_range(code, start_pc, end_pc, cell,
+				 JIT_REGION_INITIAL_BYTES, reserve, true, out);
+}
+
+bool jit_compile(const OpcodeVector *code, CellWidth cell, JitRegion *out)
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__)
+	return jit_compile_range(code, 0, code->size, cell,
+				 JIT_PROGRAM_INITIAL_BYTES, JIT_RESERVE_BYTES,
+				 false, out);
 #else
 	// Placeholder for other architectures
+	(void)code;
+	(void)cell;
+	memset(out, 0, sizeof(*out));
 	fprintf(stderr,
 		"JIT compilation is not supported on this architecture.\n");
 	return false;
 #endif
 }
+
+VmStatus jit_execute(const JitRegion *program, BfVm *vm)
+{
+	vm->cell = program->buffer.cell;
+	BfVm_start(vm);
+	if (BF_TAPE_FAULTED(vm))
+		return BfVm_finish(vm);
+	vm_guard_enter(vm, &program->buffer);
+	program->entry(vm->mem, vm);
+	vm_guard_leave(vm);
+	return BfVm_finish(vm);
+}
+
+VmStatus jit_run(BfVm *vm, const OpcodeVector *code)
+{
+	JitRegion program;
+	if (!jit_compile(code, vm->cell, &program))
+		return VM_COMPILE_FAILED;
+	VmStatus status = jit_execute(&program, vm);
+	JitRegion_free(&program);
+	return status;
+}
+
+void JitRegion_free(JitRegion *region)
+{
+	if (region->entry)
+		JitBuffer_destroy(&region->buffer);
+	memset(region, 0, sizeof(*region));
+}
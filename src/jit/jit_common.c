@@ -1,4 +1,70 @@
 #include "jit_common.h"
+#include "util.h"
+
+#include <stdatomic.h>
+
+// Committed JIT memory across all live buffers, and its high-water mark
+static atomic_size_t g_jit_committed;
+static atomic_size_t g_jit_peak_committed;
+// Most code of one buffer found on huge pages
+static atomic_size_t g_jit_peak_huge;
+
+/**
+ * @brief perror(), unless the buffer's failures are not to be reported.
+ */
+static void jit_perror(const JitBuffer *jit, const char *what)
+{
+	if (!jit->quiet)
+		perror(what);
+}
+
+static size_t round_up(size_t value, size_t multiple)
+{
+	return (value + multiple - 1) / multiple * multiple;
+}
+
+static void jit_account_commit(size_t bytes)
+{
+	size_t now = atomic_fetch_add(&g_jit_committed, bytes) + bytes;
+	size_t peak = atomic_load(&g_jit_peak_committed);
+	while (now > peak &&
+	       !atomic_compare_exchange_weak(&g_jit_peak_committed, &peak, now))
+		;
+}
+
+/**
+ * @brief Commits (makes read-write) the reserved range up to `capacity`.
+ */
+static bool jit_commit(JitBuffer *jit, size_t capacity)
+{
+	capacity = round_up(capacity, base_page_size());
+	if (capacity <= jit->capacity)
+		return true;
+	if (capacity > jit->reserved) {
+		if (!jit->quiet)
+			fprintf(stderr,
+				"JIT buffer overflow (%zu byte code cache limit)\n",
+				jit->reserved);
+		return false;
+	}
+
+	uint8_t *start = jit->buffer + jit->capacity;
+	size_t bytes = capacity - jit->capacity;
+#ifdef _WIN32
+	if (!VirtualAlloc(start, bytes, MEM_COMMIT, PAGE_READWRITE)) {
+		jit_perror(jit, "VirtualAlloc commit failed");
+		return false;
+	}
+#else
+	if (mprotect(start, bytes, PROT_READ | PROT_WRITE) == -1) {
+		jit_perror(jit, "mprotect commit failed");
+		return false;
+	}
+#endif
+	jit->capacity = capacity;
+	jit_account_commit(bytes);
+	return true;
+}
 
 static bool busX86Jit_add_jump_patch(JitBuffer *jit, size_t target_opcode_index,
 				     uint8_t jump_type)
@@ -10,7 +76,7 @@ static bool busX86Jit_add_jump_patch(JitBuffer *jit, size_t target_opcode_index,
 		JumpPatch *new_patches = (JumpPatch *)realloc(
 			jit->jump_patches, new_capacity * sizeof(JumpPatch));
 		if (!new_patches) {
-			perror("Failed to reallocate jump patches");
+			jit_perror(jit, "Failed to reallocate jump patches");
 			return false;
 		}
 		jit->jump_patches = new_patches;
@@ -24,42 +90,48 @@ static bool busX86Jit_add_jump_patch(JitBuffer *jit, size_t target_opcode_index,
 	return true;
 }
 
-bool JitBuffer_create(JitBuffer *jit, size_t capacity, size_t num_opcodes)
+bool JitBuffer_create(JitBuffer *jit, size_t capacity, size_t reserve,
+		      size_t first_opcode, size_t num_opcodes)
 {
-	jit->capacity = capacity;
+	jit->capacity = 0;
+	jit->reserved = round_up(reserve, base_page_size());
 	jit->size = 0;
+	jit->opcode_base = first_opcode;
 	jit->opcode_count = num_opcodes;
 	jit->jump_patch_count = 0;
 	jit->jump_patch_capacity = 0;
 	jit->jump_patches = NULL;
+	jit->short_branch = NULL;
+	jit->fuel_sites = NULL;
+	jit->fuel_site_count = 0;
+	jit->fuel_site_capacity = 0;
+	jit->fuel_trap = 0;
+	jit->stack_overflow = 0;
+	jit->no_lambda = 0;
+	jit->cell = CELL_8;
 
+	// Reserve address space only; pages are committed as code is pushed,
+	// so addresses baked into the code never move
 #ifdef _WIN32
-	jit->buffer = (uint8_t *)VirtualAlloc(
-		NULL, capacity, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	jit->buffer = (uint8_t *)VirtualAlloc(NULL, jit->reserved, MEM_RESERVE,
+					      PAGE_NOACCESS);
 	if (jit->buffer == NULL) {
-		perror("VirtualAlloc failed");
+		jit_perror(jit, "VirtualAlloc failed");
 		return false;
 	}
 #else
-	jit->buffer = (uint8_t *)mmap(NULL, capacity, PROT_READ | PROT_WRITE,
-				      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (jit->buffer == MAP_FAILED) {
-		perror("mmap failed");
-		jit->buffer = NULL;
+	jit->buffer = (uint8_t *)huge_pages_reserve(jit->reserved);
+	if (jit->buffer == NULL) {
+		jit_perror(jit, "mmap failed");
 		return false;
 	}
 #endif
 
 	jit->opcode_addresses = (size_t *)calloc(num_opcodes, sizeof(size_t));
-	if (jit->opcode_addresses == NULL) {
-		perror("Failed to allocate opcode_addresses");
-#ifdef _WIN32
-		VirtualFree(jit->buffer, 0, MEM_RELEASE);
-#else
-		if (jit->buffer)
-			munmap(jit->buffer, jit->capacity);
-#endif
-		jit->buffer = NULL;
+	if (jit->opcode_addresses == NULL || !jit_commit(jit, capacity)) {
+		if (jit->opcode_addresses == NULL)
+			jit_perror(jit, "Failed to allocate opcode_addresses");
+		JitBuffer_destroy(jit);
 		return false;
 	}
 	return true;
@@ -71,15 +143,18 @@ void JitBuffer_destroy(JitBuffer *jit)
 #ifdef _WIN32
 		VirtualFree(jit->buffer, 0, MEM_RELEASE);
 #else
-		munmap(jit->buffer, jit->capacity);
+		munmap(jit->buffer, jit->reserved);
 #endif
+		atomic_fetch_sub(&g_jit_committed, jit->capacity);
 	}
 	free(jit->opcode_addresses);
 	free(jit->jump_patches);
+	free(jit->short_branch);
+	free(jit->fuel_sites);
 	memset(jit, 0, sizeof(JitBuffer));
 }
 
-bool JitBuffer_exec(JitBuffer *jit)
+bool JitBuffer_seal(JitBuffer *jit)
 {
 	// Call the backend-specific patcher
 	JitBuffer_patch_jumps(jit);
@@ -88,15 +163,38 @@ bool JitBuffer_exec(JitBuffer *jit)
 	DWORD oldProtect;
 	if (!VirtualProtect(jit->buffer, jit->size, PAGE_EXECUTE_READ,
 			    &oldProtect)) {
-		perror("VirtualProtect failed");
+		jit_perror(jit, "VirtualProtect failed");
 		return false;
 	}
 #else
 	if (mprotect(jit->buffer, jit->size, PROT_READ | PROT_EXEC) == -1) {
-		perror("mprotect failed");
+		jit_perror(jit, "mprotect failed");
 		return false;
 	}
 #endif
+#if defined(__GNUC__)
+	__builtin___clear_cache((char *)jit->buffer,
+				(char *)(jit->buffer + jit->size));
+#endif
+	// Only code spanning a huge page can be on one; reading smaps for
+	// anything smaller would only slow down small compiles
+	size_t huge = huge_page_size();
+	PageUsage usage;
+	if (huge && jit->size >= huge &&
+	    PageUsage_measure(jit->buffer, jit->capacity, &usage)) {
+		size_t peak = atomic_load(&g_jit_peak_huge);
+		while (usage.huge > peak &&
+		       !atomic_compare_exchange_weak(&g_jit_peak_huge, &peak,
+						     usage.huge))
+			;
+	}
+	return true;
+}
+
+bool JitBuffer_exec(JitBuffer *jit)
+{
+	if (!JitBuffer_seal(jit))
+		return false;
 	void (*func)(void) = (void (*)(void))jit->buffer;
 	func();
 	return true;
@@ -104,10 +202,11 @@ bool JitBuffer_exec(JitBuffer *jit)
 
 bool JitBuffer_push_bytes(JitBuffer *jit, const uint8_t *bytes, size_t count)
 {
-	if (jit->size + count > jit->capacity) {
-		fprintf(stderr, "JIT buffer overflow\n");
+	if (jit->size + count > jit->capacity &&
+	    !jit_commit(jit, jit->size + count > 2 * jit->capacity ?
+				     jit->size + count :
+				     2 * jit->capacity))
 		return false;
-	}
 	memcpy(jit->buffer + jit->size, bytes, count);
 	jit->size += count;
 	return true;
@@ -136,11 +235,119 @@ bool JitBuffer_add_jump_patch(JitBuffer *jit, size_t target_opcode_index,
 
 void JitBuffer_record_opcode_address(JitBuffer *jit, size_t opcode_index)
 {
-	if (opcode_index < jit->opcode_count) {
-		jit->opcode_addresses[opcode_index] = jit->size;
+	if (JitBuffer_has_opcode(jit, opcode_index)) {
+		jit->opcode_addresses[opcode_index - jit->opcode_base] =
+			jit->size;
 	} else {
 		fprintf(stderr,
-			"Error: Invalid opcode index %zu for recording address (max %zu)\n",
-			opcode_index, jit->opcode_count - 1);
+			"Error: Invalid opcode index %zu for recording address (range %zu..%zu)\n",
+			opcode_index, jit->opcode_base,
+			jit->opcode_base + jit->opcode_count - 1);
 	}
 }
+
+bool JitBuffer_add_fuel_site(JitBuffer *jit, size_t offset)
+{
+	if (jit->fuel_site_count >= jit->fuel_site_capacity) {
+		size_t new_capacity = jit->fuel_site_capacity == 0 ?
+					      8 :
+					      jit->fuel_site_capacity * 2;
+		size_t *new_sites = (size_t *)realloc(
+			jit->fuel_sites, new_capacity * sizeof(size_t));
+		if (!new_sites) {
+			jit_perror(jit, "Failed to reallocate fuel sites");
+			return false;
+		}
+		jit->fuel_sites = new_sites;
+		jit->fuel_site_capacity = new_capacity;
+	}
+	jit->fuel_sites[jit->fuel_site_count++] = offset;
+	return true;
+}
+
+bool JitBuffer_cell_disp(const JitBuffer *jit, int64_t cells, int32_t *out)
+{
+	int64_t bytes = cells * (int64_t)CellWidth_bytes(jit->cell);
+	if (bytes < INT32_MIN || bytes > INT32_MAX) {
+		if (!jit->quiet)
+			fprintf(stderr,
+				"JIT: a move of %" PRId64 " cells is too far\n",
+				cells);
+		return false;
+	}
+	*out = (int32_t)bytes;
+	return true;
+}
+
+size_t JitBuffer_opcode_at(const JitBuffer *jit, size_t offset)
+{
+	// Ops that emit no code share an address with the next one, so on a
+	// tie the later op is the one whose code this is. Nothing is recorded
+	// at address 0, where the fuel trap routine sits.
+	size_t best = SIZE_MAX;
+	for (size_t i = 0; i < jit->opcode_count; ++i) {
+		size_t at = jit->opcode_addresses[i];
+		if (at != 0 && at <= offset &&
+		    (best == SIZE_MAX || at >= jit->opcode_addresses[best]))
+			best = i;
+	}
+	return best == SIZE_MAX ? SIZE_MAX : jit->opcode_base + best;
+}
+
+static void tape_reach_touch(JitTapeReach *reach, int64_t offset)
+{
+	if (!reach->known) {
+		*reach = (JitTapeReach){ true, offset, offset };
+		return;
+	}
+	if (offset < reach->lo)
+		reach->lo = offset;
+	if (offset > reach->hi)
+		reach->hi = offset;
+}
+
+void JitTapeReach_update(JitTapeReach *reach, const opcode *op)
+{
+	switch (op->op) {
+	case op_add:
+	case op_sub:
+	case op_out:
+	case op_clear:
+	case op_set:
+		tape_reach_touch(reach, op->offset);
+		break;
+	case op_mul:
+		// p[offset] only when p[src] is non-zero
+		tape_reach_touch(reach, op->src);
+		break;
+	case op_addp:
+		reach->lo -= op->num;
+		reach->hi -= op->num;
+		break;
+	case op_subp:
+		reach->lo += op->num;
+		reach->hi += op->num;
+		break;
+	case op_jt:
+	case op_jf:
+	case op_scanr:
+	case op_scanl:
+		// What follows is reached only past a test of p[0]
+		*reach = (JitTapeReach){ true, 0, 0 };
+		break;
+	default:
+		// op_in may leave its cell alone; lambdas move p elsewhere
+		reach->known = false;
+		break;
+	}
+}
+
+size_t JitBuffer_peak_committed(void)
+{
+	return atomic_load(&g_jit_peak_committed);
+}
+
+size_t JitBuffer_peak_huge(void)
+{
+	return atomic_load(&g_jit_peak_huge);
+}
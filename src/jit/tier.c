@@ -0,0 +1,105 @@
+#include "tier.h"
+
+/**
+ * @brief Lambda ops keep their state on the interpreter's stacks in a form
+ * the JIT runtime can't resume from, so loops containing them stay
+ * interpreted.
+ */
+static bool region_is_compilable(const OpcodeVector *code, size_t start_pc,
+				 size_t end_pc)
+{
+	for (size_t pc = start_pc; pc < end_pc; ++pc) {
+		optype_t op = code->data[pc].op;
+		if (op == op_def_lambda || op == op_ret || op == op_call)
+			return false;
+	}
+	return true;
+}
+
+static void *tier_compiler_main(void *arg)
+{
+	TierCompiler *tier = arg;
+
+	pthread_mutex_lock(&tier->lock);
+	for (;;) {
+		while (!tier->stopping && tier->queue_head == tier->queue_tail)
+			pthread_cond_wait(&tier->wake, &tier->lock);
+		if (tier->stopping)
+			break;
+		size_t id = tier->queue[tier->queue_head++];
+		pthread_mutex_unlock(&tier->lock);
+
+		TierLoop *loop = &tier->loops[id];
+		if (region_is_compilable(tier->code, loop->start_pc,
+					 loop->end_pc) &&
+		    jit_compile_region(tier->code, loop->start_pc,
+				       loop->end_pc, tier->cell,
+				       &loop->region)) {
+			atomic_fetch_add(&tier->compiled, 1);
+			atomic_store_explicit(&loop->entry, loop->region.entry,
+					      memory_order_release);
+		}
+
+		pthread_mutex_lock(&tier->lock);
+	}
+	pthread_mutex_unlock(&tier->lock);
+	return NULL;
+}
+
+bool TierCompiler_start(TierCompiler *tier, const OpcodeVector *code,
+			CellWidth cell, size_t loop_count)
+{
+	memset(tier, 0, sizeof(*tier));
+	tier->code = code;
+	tier->cell = cell;
+	tier->loop_count = loop_count;
+	tier->loops = calloc(loop_count ? loop_count : 1, sizeof(TierLoop));
+	tier->queue = malloc((loop_count ? loop_count : 1) * sizeof(size_t));
+	if (!tier->loops || !tier->queue) {
+		perror("Failed to allocate tier compiler state");
+		free(tier->loops);
+		free(tier->queue);
+		return false;
+	}
+
+	pthread_mutex_init(&tier->lock, NULL);
+	pthread_cond_init(&tier->wake, NULL);
+	int err = pthread_create(&tier->thread, NULL, tier_compiler_main, tier);
+	if (err != 0) {
+		fprintf(stderr, "Failed to start tier compiler thread: %s\n",
+			strerror(err));
+		pthread_cond_destroy(&tier->wake);
+		pthread_mutex_destroy(&tier->lock);
+		free(tier->loops);
+		free(tier->queue);
+		return false;
+	}
+	return true;
+}
+
+void TierCompiler_request(TierCompiler *tier, size_t id)
+{
+	if (atomic_exchange(&tier->loops[id].requested, true))
+		return;
+
+	pthread_mutex_lock(&tier->lock);
+	tier->queue[tier->queue_tail++] = id;
+	pthread_cond_signal(&tier->wake);
+	pthread_mutex_unlock(&tier->lock);
+}
+
+void TierCompiler_stop(TierCompiler *tier)
+{
+	pthread_mutex_lock(&tier->lock);
+	tier->stopping = true;
+	pthread_cond_signal(&tier->wake);
+	pthread_mutex_unlock(&tier->lock);
+	pthread_join(tier->thread, NULL);
+
+	for (size_t i = 0; i < tier->loop_count; ++i)
+		JitRegion_free(&tier->loops[i].region);
+	pthread_cond_destroy(&tier->wake);
+	pthread_mutex_destroy(&tier->lock);
+	free(tier->loops);
+	free(tier->queue);
+}
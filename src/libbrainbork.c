@@ -0,0 +1,340 @@
+#include "libbrainbork.h"
+
+#include "compiler.h"
+#include "jit.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__aarch64__)
+#define BF_HAVE_JIT 1
+#else
+#define BF_HAVE_JIT 0
+#endif
+
+_Static_assert((int)BF_EOF_MINUS_ONE == (int)EOF_MINUS_ONE &&
+		       (int)BF_EOF_ZERO == (int)EOF_ZERO &&
+		       (int)BF_EOF_UNCHANGED == (int)EOF_UNCHANGED,
+	       "BfEof must mirror EofPolicy");
+
+struct BfProgram {
+	OpcodeVector code;
+	JitRegion native; // BF_ENGINE_JIT only
+	CellWidth cell;
+	BfProgramStats stats;
+};
+
+/* Where a run's output goes: the caller's buffer, its callback, or
+ * nowhere. Counts every byte either way. */
+typedef struct {
+	uint8_t *data;
+	size_t capacity;
+	BfWriteFn write;
+	void *write_ctx;
+	size_t size;
+	bool failed;
+} RunOutput;
+
+/* Counts what the caller's read callback delivered. */
+typedef struct {
+	BfReadFn read;
+	void *read_ctx;
+	size_t delivered;
+} RunInput;
+
+static double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static bool run_output_sink(void *ctx, const uint8_t *data, size_t size)
+{
+	RunOutput *out = ctx;
+	// A buffer, when there is one, takes all the output: what does not fit
+	// is dropped, never passed on to the callback
+	if (out->data) {
+		if (out->size < out->capacity) {
+			size_t room = out->capacity - out->size;
+			memcpy(out->data + out->size, data,
+			       size < room ? size : room);
+		}
+	} else if (out->write && !out->failed) {
+		out->failed = !out->write(out->write_ctx, data, size);
+	}
+	out->size += size;
+	return true;
+}
+
+static ptrdiff_t run_input_source(void *ctx, uint8_t *buf, size_t size)
+{
+	RunInput *in = ctx;
+	ptrdiff_t n = in->read(in->read_ctx, buf, size);
+	if (n > 0)
+		in->delivered += (size_t)n;
+	return n;
+}
+
+BfStatus BfProgram_compile(const char *source, size_t size,
+			   const BfCompileOptions *options, BfProgram **out)
+{
+	if (!out || (!source && size))
+		return BF_ERR_ARGS;
+	*out = NULL;
+	BfCompileOptions defaults = {
+		BF_HAVE_JIT ? BF_ENGINE_JIT : BF_ENGINE_INTERPRETER,
+		OPTIMIZE_MAX_LEVEL, 8
+	};
+	if (!options)
+		options = &defaults;
+	CellWidth cell;
+	switch (options->cell_bits) {
+	case 0:
+	case 8:
+		cell = CELL_8;
+		break;
+	case 16:
+		cell = CELL_16;
+		break;
+	case 32:
+		cell = CELL_32;
+		break;
+	default:
+		return BF_ERR_ARGS;
+	}
+	if (options->opt_level < 0 || options->opt_level > OPTIMIZE_MAX_LEVEL ||
+	    (options->engine != BF_ENGINE_JIT &&
+	     options->engine != BF_ENGINE_INTERPRETER))
+		return BF_ERR_ARGS;
+	if (options->engine == BF_ENGINE_JIT && !BF_HAVE_JIT)
+		return BF_ERR_UNSUPPORTED;
+
+	double begin = now_seconds();
+	// The scanner expects a C string
+	char *text = malloc(size + 1);
+	BfProgram *program = calloc(1, sizeof(*program));
+	if (!text || !program) {
+		free(text);
+		free(program);
+		return BF_ERR_NOMEM;
+	}
+	if (size)
+		memcpy(text, source, size);
+	text[size] = '\0';
+
+	OpcodeVector code;
+	OpcodeVector_init(&code);
+	OpcodeVector_init(&program->code);
+	bool parsed = scanner(text, &code);
+	free(text);
+	if (!parsed) {
+		OpcodeVector_free(&code);
+		free(program);
+		return BF_ERR_PARSE;
+	}
+	OptimizeOptions opt = { options->opt_level, false, cell };
+	bool optimized = optimize_with(&code, &program->code, &opt);
+	OpcodeVector_free(&code);
+	if (!optimized ||
+	    (options->engine == BF_ENGINE_JIT &&
+	     !jit_compile(&program->code, cell, &program->native))) {
+		BfProgram_free(program);
+		return BF_ERR_COMPILE;
+	}
+
+	program->cell = cell;
+	program->stats.engine = options->engine;
+	program->stats.op_count = program->code.size;
+	program->stats.code_bytes =
+		program->native.entry ? program->native.buffer.size : 0;
+	program->stats.compile_seconds = now_seconds() - begin;
+	*out = program;
+	return BF_OK;
+}
+
+struct BfContext {
+	BfVm *vm;
+};
+
+static bool drop_output(void *ctx, const uint8_t *data, size_t size)
+{
+	(void)ctx;
+	(void)data;
+	(void)size;
+	return true;
+}
+
+BfStatus BfContext_create(BfContext **out)
+{
+	if (!out)
+		return BF_ERR_ARGS;
+	*out = NULL;
+	BfContext *context = malloc(sizeof(*context));
+	// BfVm holds page-aligned output buffers
+	BfVm *vm = aligned_alloc(_Alignof(BfVm), sizeof(BfVm));
+	if (!context || !vm) {
+		free(context);
+		free(vm);
+		return BF_ERR_NOMEM;
+	}
+	if (!BfVm_init_unconnected(vm)) {
+		free(context);
+		free(vm);
+		return BF_ERR_NOMEM;
+	}
+	context->vm = vm;
+	*out = context;
+	return BF_OK;
+}
+
+void BfContext_free(BfContext *context)
+{
+	if (!context)
+		return;
+	BfVm_free(context->vm);
+	free(context->vm);
+	free(context);
+}
+
+BfStatus BfContext_run(BfContext *context, const BfProgram *program,
+		       const BfRunOptions *options, BfRunStats *stats)
+{
+	BfRunOptions none = { 0 };
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+	if (!context || !program)
+		return BF_ERR_ARGS;
+	if (!options)
+		options = &none;
+	if ((!options->input && options->input_size) ||
+	    (!options->output && options->output_capacity) ||
+	    (unsigned)options->eof > BF_EOF_UNCHANGED ||
+	    !(options->timeout >= 0))
+		return BF_ERR_ARGS;
+#ifdef _WIN32
+	if (options->timeout > 0)
+		return BF_ERR_UNSUPPORTED;
+#endif
+	BfVm *vm = context->vm;
+
+	RunInput input = { options->read, options->read_ctx, 0 };
+	EofPolicy eof = (EofPolicy)options->eof;
+	if (options->input)
+		InputBuffer_init_memory(&vm->in, options->input,
+					options->input_size, eof);
+	else if (options->read)
+		InputBuffer_init_source(&vm->in, run_input_source, &input, eof);
+	else
+		InputBuffer_init_memory(&vm->in, NULL, 0, eof);
+
+	RunOutput output = { options->output, options->output_capacity,
+			     options->write, options->write_ctx, 0, false };
+	OutputBuffer_init_sink(&vm->out, run_output_sink, &output, FLUSH_FULL);
+	vm->limits = (VmLimits){ options->fuel, options->timeout };
+	vm->tape_left = options->tape_left;
+	vm->cell = program->cell;
+
+	double begin = now_seconds();
+	VmStatus status;
+	if (program->stats.engine == BF_ENGINE_JIT) {
+		status = jit_execute(&program->native, vm);
+	} else {
+		InterpreterOptions interp = { false, false };
+		status = interpreter_execute(vm, &program->code, &interp);
+	}
+	double seconds = now_seconds() - begin;
+
+	size_t unread = (size_t)(vm->in.end - vm->in.pos);
+	if (stats) {
+		stats->input_bytes = options->input ?
+					     options->input_size - unread :
+					     input.delivered - unread;
+		stats->output_bytes = output.size;
+		stats->seconds = seconds;
+		if (status == VM_TAPE_FAULT)
+			stats->fault_cell = vm->fault_cell;
+	}
+	// Let go of the caller's buffers and callbacks before returning
+	InputBuffer_init_memory(&vm->in, NULL, 0, eof);
+	OutputBuffer_init_sink(&vm->out, drop_output, NULL, FLUSH_FULL);
+
+	if (status == VM_OUT_OF_FUEL)
+		return BF_ERR_OUT_OF_FUEL;
+	if (status == VM_TIMEOUT)
+		return BF_ERR_TIMEOUT;
+	if (status == VM_TAPE_FAULT)
+		return BF_ERR_TAPE_FAULT;
+	if (status == VM_STACK_OVERFLOW)
+		return BF_ERR_STACK_OVERFLOW;
+	if (status == VM_NO_LAMBDA)
+		return BF_ERR_NO_LAMBDA;
+	if (output.failed)
+		return BF_ERR_IO;
+	if (output.data && output.size > output.capacity)
+		return BF_ERR_OUTPUT_FULL;
+	return BF_OK;
+}
+
+BfStatus BfProgram_run(const BfProgram *program, const BfRunOptions *options,
+		       BfRunStats *stats)
+{
+	if (stats)
+		memset(stats, 0, sizeof(*stats));
+	if (!program)
+		return BF_ERR_ARGS;
+	BfContext *context;
+	BfStatus status = BfContext_create(&context);
+	if (status != BF_OK)
+		return status;
+	status = BfContext_run(context, program, options, stats);
+	BfContext_free(context);
+	return status;
+}
+
+void BfProgram_stats(const BfProgram *program, BfProgramStats *stats)
+{
+	if (program)
+		*stats = program->stats;
+	else
+		memset(stats, 0, sizeof(*stats));
+}
+
+void BfProgram_free(BfProgram *program)
+{
+	if (!program)
+		return;
+	JitRegion_free(&program->native);
+	OpcodeVector_free(&program->code);
+	free(program);
+}
+
+const char *BfStatus_string(BfStatus status)
+{
+	switch (status) {
+	case BF_OK:
+		return "ok";
+	case BF_ERR_ARGS:
+		return "invalid argument";
+	case BF_ERR_PARSE:
+		return "unbalanced brackets";
+	case BF_ERR_COMPILE:
+		return "compilation failed";
+	case BF_ERR_NOMEM:
+		return "out of memory";
+	case BF_ERR_IO:
+		return "output callback failed";
+	case BF_ERR_OUTPUT_FULL:
+		return "output buffer too small";
+	case BF_ERR_UNSUPPORTED:
+		return "not supported by this build";
+	case BF_ERR_OUT_OF_FUEL:
+		return "out of fuel";
+	case BF_ERR_TIMEOUT:
+		return "timed out";
+	case BF_ERR_TAPE_FAULT:
+		return "pointer left the tape";
+	case BF_ERR_STACK_OVERFLOW:
+		return "lambda or call stack overflow";
+	case BF_ERR_NO_LAMBDA:
+		return "'!' with no lambda defined";
+	}
+	return "unknown status";
+}
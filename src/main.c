@@ -2,14 +2,104 @@
 #include "compiler.h"
 #include "vm.h"
 #include "jit.h"
+#include "batch.h"
 
 static void usage()
 {
 	printf("usage:\n"
-	       "  ./brainbork [options] <filename.bf>\n\n"
+	       "  ./brainbork [options] <filename.bf>\n"
+	       "  ./brainbork -j --batch [options] <filename.bf> [inputs...]\n\n"
 	       "options:\n"
-	       "  -i | interpreter mode\n"
-	       "  -j | JIT mode\n");
+	       "  -i            | interpreter mode\n"
+	       "  -j            | JIT mode\n"
+	       "  -t            | tiered mode: interpret, JIT hot loops in the background\n"
+	       "  -O0 .. -O3    | optimization level (default -O3)\n"
+	       "  --time-passes | report time and ops removed per pass\n"
+	       "  --superinsn-report | with -i, report superinstruction use\n"
+	       "  --jit-stats   | report the JIT code cache's peak size\n"
+	       "  --page-stats  | report the page sizes backing the tape and JIT code\n"
+	       "  --no-huge-pages | keep the tape and JIT code on base pages\n"
+	       "  --flush=line|full|none | when program output is written out\n"
+	       "                (default: line on a terminal, else full)\n"
+	       "  --eof=-1|0|unchanged | what ',' stores at end of input (default -1)\n"
+	       "  --cell=8|16|32 | cell width in bits; cells wrap at it (default 8)\n"
+	       "  --no-vmsplice | copy output into a pipe instead of splicing pages\n"
+	       "  --batch       | compile once, run once per input file on a thread\n"
+	       "                pool; each output goes to <input>.out. Input paths\n"
+	       "                are read from stdin, one per line, if none are given\n"
+	       "  --threads=N   | --batch worker count (default: one per core)\n"
+	       "  --fuel=N      | stop after N loop back-edges and lambda calls\n"
+	       "  --timeout=SECONDS | stop a run after this much wall-clock time\n"
+	       "  --tape-left   | start in the middle of the tape, so cells left\n"
+	       "                  of the first one can be used\n");
+}
+
+/**
+ * @brief Reports which page sizes the tape (unless `vm` is NULL) and the
+ * JIT code cache actually got.
+ */
+static void page_stats_report(const BfVm *vm)
+{
+	size_t base = base_page_size() / 1024;
+	size_t huge = huge_page_size() / 1024;
+	size_t committed = JitBuffer_peak_committed() / 1024;
+	PageUsage tape;
+	if (vm && PageUsage_measure(vm->tape, vm->tape_size, &tape)) {
+		if (tape.huge)
+			fprintf(stderr,
+				"tape pages: %zu KiB huge pages for %zu of "
+				"%zu KiB resident\n",
+				huge, tape.huge / 1024, tape.resident / 1024);
+		else
+			fprintf(stderr,
+				"tape pages: %zu KiB base pages, %zu KiB "
+				"resident (%s)\n",
+				base, tape.resident / 1024,
+				huge ? "no huge page obtained" :
+				       "huge pages off or unavailable");
+	}
+	if (committed == 0) // nothing was compiled
+		return;
+	size_t code = JitBuffer_peak_huge() / 1024;
+	if (code)
+		fprintf(stderr,
+			"jit code pages: %zu KiB huge pages for %zu KiB of "
+			"code, peak %zu KiB committed\n",
+			huge, code, committed);
+	else
+		fprintf(stderr,
+			"jit code pages: %zu KiB base pages, peak %zu KiB "
+			"committed (%s)\n",
+			base, committed,
+			!huge		  ? "huge pages off or unavailable" :
+			committed < huge ? "smaller than a huge page" :
+					   "no huge page obtained");
+}
+
+/**
+ * @brief Reports a run that did not finish. Returns the exit status.
+ */
+static int run_exit_status(const BfVm *vm, VmStatus status)
+{
+	switch (status) {
+	case VM_OK:
+	case VM_OUTPUT_FAILED: // the failed write was already reported
+		return 0;
+	case VM_COMPILE_FAILED:
+		fprintf(stderr, "JIT compilation or execution failed.\n");
+		return -1;
+	case VM_TAPE_FAULT:
+		fprintf(stderr, "program stopped: %s at cell %td",
+			VmStatus_string(status), vm->fault_cell);
+		if (vm->fault_op != BF_NO_OP)
+			fprintf(stderr, " (op %zu)", vm->fault_op);
+		fputc('\n', stderr);
+		return -1;
+	default:
+		fprintf(stderr, "program stopped: %s\n",
+			VmStatus_string(status));
+		return -1;
+	}
 }
 
 static char *read_file_to_string(const char *filename)
@@ -41,6 +131,111 @@ static char *read_file_to_string(const char *filename)
 	return buffer;
 }
 
+/**
+ * @brief Reads newline-separated paths from stdin into a growing array.
+ * Returns the count, or -1 on allocation failure. Empty lines are skipped.
+ */
+static long read_paths_from_stdin(char ***out)
+{
+	char **paths = NULL;
+	size_t count = 0, capacity = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t len;
+	while ((len = getline(&line, &line_size, stdin)) >= 0) {
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0)
+			continue;
+		if (count == capacity) {
+			capacity = capacity ? capacity * 2 : 64;
+			char **grown = realloc(paths, capacity * sizeof(char *));
+			if (!grown)
+				goto error;
+			paths = grown;
+		}
+		if (!(paths[count] = strdup(line)))
+			goto error;
+		count++;
+	}
+	free(line);
+	*out = paths;
+	return (long)count;
+
+error:
+	perror("Failed to read batch inputs");
+	for (size_t i = 0; i < count; ++i)
+		free(paths[i]);
+	free(paths);
+	free(line);
+	return -1;
+}
+
+/**
+ * @brief --batch: compiles `code` once for cells of width `cell` and runs
+ * it over every input on a thread pool, writing each output to
+ * <input>.out. Returns the exit status.
+ */
+static int run_batch(const OpcodeVector *code, CellWidth cell,
+		     const char **inputs, size_t input_count,
+		     const BatchOptions *options)
+{
+	char **owned = NULL;
+	if (input_count == 0) {
+		long n = read_paths_from_stdin(&owned);
+		if (n < 0)
+			return -1;
+		inputs = (const char **)owned;
+		input_count = (size_t)n;
+	}
+
+	int status = -1;
+	JitRegion program;
+	BatchJob *jobs = calloc(input_count ? input_count : 1, sizeof(BatchJob));
+	if (!jobs) {
+		perror("Failed to allocate batch jobs");
+		goto done;
+	}
+	for (size_t i = 0; i < input_count; ++i) {
+		jobs[i].input = inputs[i];
+		jobs[i].output = malloc(strlen(inputs[i]) + sizeof(".out"));
+		if (!jobs[i].output) {
+			perror("Failed to allocate batch jobs");
+			goto done;
+		}
+		sprintf(jobs[i].output, "%s.out", inputs[i]);
+	}
+
+	if (!jit_compile(code, cell, &program)) {
+		fprintf(stderr, "JIT compilation failed.\n");
+		goto done;
+	}
+	BatchStats stats;
+	bool started = batch_run(&program, jobs, input_count, options, &stats);
+	JitRegion_free(&program);
+	if (started) {
+		batch_report(jobs, input_count, &stats, stderr);
+		status = 0;
+		for (size_t i = 0; i < input_count; ++i) {
+			if (!jobs[i].ok)
+				status = -1;
+		}
+	}
+
+done:
+	if (jobs) {
+		for (size_t i = 0; i < input_count; ++i)
+			free(jobs[i].output);
+		free(jobs);
+	}
+	if (owned) {
+		for (size_t i = 0; i < input_count; ++i)
+			free(owned[i]);
+		free(owned);
+	}
+	return status;
+}
+
 int main(int argc, const char *argv[])
 {
 	if (argc == 1) {
@@ -51,20 +246,86 @@ int main(int argc, const char *argv[])
 	int interpreter_mode = 0;
 	int jit_compiler_mode = 0;
 	int filename_index = -1;
+	OptimizeOptions opt_options = { OPTIMIZE_MAX_LEVEL, false, CELL_8 };
+	InterpreterOptions vm_options = { false, false };
+	int tiered_mode = 0;
+	bool jit_stats = false;
+	bool page_stats = false;
+	FlushPolicy flush_policy = OutputBuffer_default_policy();
+	EofPolicy eof_policy = EOF_MINUS_ONE;
+	bool vmsplice = true;
+	bool batch_mode = false;
+	VmLimits limits = { 0, 0.0 };
+	bool tape_left = false;
+	BatchOptions batch_options = { 0, EOF_MINUS_ONE, { 0, 0.0 }, false };
+	const char **batch_inputs = calloc((size_t)argc, sizeof(char *));
+	size_t batch_input_count = 0;
+	if (!batch_inputs) {
+		perror("Failed to allocate argument list");
+		return -1;
+	}
 
 	for (int i = 1; i < argc; ++i) {
 		if (strcmp(argv[i], "-i") == 0) {
 			interpreter_mode = 1;
 		} else if (strcmp(argv[i], "-j") == 0) {
 			jit_compiler_mode = 1;
+		} else if (strcmp(argv[i], "-t") == 0) {
+			tiered_mode = 1;
+		} else if (strncmp(argv[i], "-O", 2) == 0 &&
+			   argv[i][2] >= '0' &&
+			   argv[i][2] <= '0' + OPTIMIZE_MAX_LEVEL &&
+			   argv[i][3] == '\0') {
+			opt_options.level = argv[i][2] - '0';
+		} else if (strcmp(argv[i], "--time-passes") == 0) {
+			opt_options.time_passes = true;
+		} else if (strcmp(argv[i], "--jit-stats") == 0) {
+			jit_stats = true;
+		} else if (strcmp(argv[i], "--page-stats") == 0) {
+			page_stats = true;
+		} else if (strcmp(argv[i], "--no-huge-pages") == 0) {
+			huge_pages_set_enabled(false);
+		} else if (strcmp(argv[i], "--flush=line") == 0) {
+			flush_policy = FLUSH_LINE;
+		} else if (strcmp(argv[i], "--flush=full") == 0) {
+			flush_policy = FLUSH_FULL;
+		} else if (strcmp(argv[i], "--flush=none") == 0) {
+			flush_policy = FLUSH_NONE;
+		} else if (strcmp(argv[i], "--eof=-1") == 0) {
+			eof_policy = EOF_MINUS_ONE;
+		} else if (strcmp(argv[i], "--eof=0") == 0) {
+			eof_policy = EOF_ZERO;
+		} else if (strcmp(argv[i], "--eof=unchanged") == 0) {
+			eof_policy = EOF_UNCHANGED;
+		} else if (strcmp(argv[i], "--cell=8") == 0) {
+			opt_options.cell = CELL_8;
+		} else if (strcmp(argv[i], "--cell=16") == 0) {
+			opt_options.cell = CELL_16;
+		} else if (strcmp(argv[i], "--cell=32") == 0) {
+			opt_options.cell = CELL_32;
+		} else if (strcmp(argv[i], "--no-vmsplice") == 0) {
+			vmsplice = false;
+		} else if (strcmp(argv[i], "--superinsn-report") == 0) {
+			vm_options.superinsn_report = true;
+		} else if (strcmp(argv[i], "--batch") == 0) {
+			batch_mode = true;
+		} else if (strncmp(argv[i], "--threads=", 10) == 0 &&
+			   argv[i][10] >= '1' && argv[i][10] <= '9') {
+			batch_options.threads = strtoul(argv[i] + 10, NULL, 10);
+		} else if (strncmp(argv[i], "--fuel=", 7) == 0 &&
+			   argv[i][7] >= '1' && argv[i][7] <= '9') {
+			limits.fuel = strtoull(argv[i] + 7, NULL, 10);
+		} else if (strncmp(argv[i], "--timeout=", 10) == 0 &&
+			   strtod(argv[i] + 10, NULL) > 0) {
+			limits.timeout = strtod(argv[i] + 10, NULL);
+		} else if (strcmp(argv[i], "--tape-left") == 0) {
+			tape_left = true;
 		} else if (argv[i][0] != '-') {
-			if (filename_index != -1) {
-				fprintf(stderr,
-					"error: multiple filenames provided.\n\n");
-				usage();
-				return -1;
-			}
-			filename_index = i;
+			// Anything after the program is a --batch input
+			if (filename_index != -1)
+				batch_inputs[batch_input_count++] = argv[i];
+			else
+				filename_index = i;
 		} else {
 			fprintf(stderr, "error argument \"%s\"\n\n", argv[i]);
 			usage();
@@ -72,9 +333,9 @@ int main(int argc, const char *argv[])
 		}
 	}
 
-	if (!interpreter_mode && !jit_compiler_mode) {
+	if (!interpreter_mode && !jit_compiler_mode && !tiered_mode) {
 		fprintf(stderr,
-			"please choose an interpreter or JIT-compiler\n\n");
+			"please choose an interpreter, JIT-compiler or tiered mode\n\n");
 		usage();
 		return -1;
 	}
@@ -85,6 +346,18 @@ int main(int argc, const char *argv[])
 		return -1;
 	}
 
+	if (batch_input_count > 0 && !batch_mode) {
+		fprintf(stderr, "error: multiple filenames provided.\n\n");
+		usage();
+		return -1;
+	}
+
+	if (batch_mode && (interpreter_mode || tiered_mode)) {
+		fprintf(stderr, "--batch runs compiled code; use it with -j only\n\n");
+		usage();
+		return -1;
+	}
+
 	char *file_content = read_file_to_string(argv[filename_index]);
 	if (!file_content) {
 		fprintf(stderr, "cannot open or read file <%s>\n",
@@ -104,7 +377,7 @@ int main(int argc, const char *argv[])
 	free(file_content);
 	file_content = NULL;
 
-	if (!optimize(&code, &optimized_code)) {
+	if (!optimize_with(&code, &optimized_code, &opt_options)) {
 		fprintf(stderr, "Failed to optimize the code.\n");
 		OpcodeVector_free(&code);
 		return -1;
@@ -112,19 +385,72 @@ int main(int argc, const char *argv[])
 
 	OpcodeVector_free(&code); // We only need the optimized version now
 
+	if (batch_mode) {
+		batch_options.eof = eof_policy;
+		batch_options.limits = limits;
+		batch_options.tape_left = tape_left;
+		int status = run_batch(&optimized_code, opt_options.cell,
+				       batch_inputs, batch_input_count,
+				       &batch_options);
+		if (jit_stats)
+			fprintf(stderr,
+				"jit code cache: peak %zu KiB committed\n",
+				JitBuffer_peak_committed() / 1024);
+		if (page_stats)
+			page_stats_report(NULL);
+		free(batch_inputs);
+		OpcodeVector_free(&optimized_code);
+		return status;
+	}
+	free(batch_inputs);
+
+	// Static: a BfVm holds page-aligned output buffers
+	static BfVm vm;
+	if (!BfVm_init(&vm)) {
+		OpcodeVector_free(&optimized_code);
+		return -1;
+	}
+	OutputBuffer_init(&vm.out, 1, flush_policy);
+	if (!vmsplice)
+		vm.out.splice = false;
+	vm.in.eof = eof_policy;
+	vm.limits = limits;
+	vm.tape_left = tape_left;
+	vm.cell = opt_options.cell;
+
+	int exit_status = 0;
 	if (interpreter_mode) {
-		interpreter(&optimized_code);
+		VmStatus status =
+			interpreter_with(&vm, &optimized_code, &vm_options);
+		if (run_exit_status(&vm, status) != 0)
+			exit_status = -1;
+	}
+
+	if (tiered_mode) {
+		InterpreterOptions tiered_options = vm_options;
+		tiered_options.tiered = true;
+		VmStatus status = interpreter_with(&vm, &optimized_code,
+						   &tiered_options);
+		if (run_exit_status(&vm, status) != 0)
+			exit_status = -1;
 	}
 
 	if (jit_compiler_mode) {
-		if (!jit(&optimized_code)) {
-			fprintf(stderr,
-				"JIT compilation or execution failed.\n");
+		VmStatus status = jit_run(&vm, &optimized_code);
+		if (run_exit_status(&vm, status) != 0) {
+			BfVm_free(&vm);
 			OpcodeVector_free(&optimized_code);
 			return -1;
 		}
 	}
 
+	if (jit_stats)
+		fprintf(stderr, "jit code cache: peak %zu KiB committed\n",
+			JitBuffer_peak_committed() / 1024);
+	if (page_stats)
+		page_stats_report(&vm);
+
+	BfVm_free(&vm);
 	OpcodeVector_free(&optimized_code);
-	return 0;
+	return exit_status;
 }
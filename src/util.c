@@ -1,5 +1,13 @@
 #include "util.h"
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 void OpcodeVector_init(OpcodeVector *vec)
 {
 	vec->data = NULL;
@@ -88,27 +96,17 @@ void SizeTStack_free(SizeTStack *stk)
 	stk->capacity = 0;
 }
 
-void LambdaStack_init(LambdaStack *stk)
+void LambdaStack_init(LambdaStack *stk, Lambda *data, size_t capacity)
 {
-	stk->data = NULL;
+	stk->data = data;
 	stk->size = 0;
-	stk->capacity = 0;
+	stk->capacity = capacity;
 }
 
 bool LambdaStack_push(LambdaStack *stk, Lambda val)
 {
-	if (stk->size >= stk->capacity) {
-		size_t new_capacity =
-			stk->capacity == 0 ? 8 : stk->capacity * 2;
-		Lambda *new_data = (Lambda *)realloc(
-			stk->data, new_capacity * sizeof(Lambda));
-		if (!new_data) {
-			perror("Failed to reallocate lambda stack");
-			return false;
-		}
-		stk->data = new_data;
-		stk->capacity = new_capacity;
-	}
+	if (stk->size == stk->capacity)
+		return false;
 	stk->data[stk->size++] = val;
 	return true;
 }
@@ -122,35 +120,17 @@ bool LambdaStack_top(const LambdaStack *stk, Lambda *out_val)
 	return false;
 }
 
-void LambdaStack_free(LambdaStack *stk)
-{
-	free(stk->data);
-	stk->data = NULL;
-	stk->size = 0;
-	stk->capacity = 0;
-}
-
-void CallStack_init(CallStack *stk)
+void CallStack_init(CallStack *stk, CallFrame *data, size_t capacity)
 {
-	stk->data = NULL;
+	stk->data = data;
 	stk->size = 0;
-	stk->capacity = 0;
+	stk->capacity = capacity;
 }
 
 bool CallStack_push(CallStack *stk, CallFrame val)
 {
-	if (stk->size >= stk->capacity) {
-		size_t new_capacity =
-			stk->capacity == 0 ? 8 : stk->capacity * 2;
-		CallFrame *new_data = (CallFrame *)realloc(
-			stk->data, new_capacity * sizeof(CallFrame));
-		if (!new_data) {
-			perror("Failed to reallocate call stack");
-			return false;
-		}
-		stk->data = new_data;
-		stk->capacity = new_capacity;
-	}
+	if (stk->size == stk->capacity)
+		return false;
 	stk->data[stk->size++] = val;
 	return true;
 }
@@ -165,10 +145,122 @@ bool CallStack_pop(CallStack *stk, CallFrame *out_val)
 	return false;
 }
 
-void CallStack_free(CallStack *stk)
+static bool g_huge_pages_enabled = true;
+
+void huge_pages_set_enabled(bool enabled)
 {
-	free(stk->data);
-	stk->data = NULL;
-	stk->size = 0;
-	stk->capacity = 0;
+	g_huge_pages_enabled = enabled;
+}
+
+size_t base_page_size(void)
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	long page = sysconf(_SC_PAGESIZE);
+	return page > 0 ? (size_t)page : 4096;
+#endif
+}
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+static pthread_once_t g_huge_page_once = PTHREAD_ONCE_INIT;
+static size_t g_huge_page_size;
+
+/**
+ * @brief Reads the transparent huge page size, unless the kernel has them
+ * switched off ("never"), in which case advising would gain nothing.
+ */
+static void huge_page_probe(void)
+{
+	FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if (!f)
+		return;
+	char mode[128];
+	bool never = !fgets(mode, sizeof(mode), f) || strstr(mode, "[never]");
+	fclose(f);
+	if (never)
+		return;
+	f = fopen("/sys/kernel/mm/transparent_hugepage/hpage_pmd_size", "r");
+	if (!f)
+		return;
+	unsigned long long size;
+	if (fscanf(f, "%llu", &size) == 1 && size > base_page_size() &&
+	    (size & (size - 1)) == 0)
+		g_huge_page_size = (size_t)size;
+	fclose(f);
+}
+#endif
+
+size_t huge_page_size(void)
+{
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if (!g_huge_pages_enabled)
+		return 0;
+	pthread_once(&g_huge_page_once, huge_page_probe);
+	return g_huge_page_size;
+#else
+	return 0;
+#endif
+}
+
+#ifndef _WIN32
+void *huge_pages_reserve(size_t size)
+{
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+#ifdef MADV_HUGEPAGE
+	size_t huge = huge_page_size();
+	if (huge) {
+		// Over-reserve by one huge page and trim both ends, leaving an
+		// aligned range. Without room for that, fall back to base pages.
+		uint8_t *map = mmap(NULL, size + huge, PROT_NONE, flags, -1, 0);
+		if (map != MAP_FAILED) {
+			uintptr_t start = ((uintptr_t)map + huge - 1) &
+					  ~(uintptr_t)(huge - 1);
+			size_t head = start - (uintptr_t)map;
+			if (head)
+				munmap(map, head);
+			munmap((uint8_t *)start + size, huge - head);
+			// A kernel that refuses just keeps base pages
+			madvise((void *)start, size, MADV_HUGEPAGE);
+			return (void *)start;
+		}
+	}
+#endif
+	void *map = mmap(NULL, size, PROT_NONE, flags, -1, 0);
+	return map == MAP_FAILED ? NULL : map;
+}
+#endif
+
+bool PageUsage_measure(const void *addr, size_t size, PageUsage *usage)
+{
+	usage->resident = usage->huge = 0;
+#ifdef __linux__
+	FILE *f = fopen("/proc/self/smaps", "r");
+	if (!f)
+		return false;
+	uintptr_t lo = (uintptr_t)addr;
+	uintptr_t hi = lo + size;
+	bool inside = false;
+	char line[512];
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long long start, end, kib;
+		// Each mapping starts with its "start-end perms ..." line,
+		// followed by one "Field: value" line per counter
+		if (sscanf(line, "%llx-%llx ", &start, &end) == 2)
+			inside = start < hi && end > lo;
+		else if (inside && sscanf(line, "Rss: %llu kB", &kib) == 1)
+			usage->resident += (size_t)kib * 1024;
+		else if (inside &&
+			 sscanf(line, "AnonHugePages: %llu kB", &kib) == 1)
+			usage->huge += (size_t)kib * 1024;
+	}
+	fclose(f);
+	return true;
+#else
+	(void)addr;
+	(void)size;
+	return false;
+#endif
 }
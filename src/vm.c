@@ -1,131 +1,1117 @@
 #include "vm.h"
+#include "tier.h"
 
-// Define the global VM state
-uint8_t g_bf_mem[0x20000];
-LambdaStack g_lambda_stack;
-CallStack g_call_stack;
+#ifdef _WIN32
+#include <io.h>
+#define read _read
+#define write _write
+#define isatty _isatty
+#else
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <ucontext.h>
+#endif
+#endif
 
-void interpreter(const OpcodeVector *code)
+/**
+ * @brief Whether vmsplice can safely hand page sets to `fd`: it must be a
+ * pipe whose capacity is at most one page set.
+ */
+static bool output_can_splice(int fd)
 {
-	clock_t begin = clock();
-	memset(g_bf_mem, 0, sizeof(g_bf_mem));
+#ifdef __linux__
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISFIFO(st.st_mode))
+		return false;
+	// Fails harmlessly if the pipe currently holds more than this
+	fcntl(fd, F_SETPIPE_SZ, BF_OUT_BUFFER_SIZE);
+	int size = fcntl(fd, F_GETPIPE_SZ);
+	return size > 0 && size <= BF_OUT_BUFFER_SIZE;
+#else
+	(void)fd;
+	return false;
+#endif
+}
 
-	// Initialize runtime stacks
-	LambdaStack_init(&g_lambda_stack);
-	CallStack_init(&g_call_stack);
+static void output_reset(OutputBuffer *out)
+{
+	out->pos = out->start;
+	out->limit = out->policy == FLUSH_NONE ? out->start :
+						 out->start + BF_OUT_BUFFER_SIZE;
+}
 
-	uint32_t p = 0;
-	size_t pc = 0;
+void OutputBuffer_init(OutputBuffer *out, int fd, FlushPolicy policy)
+{
+	out->fd = fd;
+	out->policy = policy;
+	out->start = out->data[0];
+	out->splice = policy == FLUSH_FULL && output_can_splice(fd);
+	out->sink = NULL;
+	out->sink_ctx = NULL;
+	output_reset(out);
+}
 
-	while (pc < code->size) {
-		const opcode *op = &code->data[pc];
-		switch (op->op) {
-		case op_add:
-			g_bf_mem[p] += op->num;
-			pc++;
-			break;
-		case op_sub:
-			g_bf_mem[p] -= op->num;
-			pc++;
-			break;
-		case op_addp:
-			p += op->num;
-			pc++;
-			break;
-		case op_subp:
-			p -= op->num;
-			pc++;
-			break;
-		case op_jt:
-			if (g_bf_mem[p])
-				pc = op->num;
-			else
-				pc++;
-			break;
-		case op_jf:
-			if (!g_bf_mem[p])
-				pc = op->num;
-			else
-				pc++;
-			break;
-		case op_in:
-			g_bf_mem[p] = getchar();
-			pc++;
-			break;
-		case op_out:
-			putchar(g_bf_mem[p]);
-			pc++;
-			break;
-		case op_clear:
-			g_bf_mem[p] = 0;
-			pc++;
-			break;
+void OutputBuffer_init_sink(OutputBuffer *out, OutputSink sink, void *ctx,
+			    FlushPolicy policy)
+{
+	out->fd = -1;
+	out->policy = policy;
+	out->start = out->data[0];
+	out->splice = false;
+	out->sink = sink;
+	out->sink_ctx = ctx;
+	output_reset(out);
+}
 
-		case op_def_lambda: {
-			Lambda lambda;
-			lambda.start_pc =
-				pc + 1; // Code starts after this opcode
-			lambda.captured_p = p; // Capture current data pointer
-			lambda.jit_addr = 0; // Not used by interpreter
-
-			if (!LambdaStack_push(&g_lambda_stack, lambda)) {
-				fprintf(stderr,
-					"Interpreter runtime error: Lambda stack overflow\n");
-				goto cleanup;
+bool OutputBuffer_flush(OutputBuffer *out)
+{
+	const uint8_t *p = out->start;
+	bool spliced = false;
+	bool ok = true;
+	if (out->sink) {
+		if (out->pos > p)
+			ok = out->sink(out->sink_ctx, p, (size_t)(out->pos - p));
+		output_reset(out);
+		return ok;
+	}
+#ifdef __linux__
+	if (out->splice && out->pos == out->start + BF_OUT_BUFFER_SIZE) {
+		while (p < out->pos) {
+			struct iovec iov = { (void *)p, (size_t)(out->pos - p) };
+			ssize_t n = vmsplice(out->fd, &iov, 1, 0);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				// Copy the rest from now on
+				out->splice = false;
+				break;
 			}
-			pc = op->num; // Jump past the function body
+			p += n;
+			spliced = true;
+		}
+	}
+#endif
+	while (p < out->pos) {
+		ssize_t n = write(out->fd, p, (size_t)(out->pos - p));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write");
+			ok = false;
 			break;
 		}
+		p += n;
+	}
+	// The pipe may still reference this set's pages; fill the other one
+	if (spliced)
+		out->start = out->start == out->data[0] ? out->data[1] :
+							  out->data[0];
+	output_reset(out);
+	return ok;
+}
 
-		case op_ret: {
-			CallFrame frame;
-			if (!CallStack_pop(&g_call_stack, &frame)) {
-				fprintf(stderr,
-					"Interpreter runtime error: ')' without matching '!' call.\n");
-				goto cleanup;
-			}
-			pc = frame.return_pc;
-			p = frame.saved_p;
-			break;
+FlushPolicy OutputBuffer_default_policy(void)
+{
+	return isatty(1) ? FLUSH_LINE : FLUSH_FULL;
+}
+
+void InputBuffer_init(InputBuffer *in, int fd, EofPolicy eof)
+{
+	InputBuffer_free(in);
+	in->eof = eof;
+	in->fd = fd;
+	in->source = NULL;
+	in->source_ctx = NULL;
+#ifndef _WIN32
+	struct stat st;
+	off_t start = lseek(fd, 0, SEEK_CUR);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && start >= 0 &&
+	    st.st_size > start) {
+		void *map = mmap(NULL, (size_t)st.st_size, PROT_READ,
+				 MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+			in->map = (uint8_t *)map;
+			in->map_size = (size_t)st.st_size;
+			in->pos = in->map + start;
+			in->end = in->map + in->map_size;
+			// Everything is already visible; refills only report EOF
+			in->at_eof = true;
 		}
+	}
+#endif
+}
 
-		case op_call: {
-			Lambda lambda;
-			if (!LambdaStack_top(&g_lambda_stack, &lambda)) {
-				fprintf(stderr,
-					"Interpreter runtime error: '!' call with no defined lambda.\n");
-				goto cleanup;
-			}
+void InputBuffer_init_memory(InputBuffer *in, const uint8_t *data,
+			     size_t size, EofPolicy eof)
+{
+	InputBuffer_free(in);
+	in->eof = eof;
+	in->fd = -1;
+	in->source = NULL;
+	in->source_ctx = NULL;
+	in->pos = data;
+	in->end = data ? data + size : data;
+	in->at_eof = true;
+}
 
-			CallFrame frame;
-			frame.return_pc =
-				pc +
-				1;
-			frame.saved_p = p;
+void InputBuffer_init_source(InputBuffer *in, InputSource source, void *ctx,
+			     EofPolicy eof)
+{
+	InputBuffer_free(in);
+	in->eof = eof;
+	in->fd = -1;
+	in->source = source;
+	in->source_ctx = ctx;
+}
 
-			if (!CallStack_push(&g_call_stack, frame)) {
-				fprintf(stderr,
-					"Interpreter runtime error: Call stack overflow\n");
-				goto cleanup;
-			}
+void InputBuffer_free(InputBuffer *in)
+{
+#ifndef _WIN32
+	if (in->map)
+		munmap(in->map, in->map_size);
+#endif
+	free(in->buffer);
+	in->map = NULL;
+	in->map_size = 0;
+	in->buffer = NULL;
+	in->pos = in->end = NULL;
+	in->at_eof = false;
+}
 
-			pc = lambda.start_pc;
-			p = lambda.captured_p;
-			break;
+bool InputBuffer_refill(InputBuffer *in)
+{
+	if (in->at_eof)
+		return false;
+	if (in->buffer == NULL) {
+		in->buffer = (uint8_t *)malloc(BF_IN_BUFFER_SIZE);
+		if (in->buffer == NULL) {
+			perror("Failed to allocate input buffer");
+			in->at_eof = true;
+			return false;
+		}
+	}
+	if (in->tied && in->tied->policy == FLUSH_LINE)
+		OutputBuffer_flush(in->tied);
+	for (;;) {
+		ssize_t n = in->source ? (ssize_t)in->source(in->source_ctx,
+							     in->buffer,
+							     BF_IN_BUFFER_SIZE) :
+					 read(in->fd, in->buffer,
+					      BF_IN_BUFFER_SIZE);
+		if (n > 0) {
+			in->pos = in->buffer;
+			in->end = in->buffer + n;
+			return true;
 		}
+		if (n < 0 && !in->source && errno == EINTR)
+			continue;
+		if (n < 0 && !in->source)
+			perror("read");
+		in->at_eof = true;
+		return false;
+	}
+}
+
+int32_t InputBuffer_read_slow(InputBuffer *in)
+{
+	int c = InputBuffer_get(in);
+	if (c >= 0)
+		return c;
+	switch (in->eof) {
+	case EOF_ZERO:
+		return 0;
+	case EOF_UNCHANGED:
+		return BF_IN_KEEP_CELL;
+	default:
+		return -1;
+	}
+}
+
+static bool discard_output(void *ctx, const uint8_t *data, size_t size)
+{
+	(void)ctx;
+	(void)data;
+	(void)size;
+	return true;
+}
+
+#ifndef _WIN32
+/* The VM whose program this thread is running, for the fault handler. */
+static _Thread_local BfVm *g_guarded_vm;
+static struct sigaction g_prev_segv_action, g_prev_bus_action;
+static pthread_once_t g_fault_handler_once = PTHREAD_ONCE_INIT;
+
+static bool tape_guard_holds(const BfVm *vm, uintptr_t addr)
+{
+	uintptr_t left = (uintptr_t)vm->tape_map;
+	uintptr_t tape = (uintptr_t)vm->tape;
+	return (addr >= left && addr < tape) ||
+	       (addr >= tape + vm->tape_size &&
+		addr < tape + vm->tape_size + BF_TAPE_GUARD);
+}
 
-		default:
-			fprintf(stderr, "Unknown opcode: %d\n", op->op);
-			pc++;
+/*
+ * Where the handler can read the faulting instruction, to tell which op of
+ * a JIT program made the access. Elsewhere only the cell is reported.
+ */
+#if defined(__linux__) && defined(__x86_64__)
+#define FAULT_PC(uc) ((uc)->uc_mcontext.gregs[REG_RIP])
+#elif defined(__linux__) && defined(__aarch64__)
+#define FAULT_PC(uc) ((uc)->uc_mcontext.pc)
+#endif
+
+/**
+ * @brief SIGSEGV/SIGBUS handler. An access by the guarded program on this
+ * thread to a guard stops the run with VM_TAPE_FAULT, unwinding to its
+ * BF_TAPE_FAULTED(). Any other fault goes to the handler that was
+ * installed before. The tape itself never faults, so a run that stays on
+ * it works even where the host has replaced this handler with its own.
+ */
+static void tape_fault_handler(int sig, siginfo_t *info, void *context)
+{
+	BfVm *vm = g_guarded_vm;
+	uintptr_t addr = (uintptr_t)info->si_addr;
+	if (vm && tape_guard_holds(vm, addr)) {
+		vm->fault_op = BF_NO_OP;
+#ifdef FAULT_PC
+		const JitBuffer *code = vm->native_code;
+		uintptr_t pc = (uintptr_t)FAULT_PC((ucontext_t *)context);
+		uintptr_t base = code ? (uintptr_t)code->buffer : 0;
+		if (code && pc >= base && pc < base + code->size)
+			vm->fault_op = JitBuffer_opcode_at(code, pc - base);
+#endif
+		// Cells are aligned, so the access starts on a cell boundary
+		vm->fault_cell = (ptrdiff_t)(addr - (uintptr_t)vm->mem) /
+				 (ptrdiff_t)CellWidth_bytes(vm->cell);
+		vm->status = VM_TAPE_FAULT;
+		g_guarded_vm = NULL;
+		siglongjmp(vm->fault_jmp, 1);
+	}
+
+	const struct sigaction *prev = sig == SIGSEGV ? &g_prev_segv_action :
+							&g_prev_bus_action;
+	if (prev->sa_flags & SA_SIGINFO) {
+		prev->sa_sigaction(sig, info, context);
+	} else if (prev->sa_handler != SIG_DFL &&
+		   prev->sa_handler != SIG_IGN) {
+		prev->sa_handler(sig);
+	} else {
+		// Returning retries the access, which now takes the default
+		// action
+		signal(sig, SIG_DFL);
+	}
+}
+
+static void install_fault_handler(void)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = tape_fault_handler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGSEGV, &sa, &g_prev_segv_action) != 0 ||
+	    sigaction(SIGBUS, &sa, &g_prev_bus_action) != 0)
+		perror("sigaction");
+}
+#endif
+
+#ifdef __linux__
+/* native_stack_floor() of this thread, once known. */
+static _Thread_local uint8_t *g_stack_floor;
+static _Thread_local bool g_stack_floor_known;
+#endif
+
+/**
+ * @brief The lowest address this thread's stack may grow to, less
+ * BF_JIT_STACK_MARGIN, or NULL where that is unknown. Looked up once per
+ * thread: for the main thread glibc reads /proc/self/maps.
+ */
+static uint8_t *native_stack_floor(void)
+{
+#ifdef __linux__
+	if (g_stack_floor_known)
+		return g_stack_floor;
+	g_stack_floor_known = true;
+	pthread_attr_t attr;
+	if (pthread_getattr_np(pthread_self(), &attr) != 0)
+		return NULL;
+	void *low;
+	size_t size;
+	if (pthread_attr_getstack(&attr, &low, &size) == 0 &&
+	    size > BF_JIT_STACK_MARGIN)
+		g_stack_floor = (uint8_t *)low + BF_JIT_STACK_MARGIN;
+	pthread_attr_destroy(&attr);
+	return g_stack_floor;
+#else
+	return NULL;
+#endif
+}
+
+void vm_guard_enter(BfVm *vm, const JitBuffer *code)
+{
+	vm->native_code = code;
+	if (code)
+		vm->jit_stack_floor = native_stack_floor();
+#ifndef _WIN32
+	g_guarded_vm = vm;
+#endif
+}
+
+void vm_guard_leave(BfVm *vm)
+{
+	vm->native_code = NULL;
+#ifndef _WIN32
+	g_guarded_vm = NULL;
+#endif
+}
+
+/**
+ * @brief Maps `size` cells between two inaccessible BF_TAPE_GUARD regions.
+ * The cells are readable and writable but MAP_NORESERVE, so the kernel
+ * commits zeroed pages only where a run first touches them, and where it
+ * offers them they are advised for huge pages. Windows commits the tape
+ * itself up front.
+ */
+static uint8_t *tape_reserve(size_t size)
+{
+#ifdef _WIN32
+	uint8_t *map = VirtualAlloc(NULL, BF_TAPE_GUARD + size + BF_TAPE_GUARD,
+				    MEM_RESERVE, PAGE_NOACCESS);
+	if (!map)
+		return NULL;
+	if (!VirtualAlloc(map + BF_TAPE_GUARD, size, MEM_COMMIT,
+			  PAGE_READWRITE)) {
+		VirtualFree(map, 0, MEM_RELEASE);
+		return NULL;
+	}
+	return map;
+#else
+	// The guards are whole huge pages, so an aligned mapping aligns the
+	// tape too
+	uint8_t *map = huge_pages_reserve(BF_TAPE_GUARD + size + BF_TAPE_GUARD);
+	if (map &&
+	    mprotect(map + BF_TAPE_GUARD, size, PROT_READ | PROT_WRITE) != 0) {
+		munmap(map, BF_TAPE_GUARD + size + BF_TAPE_GUARD);
+		return NULL;
+	}
+	return map;
+#endif
+}
+
+#ifndef _WIN32
+static size_t tape_keep_size(void)
+{
+	size_t page = base_page_size();
+	return BF_TAPE_KEEP_SIZE > page ? BF_TAPE_KEEP_SIZE : page;
+}
+
+/**
+ * @brief Keeps the huge page holding the cells a run starts on, at cell 0
+ * and at the middle of the tape, on base pages: most runs touch only a
+ * few of them, and faulting in and clearing a whole huge page would cost
+ * such a run more than its TLB misses.
+ */
+static void tape_keep_base_pages(const BfVm *vm)
+{
+#ifdef MADV_NOHUGEPAGE
+	if (!vm->tape_huge_page)
+		return;
+	madvise(vm->tape, vm->tape_huge_page, MADV_NOHUGEPAGE);
+	madvise(vm->tape + vm->tape_size / 2, vm->tape_huge_page,
+		MADV_NOHUGEPAGE);
+#else
+	(void)vm;
+#endif
+}
+#endif
+
+/**
+ * @brief Maps the tape: BF_TAPE_SIZE cells, or the largest power-of-two
+ * fraction of it the address space has room for.
+ */
+static bool tape_map(BfVm *vm)
+{
+#ifndef _WIN32
+	pthread_once(&g_fault_handler_once, install_fault_handler);
+#endif
+	for (size_t size = BF_TAPE_SIZE; size >= BF_TAPE_MIN_SIZE; size /= 2) {
+		uint8_t *map = tape_reserve(size);
+		if (!map)
+			continue;
+		vm->tape_map = map;
+		vm->tape = map + BF_TAPE_GUARD;
+		vm->tape_size = size;
+		vm->mem = vm->tape;
+		vm->tape_dirty = false;
+		size_t huge = huge_page_size();
+		vm->tape_huge_page =
+			huge && ((uintptr_t)vm->tape & (huge - 1)) == 0 ? huge :
+									  0;
+#ifndef _WIN32
+		tape_keep_base_pages(vm);
+#endif
+		return true;
+	}
+#ifdef _WIN32
+	fprintf(stderr, "Failed to reserve the tape\n");
+#else
+	perror("Failed to map the tape");
+#endif
+	return false;
+}
+
+#ifndef _WIN32
+/**
+ * @brief Hands the pages of tape[from, to) back to the kernel, which
+ * refills them with zeroes when they are next touched. Costs next to
+ * nothing where a run never went.
+ */
+static bool tape_drop(uint8_t *from, uint8_t *to)
+{
+	if (from >= to)
+		return true;
+#ifdef __linux__
+	// Linux refills dropped private anonymous pages with zeroes
+	return madvise(from, (size_t)(to - from), MADV_DONTNEED) == 0;
+#else
+	// Elsewhere MADV_DONTNEED may keep the contents; map fresh pages over
+	// the old ones instead
+	return mmap(from, (size_t)(to - from), PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+		    -1, 0) != MAP_FAILED;
+#endif
+}
+#endif
+
+/**
+ * @brief Zeroes what the last run may have written. The tape_keep_size()
+ * cells from its cell 0 are cleared with a memset, which is cheaper than
+ * faulting their pages back in, and cover all of a short run; everything
+ * else is dropped, so the next run again commits only what it touches.
+ */
+static void tape_clear(BfVm *vm)
+{
+#ifdef _WIN32
+	memset(vm->tape, 0, vm->tape_size);
+#else
+	uint8_t *tape_end = vm->tape + vm->tape_size;
+	size_t room = (size_t)(tape_end - vm->mem);
+	uint8_t *keep_end = vm->mem + (tape_keep_size() < room ?
+						tape_keep_size() :
+						room);
+	memset(vm->mem, 0, (size_t)(keep_end - vm->mem));
+	if (!tape_drop(vm->tape, vm->mem) || !tape_drop(keep_end, tape_end))
+		perror("Failed to clear the tape");
+#endif
+}
+
+static void tape_unmap(BfVm *vm)
+{
+	if (!vm->tape_map)
+		return;
+#ifdef _WIN32
+	VirtualFree(vm->tape_map, 0, MEM_RELEASE);
+#else
+	munmap(vm->tape_map, BF_TAPE_GUARD + vm->tape_size + BF_TAPE_GUARD);
+#endif
+	vm->tape_map = NULL;
+	vm->tape = NULL;
+	vm->mem = NULL;
+}
+
+static size_t round_to_page(size_t size)
+{
+	size_t page = base_page_size();
+	return (size + page - 1) / page * page;
+}
+
+/**
+ * @brief Maps the arena for the lambda and call stacks: the lambda
+ * entries, a guard page, the call frames and another guard page. The
+ * kernel commits the stack pages as the program first uses them.
+ */
+static bool stacks_map(BfVm *vm)
+{
+	size_t page = base_page_size();
+	size_t lambdas = round_to_page(BF_LAMBDA_DEPTH * sizeof(Lambda));
+	size_t frames = round_to_page(BF_CALL_DEPTH * sizeof(CallFrame));
+	size_t size = lambdas + page + frames + page;
+#ifdef _WIN32
+	uint8_t *map = VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+	if (!map || !VirtualAlloc(map, lambdas, MEM_COMMIT, PAGE_READWRITE) ||
+	    !VirtualAlloc(map + lambdas + page, frames, MEM_COMMIT,
+			  PAGE_READWRITE)) {
+		if (map)
+			VirtualFree(map, 0, MEM_RELEASE);
+		fprintf(stderr, "Failed to reserve the lambda and call stacks\n");
+		return false;
+	}
+#else
+	uint8_t *map = mmap(NULL, size, PROT_NONE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED ||
+	    mprotect(map, lambdas, PROT_READ | PROT_WRITE) != 0 ||
+	    mprotect(map + lambdas + page, frames, PROT_READ | PROT_WRITE) !=
+		    0) {
+		perror("Failed to map the lambda and call stacks");
+		if (map != MAP_FAILED)
+			munmap(map, size);
+		return false;
+	}
+#endif
+	vm->stack_map = map;
+	vm->stack_map_size = size;
+	LambdaStack_init(&vm->lambda_stack, (Lambda *)map, BF_LAMBDA_DEPTH);
+	CallStack_init(&vm->call_stack, (CallFrame *)(map + lambdas + page),
+		       BF_CALL_DEPTH);
+	return true;
+}
+
+static void stacks_unmap(BfVm *vm)
+{
+	if (!vm->stack_map)
+		return;
+#ifdef _WIN32
+	VirtualFree(vm->stack_map, 0, MEM_RELEASE);
+#else
+	munmap(vm->stack_map, vm->stack_map_size);
+#endif
+	vm->stack_map = NULL;
+}
+
+bool BfVm_init_unconnected(BfVm *vm)
+{
+	vm->fuel_slice = INT64_MAX;
+	vm->jit_exit_sp = NULL;
+	vm->fuel_left = 0;
+	atomic_init(&vm->timed_out, false);
+	vm->status = VM_OK;
+	vm->limits = (VmLimits){ 0, 0.0 };
+#ifndef _WIN32
+	vm->timer_armed = false;
+#endif
+	vm->native_code = NULL;
+	vm->jit_stack_floor = NULL;
+	vm->fault_cell = 0;
+	vm->fault_op = BF_NO_OP;
+	vm->tape_left = false;
+	vm->cell = CELL_8;
+	if (!tape_map(vm))
+		return false;
+	if (!stacks_map(vm)) {
+		tape_unmap(vm);
+		return false;
+	}
+	OutputBuffer_init_sink(&vm->out, discard_output, NULL, FLUSH_FULL);
+	memset(&vm->in, 0, sizeof(vm->in));
+	InputBuffer_init_memory(&vm->in, NULL, 0, EOF_MINUS_ONE);
+	vm->in.tied = &vm->out;
+	return true;
+}
+
+bool BfVm_init(BfVm *vm)
+{
+	if (!BfVm_init_unconnected(vm))
+		return false;
+	OutputBuffer_init(&vm->out, 1, OutputBuffer_default_policy());
+	InputBuffer_init(&vm->in, 0, EOF_MINUS_ONE);
+	return true;
+}
+
+void BfVm_free(BfVm *vm)
+{
+	OutputBuffer_flush(&vm->out);
+	InputBuffer_free(&vm->in);
+	stacks_unmap(vm);
+	tape_unmap(vm);
+}
+
+void BfVm_reset(BfVm *vm)
+{
+	if (vm->tape_dirty)
+		tape_clear(vm);
+	vm->tape_dirty = false;
+	vm->lambda_stack.size = 0;
+	vm->call_stack.size = 0;
+}
+
+#ifndef _WIN32
+#ifdef SIGRTMIN
+#define BF_TIMEOUT_SIGNAL SIGRTMIN
+#else
+#define BF_TIMEOUT_SIGNAL SIGALRM
+#endif
+
+static void timeout_handler(int sig, siginfo_t *info, void *context)
+{
+	(void)sig;
+	(void)context;
+	BfVm *vm = info->si_value.sival_ptr;
+	if (info->si_code == SI_TIMER && vm)
+		atomic_store_explicit(&vm->timed_out, true,
+				      memory_order_relaxed);
+}
+
+static pthread_once_t g_timeout_handler_once = PTHREAD_ONCE_INIT;
+static bool g_timeout_handler_ok;
+
+static void install_timeout_handler(void)
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = timeout_handler;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	g_timeout_handler_ok = sigaction(BF_TIMEOUT_SIGNAL, &sa, NULL) == 0;
+	if (!g_timeout_handler_ok)
+		perror("sigaction");
+}
+
+/**
+ * @brief Starts a one-shot timer that flags `vm` as timed out. On Linux
+ * the signal goes to the calling thread, the one running the program, so
+ * once the timer is deleted no handler can still be touching `vm`.
+ */
+static void arm_timeout(BfVm *vm)
+{
+	pthread_once(&g_timeout_handler_once, install_timeout_handler);
+	if (!g_timeout_handler_ok)
+		return;
+
+	struct sigevent sev;
+	memset(&sev, 0, sizeof(sev));
+	sev.sigev_signo = BF_TIMEOUT_SIGNAL;
+	sev.sigev_value.sival_ptr = vm;
+#ifdef __linux__
+	sev.sigev_notify = SIGEV_THREAD_ID;
+#ifdef sigev_notify_thread_id
+	sev.sigev_notify_thread_id = (pid_t)syscall(SYS_gettid);
+#else
+	sev._sigev_un._tid = (pid_t)syscall(SYS_gettid);
+#endif
+#else
+	sev.sigev_notify = SIGEV_SIGNAL;
+#endif
+	if (timer_create(CLOCK_MONOTONIC, &sev, &vm->timer) != 0) {
+		perror("timer_create: running without a timeout");
+		return;
+	}
+	double whole = (double)(time_t)vm->limits.timeout;
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = (time_t)whole;
+	its.it_value.tv_nsec = (long)((vm->limits.timeout - whole) * 1e9);
+	if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+		its.it_value.tv_nsec = 1;
+	timer_settime(vm->timer, 0, &its, NULL);
+	vm->timer_armed = true;
+}
+#endif
+
+void BfVm_start(BfVm *vm)
+{
+	BfVm_reset(vm);
+	vm->mem = vm->tape + (vm->tape_left ? vm->tape_size / 2 : 0);
+	vm->tape_dirty = true;
+	vm->status = VM_OK;
+	vm->jit_exit_sp = NULL;
+	vm->fault_cell = 0;
+	vm->fault_op = BF_NO_OP;
+	atomic_store_explicit(&vm->timed_out, false, memory_order_relaxed);
+
+	// With no limit at all the slice never runs out
+	vm->fuel_slice = INT64_MAX;
+	vm->fuel_left = 0;
+	if (vm->limits.fuel) {
+		uint64_t slice = vm->limits.fuel < BF_FUEL_SLICE ?
+					 vm->limits.fuel :
+					 BF_FUEL_SLICE;
+		vm->fuel_slice = (int64_t)slice;
+		vm->fuel_left = vm->limits.fuel - slice;
+	} else if (vm->limits.timeout > 0) {
+		vm->fuel_slice = BF_FUEL_SLICE;
+	}
+
+	if (vm->limits.timeout > 0) {
+#ifndef _WIN32
+		arm_timeout(vm);
+#else
+		fprintf(stderr, "timeouts are not supported on Windows\n");
+#endif
+	}
+}
+
+VmStatus BfVm_finish(BfVm *vm)
+{
+#ifndef _WIN32
+	if (vm->timer_armed) {
+		timer_delete(vm->timer);
+		vm->timer_armed = false;
+	}
+#endif
+	bool flushed = OutputBuffer_flush(&vm->out);
+	if (vm->status == VM_OK && !flushed)
+		vm->status = VM_OUTPUT_FAILED;
+	return vm->status;
+}
+
+bool vm_fuel_trap(BfVm *vm)
+{
+	if (atomic_load_explicit(&vm->timed_out, memory_order_relaxed)) {
+		vm->status = VM_TIMEOUT;
+		return true;
+	}
+	// The check that trapped takes the first unit of the new slice
+	if (vm->limits.fuel == 0) {
+		vm->fuel_slice = BF_FUEL_SLICE - 1;
+		return false;
+	}
+	if (vm->fuel_left == 0) {
+		vm->status = VM_OUT_OF_FUEL;
+		return true;
+	}
+	uint64_t slice = vm->fuel_left < BF_FUEL_SLICE ? vm->fuel_left :
+							 BF_FUEL_SLICE;
+	vm->fuel_left -= slice;
+	vm->fuel_slice = (int64_t)slice - 1;
+	return false;
+}
+
+const char *VmStatus_string(VmStatus status)
+{
+	switch (status) {
+	case VM_OK:
+		return "ok";
+	case VM_OUT_OF_FUEL:
+		return "out of fuel";
+	case VM_TIMEOUT:
+		return "timed out";
+	case VM_OUTPUT_FAILED:
+		return "output could not be written";
+	case VM_TAPE_FAULT:
+		return "pointer left the tape";
+	case VM_COMPILE_FAILED:
+		return "JIT compilation failed";
+	case VM_STACK_OVERFLOW:
+		return "lambda or call stack overflow";
+	case VM_NO_LAMBDA:
+		return "'!' with no lambda defined";
+	}
+	return "unknown status";
+}
+
+void vm_putchar(BfVm *vm, int c)
+{
+	OutputBuffer_put(&vm->out, (uint8_t)c);
+}
+
+uint32_t vm_read_cell(BfVm *vm, uint32_t cell)
+{
+	return InputBuffer_read_cell(&vm->in, cell);
+}
+
+
+/*
+ * The lambda ops update pc/p through a VmPos copy rather than through
+ * pointers to the dispatch loop's locals: taking their address would force
+ * pc and p out of registers for the whole loop, since every tape store may
+ * alias them.
+ */
+typedef struct {
+	size_t pc;
+	ptrdiff_t p;
+} VmPos;
+
+/**
+ * @brief Pushes a lambda whose body starts after the op at `pc` and jumps
+ * past the body.
+ */
+static bool exec_def_lambda(BfVm *vm, const opcode *op, VmPos *pos)
+{
+	Lambda lambda;
+	lambda.start_pc = pos->pc + 1; // Code starts after this opcode
+	lambda.captured_p = pos->p; // Capture current data pointer
+	lambda.jit_addr = 0; // Not used by interpreter
+
+	if (!LambdaStack_push(&vm->lambda_stack, lambda)) {
+		vm->status = VM_STACK_OVERFLOW;
+		return false;
+	}
+	pos->pc = op->num; // Jump past the function body
+	return true;
+}
+
+static bool exec_ret(BfVm *vm, VmPos *pos)
+{
+	CallFrame frame;
+	if (!CallStack_pop(&vm->call_stack, &frame)) {
+		fprintf(stderr,
+			"Interpreter runtime error: ')' without matching '!' call.\n");
+		return false;
+	}
+	pos->pc = frame.return_pc;
+	pos->p = frame.saved_p;
+	return true;
+}
+
+static bool exec_call(BfVm *vm, VmPos *pos)
+{
+	Lambda lambda;
+	if (!LambdaStack_top(&vm->lambda_stack, &lambda)) {
+		vm->status = VM_NO_LAMBDA;
+		return false;
+	}
+
+	CallFrame frame;
+	frame.return_pc = pos->pc + 1;
+	frame.saved_p = pos->p;
+
+	if (!CallStack_push(&vm->call_stack, frame)) {
+		vm->status = VM_STACK_OVERFLOW;
+		return false;
+	}
+
+	pos->pc = lambda.start_pc;
+	pos->p = lambda.captured_p;
+	return true;
+}
+
+
+/*
+ * Charges one unit of fuel against the dispatch loop's local copy of
+ * vm->fuel_slice, running `stop` if vm_fuel_trap() says the budget or the
+ * time is up.
+ */
+#define CHARGE_FUEL(stop)                              \
+	do {                                           \
+		if (--slice < 0) {                     \
+			vm->fuel_slice = slice;        \
+			if (vm_fuel_trap(vm))          \
+				stop;                  \
+			slice = vm->fuel_slice;        \
+		}                                      \
+	} while (0)
+
+#if defined(__GNUC__) && !defined(BF_NO_COMPUTED_GOTO)
+/*
+ * Superinstructions: op sequences the threaded decoder replaces with one
+ * fused handler. The table comes from dynamic op-pair profiles of
+ * examples/mandelbrot.bf after -O3: loop back-edges (addp/subp+jt) and
+ * the multiply-loop tail (mul+clear, mul+mul) dominate.
+ * Use --superinsn-report to see how often each one fires.
+ */
+typedef enum {
+	super_addp_jt, // Move, then loop back-edge
+	super_subp_jt,
+	super_clear_addp_jt,
+	super_clear_subp_jt,
+	super_jf_mul, // Loop header straight into a multiply loop
+	super_mul_clear, // Last factor of a multiply loop and its clear
+	super_mul_clear_addp_jt, // ...ending an enclosing loop's body
+	super_mul_clear_subp_jt,
+	super_mul_mul,
+	super_count,
+	super_none = super_count
+} SuperOp;
+
+typedef struct {
+	const char *name;
+	size_t len;
+	optype_t ops[4];
+} SuperPattern;
+
+static const SuperPattern g_super_patterns[super_count] = {
+	[super_addp_jt] = { "addp+jt", 2, { op_addp, op_jt } },
+	[super_subp_jt] = { "subp+jt", 2, { op_subp, op_jt } },
+	[super_clear_addp_jt] = { "clear+addp+jt", 3,
+				  { op_clear, op_addp, op_jt } },
+	[super_clear_subp_jt] = { "clear+subp+jt", 3,
+				  { op_clear, op_subp, op_jt } },
+	[super_jf_mul] = { "jf+mul", 2, { op_jf, op_mul } },
+	[super_mul_clear] = { "mul+clear", 2, { op_mul, op_clear } },
+	[super_mul_clear_addp_jt] = { "mul+clear+addp+jt", 4,
+				      { op_mul, op_clear, op_addp, op_jt } },
+	[super_mul_clear_subp_jt] = { "mul+clear+subp+jt", 4,
+				      { op_mul, op_clear, op_subp, op_jt } },
+	[super_mul_mul] = { "mul+mul", 2, { op_mul, op_mul } },
+};
+
+/**
+ * @brief Returns the longest superinstruction starting at `pc`, or
+ * super_none.
+ * Jumps into the middle of a fused sequence stay correct: every op keeps
+ * its own entry in the threaded code, fusing only changes which handler
+ * the first op's entry points at.
+ */
+static SuperOp match_super(const OpcodeVector *code, size_t pc)
+{
+	SuperOp best = super_none;
+	for (int k = 0; k < super_count; ++k) {
+		const SuperPattern *pattern = &g_super_patterns[k];
+		if (pc + pattern->len > code->size)
+			continue;
+		if (best != super_none && g_super_patterns[best].len >= pattern->len)
+			continue;
+
+		size_t j = 0;
+		while (j < pattern->len && code->data[pc + j].op == pattern->ops[j])
+			++j;
+		if (j == pattern->len)
+			best = (SuperOp)k;
+	}
+	return best;
+}
+
+#define OP_TYPE_COUNT (op_set + 1)
+#define SUPER_REPORT_PAIRS 5
+
+static const char *const g_op_names[OP_TYPE_COUNT] = {
+	[op_add] = "add",     [op_sub] = "sub",	    [op_addp] = "addp",
+	[op_subp] = "subp",   [op_jt] = "jt",	    [op_jf] = "jf",
+	[op_in] = "in",	      [op_out] = "out",	    [op_clear] = "clear",
+	[op_def_lambda] = "def_lambda",		    [op_ret] = "ret",
+	[op_call] = "call",   [op_mul] = "mul",	    [op_scanr] = "scanr",
+	[op_scanl] = "scanl", [op_set] = "set",
+};
+
+static double percent(uint64_t part, uint64_t whole)
+{
+	return whole ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+/**
+ * @brief Prints how often each superinstruction fired, then the hottest
+ * boundaries between consecutive dispatches (last op of one handler, first
+ * op of the next): the candidates for the next superinstruction.
+ */
+static void print_super_report(const uint64_t *counts,
+			       uint64_t pairs[OP_TYPE_COUNT][OP_TYPE_COUNT],
+			       uint64_t dispatches)
+{
+	fprintf(stderr, "superinstructions (%" PRIu64 " dispatches):\n",
+		dispatches);
+	for (int k = 0; k < super_count; ++k)
+		fprintf(stderr, "  %-18s %14" PRIu64 " fired %6.2f%%\n",
+			g_super_patterns[k].name, counts[k],
+			percent(counts[k], dispatches));
+
+	fprintf(stderr, "hottest unfused pairs:\n");
+	for (int n = 0; n < SUPER_REPORT_PAIRS; ++n) {
+		int best_a = 0, best_b = 0;
+		for (int a = 0; a < OP_TYPE_COUNT; ++a)
+			for (int b = 0; b < OP_TYPE_COUNT; ++b)
+				if (pairs[a][b] > pairs[best_a][best_b]) {
+					best_a = a;
+					best_b = b;
+				}
+		if (pairs[best_a][best_b] == 0)
 			break;
-		}
+		fprintf(stderr, "  %5s+%-12s %14" PRIu64 "       %6.2f%%\n",
+			g_op_names[best_a], g_op_names[best_b],
+			pairs[best_a][best_b],
+			percent(pairs[best_a][best_b], dispatches));
+		pairs[best_a][best_b] = 0;
 	}
+}
+
+/*
+ * Tiered mode: loop iterations before the loop is handed to the background
+ * compiler. Compiling a loop takes microseconds, so this only needs to
+ * filter out loops that are too short-lived to be worth it.
+ */
+#define TIER_HOT_ITERATIONS 1000
+#define TIER_NO_LOOP UINT32_MAX
+#endif
 
-cleanup:
-	LambdaStack_free(&g_lambda_stack);
-	CallStack_free(&g_call_stack);
+#define CELL_T uint8_t
+#define CELL_FN(name) name##_8
+#include "vm_loops.inc"
+#define CELL_T uint16_t
+#define CELL_FN(name) name##_16
+#include "vm_loops.inc"
+#define CELL_T uint32_t
+#define CELL_FN(name) name##_32
+#include "vm_loops.inc"
+
+/* The switch loop for vm->cell, with the tape guard armed. */
+static void run_switch(BfVm *vm, const OpcodeVector *code)
+{
+	if (BF_TAPE_FAULTED(vm))
+		return;
+	vm_guard_enter(vm, NULL);
+	switch (vm->cell) {
+	case CELL_16:
+		switch_loop_16(vm, code);
+		break;
+	case CELL_32:
+		switch_loop_32(vm, code);
+		break;
+	default:
+		switch_loop_8(vm, code);
+		break;
+	}
+	vm_guard_leave(vm);
+}
+
+#if defined(__GNUC__) && !defined(BF_NO_COMPUTED_GOTO)
+/* The threaded loop for vm->cell. */
+static bool run_threaded(BfVm *vm, const OpcodeVector *code,
+			 const InterpreterOptions *options)
+{
+	switch (vm->cell) {
+	case CELL_16:
+		return run_threaded_16(vm, code, options);
+	case CELL_32:
+		return run_threaded_32(vm, code, options);
+	default:
+		return run_threaded_8(vm, code, options);
+	}
+}
+#endif
+
+VmStatus interpreter(BfVm *vm, const OpcodeVector *code)
+{
+	InterpreterOptions options = { false, false };
+	return interpreter_with(vm, code, &options);
+}
+
+VmStatus interpreter_with(BfVm *vm, const OpcodeVector *code,
+			  const InterpreterOptions *options)
+{
+	clock_t begin = clock();
+	VmStatus status = interpreter_execute(vm, code, options);
 
 	clock_t end = clock();
 	double time_spent = (double)(end - begin) / CLOCKS_PER_SEC;
 	printf("\ninterpreter time usage: %fs\n", time_spent);
+	return status;
+}
+
+VmStatus interpreter_execute(BfVm *vm, const OpcodeVector *code,
+			     const InterpreterOptions *options)
+{
+	BfVm_start(vm);
+
+#if defined(__GNUC__) && !defined(BF_NO_COMPUTED_GOTO)
+	if (!run_threaded(vm, code, options))
+#endif
+	{
+		if (options->superinsn_report)
+			fprintf(stderr,
+				"superinstructions: not available with switch dispatch\n");
+		if (options->tiered)
+			fprintf(stderr,
+				"tiered: not available with switch dispatch, interpreting only\n");
+		run_switch(vm, code);
+	}
+
+	return BfVm_finish(vm);
 }